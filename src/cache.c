@@ -0,0 +1,68 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "titools.h"
+
+/* Get the full path of a file in the TITools cache directory
+   ($XDG_CACHE_HOME/titools), creating the directory if necessary. */
+char * tt_cache_filename(const char *name)
+{
+  char *dir, *path;
+
+  dir = g_build_filename(g_get_user_cache_dir(), "titools", NULL);
+  g_mkdir_with_parents(dir, 0700);
+  path = g_build_filename(dir, name, NULL);
+  g_free(dir);
+  return path;
+}
+
+/* Read a cache file.  If the file does not exist or cannot be
+   parsed, an empty GKeyFile is returned. */
+GKeyFile * tt_cache_load(const char *name)
+{
+  GKeyFile *kf;
+  char *path;
+
+  kf = g_key_file_new();
+  path = tt_cache_filename(name);
+  g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL);
+  g_free(path);
+  return kf;
+}
+
+/* Write a cache file.  Failure is not an error (the information will
+   simply be looked up again next time.) */
+void tt_cache_save(const char *name, GKeyFile *kf)
+{
+  char *path, *data;
+  gsize length;
+
+  path = tt_cache_filename(name);
+  data = g_key_file_to_data(kf, &length, NULL);
+  if (data)
+    g_file_set_contents(path, data, length, NULL);
+  g_free(data);
+  g_free(path);
+}
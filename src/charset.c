@@ -0,0 +1,242 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Conversion of characters to the calculators' character sets, and
+   to keypresses.
+
+   libticonv only provides tables from TI characters to Unicode.  The
+   reverse tables are built from them the first time each character
+   set is needed, and kept for the life of the program.  Models not
+   listed here use UTF-8 for variable names. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "titools.h"
+
+typedef struct _CharPair {
+  unsigned long ucs;		/* Unicode (UTF-16 pairs as hi << 16 | lo) */
+  guint8 ti;
+} CharPair;
+
+typedef struct _Charmap {
+  const unsigned long *charset;	/* TI -> Unicode, from libticonv */
+  guint8 ascii[128];		/* ASCII -> TI (0 if none) */
+  CharPair pairs[255];		/* all characters, sorted by Unicode */
+  int n;
+} Charmap;
+
+enum { CS_TI73, CS_TI82, CS_TI83, CS_TI83P, CS_TI85, CS_TI86, CS_TI9X,
+       N_CHARSETS };
+
+static Charmap charmaps[N_CHARSETS];
+static gsize charmap_ready[N_CHARSETS];
+
+static int compare_pairs(const void *a, const void *b)
+{
+  const CharPair *pa = a, *pb = b;
+
+  if (pa->ucs != pb->ucs)
+    return (pa->ucs < pb->ucs ? -1 : 1);
+  else
+    return (int) pa->ti - (int) pb->ti;
+}
+
+static void charmap_build(Charmap *map, const unsigned long *cs)
+{
+  int i;
+
+  map->charset = cs;
+  map->n = 0;
+  memset(map->ascii, 0, sizeof(map->ascii));
+
+  for (i = 1; i < 256; i++) {
+    map->pairs[map->n].ucs = cs[i];
+    map->pairs[map->n].ti = i;
+    map->n++;
+  }
+
+  qsort(map->pairs, map->n, sizeof(CharPair), &compare_pairs);
+
+  /* where a character appears more than once, prefer its own code
+     point, then the lowest code */
+  for (i = map->n - 1; i >= 0; i--)
+    if (map->pairs[i].ucs < 128 && map->pairs[i].ucs > 0)
+      map->ascii[map->pairs[i].ucs] = map->pairs[i].ti;
+  for (i = 1; i < 128; i++)
+    if (cs[i] == (unsigned long) i)
+      map->ascii[i] = i;
+}
+
+static const Charmap * get_charmap(CalcModel model)
+{
+  const unsigned long *cs;
+  int i;
+
+  switch (model) {
+  case CALC_TI73: i = CS_TI73; cs = ti73_charset; break;
+  case CALC_TI82: i = CS_TI82; cs = ti82_charset; break;
+  case CALC_TI83: i = CS_TI83; cs = ti83_charset; break;
+  case CALC_TI83P:
+  case CALC_TI84P: i = CS_TI83P; cs = ti83p_charset; break;
+  case CALC_TI85: i = CS_TI85; cs = ti85_charset; break;
+  case CALC_TI86: i = CS_TI86; cs = ti86_charset; break;
+  case CALC_TI89:
+  case CALC_TI92:
+  case CALC_TI92P:
+  case CALC_V200: i = CS_TI9X; cs = ti9x_charset; break;
+  default:
+    return NULL;
+  }
+
+  if (g_once_init_enter(&charmap_ready[i])) {
+    charmap_build(&charmaps[i], cs);
+    g_once_init_leave(&charmap_ready[i], 1);
+  }
+
+  return &charmaps[i];
+}
+
+static int charmap_lookup(const Charmap *map, unsigned long c)
+{
+  int lo = 0, hi = map->n;
+
+  if (c < 128)
+    return (map->ascii[c] ? map->ascii[c] : -1);
+  if (c < 256 && map->charset[c] == c)
+    return c;
+
+  /* find the first pair for this character */
+  while (lo < hi) {
+    if (map->pairs[(lo + hi) / 2].ucs < c)
+      lo = (lo + hi) / 2 + 1;
+    else
+      hi = (lo + hi) / 2;
+  }
+
+  if (lo < map->n && map->pairs[lo].ucs == c)
+    return map->pairs[lo].ti;
+  else
+    return -1;
+}
+
+/* Convert a Unicode character to the calculator's character set.
+   Returns -1 if the calculator has no such character, or does not
+   use a single-byte character set. */
+int tt_unichar_to_ti(CalcModel model, gunichar c)
+{
+  const Charmap *map;
+
+  if (!(map = get_charmap(model)))
+    return -1;
+
+  /* the tables store characters outside the BMP as UTF-16 pairs */
+  if (c >= 0x10000)
+    return charmap_lookup(map, ((0xd800UL + ((c - 0x10000) >> 10)) << 16)
+			  | (0xdc00UL + ((c - 0x10000) & 0x3ff)));
+  else
+    return charmap_lookup(map, c);
+}
+
+/* Convert a UTF-8 string into the encoding used for variable names
+   (the calculator's character set, or UTF-8 for models that use it.)
+   Characters that cannot be represented are replaced by '?'. */
+char * tt_utf8_to_ti(CalcModel model, const char *str)
+{
+  const Charmap *map;
+  const char *p, *q;
+  GString *out;
+  int c;
+
+  if (!(map = get_charmap(model)))
+    return g_strdup(str);
+
+  out = g_string_sized_new(strlen(str));
+  p = str;
+
+  while (*p) {
+    /* copy runs of characters that are the same in both sets */
+    for (q = p; *q && !(*q & 0x80) && map->ascii[(int) *q] == *q; q++)
+      ;
+    if (q != p) {
+      g_string_append_len(out, p, q - p);
+      p = q;
+      continue;
+    }
+
+    c = tt_unichar_to_ti(model, g_utf8_get_char(p));
+    g_string_append_c(out, (c > 0 ? c : '?'));
+    p = g_utf8_next_char(p);
+  }
+
+  return g_string_free(out, FALSE);
+}
+
+enum { KEYS_73, KEYS_83, KEYS_83P, KEYS_86, KEYS_89, N_KEYMAPS };
+
+static guint16 keymaps[N_KEYMAPS][256];
+static gsize keymap_ready[N_KEYMAPS];
+
+/* Get the keypress that types the given character (in the
+   calculator's character set.)  Returns 0 if there is none. */
+guint16 tt_ti_to_key(CalcModel model, int c)
+{
+  const CalcKey *(*keys)(uint8_t);
+  const CalcKey *ck;
+  int i, j;
+
+  if (c <= 0 || c > 255)
+    return 0;
+
+  if (model == CALC_TI73) {
+    i = KEYS_73; keys = &ticalcs_keys_73;
+  }
+  else if (model == CALC_TI82 || model == CALC_TI83) {
+    i = KEYS_83; keys = &ticalcs_keys_83;
+  }
+  else if (model == CALC_TI83P || model == CALC_TI84P
+	   || model == CALC_TI84P_USB) {
+    i = KEYS_83P; keys = &ticalcs_keys_83p;
+  }
+  else if (model == CALC_TI86) {
+    i = KEYS_86; keys = &ticalcs_keys_86;
+  }
+  else if (model == CALC_TI89 || model == CALC_TI89T_USB
+	   || model == CALC_TI89T || model == CALC_TI92
+	   || model == CALC_TI92P || model == CALC_V200) {
+    i = KEYS_89; keys = &ticalcs_keys_89;
+  }
+  else {
+    return 0;
+  }
+
+  if (g_once_init_enter(&keymap_ready[i])) {
+    for (j = 1; j < 256; j++) {
+      ck = (*keys)(j);
+      keymaps[i][j] = (ck ? ck->normal.value : 0);
+    }
+    g_once_init_leave(&keymap_ready[i], 1);
+  }
+
+  return keymaps[i][c];
+}
@@ -25,18 +25,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include <locale.h>
+#include <errno.h>
+#include <glib/gstdio.h>
 #include "titools.h"
 
-#define EXIT_INVALID_OPTIONS 15
-#define EXIT_INTERNAL_ERROR 14
-#define EXIT_NO_CABLE_FOUND 13
-#define EXIT_CABLE_FAILED 12
-#define EXIT_NO_CALC_FOUND 11
-#define EXIT_CALC_UNSUPPORTED 10
+#if defined(HAVE_FORK) && defined(HAVE_POLL_H) && defined(HAVE_SYS_WAIT_H)
+# define MULTI_DEVICE 1
+# include <unistd.h>
+# include <poll.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <fcntl.h>
+#endif
+
+static TTSession *session = NULL;
+static int link_mode = TT_LINK_AUTO;
+static int (*device_setup)(TTSession *s) = NULL;
+static int libraries_open = 0;
+
+static GKeyFile *cache = NULL;	/* cached link settings */
+
+/* Select how tt_init() should connect (see TT_LINK_* in titools.h.)
+   Must be called before tt_init(). */
+void tt_set_link_mode(int mode)
+{
+  link_mode = mode;
+}
+
+static void open_libraries()
+{
+  if (!libraries_open) {
+    ticables_library_init();
+    tifiles_library_init();
+    ticalcs_library_init();
+    libraries_open = 1;
+  }
+}
+
+static void close_libraries()
+{
+  if (libraries_open) {
+    ticalcs_library_exit();
+    tifiles_library_exit();
+    ticables_library_exit();
+    libraries_open = 0;
+  }
+}
 
-CalcModel calc_model;
-CableHandle *cable_handle;
-CalcHandle *calc_handle;
+/* Set a function to be called once, before starting a process for
+   each device (--all-devices), for work (such as reading input
+   files) that all of the devices can share.  It is called after the
+   options are parsed, and before the link is opened, so S->model may
+   not yet be known.  If it returns nonzero, the program exits with
+   that status.  Must be called before tt_init(). */
+void tt_set_device_setup(int (*setup)(TTSession *s))
+{
+  device_setup = setup;
+}
 
 /* Convert cable name to a CableModel.  ticables_string_to_model()
    uses names like "BlackLink" and "SilverLink"; we also accept
@@ -201,7 +246,12 @@ static char *cable_name = NULL;
 static char *calc_name = NULL;
 static int timeout = DFLT_TIMEOUT * 100;
 static gboolean verbose = FALSE;
+static gboolean refresh = FALSE;
 static gboolean showversion = FALSE;
+static gboolean all_devices = FALSE;
+static char *device_list = NULL;
+static char *device_label = NULL;
+static char *progress_name = NULL;
 
 static const GOptionEntry comm_options[] =
   {{ "cable", 'c', 0, G_OPTION_ARG_STRING, &cable_name,
@@ -210,12 +260,53 @@ static const GOptionEntry comm_options[] =
      "Specify calculator model", "MODEL" },
    { "timeout", 'T', 0, G_OPTION_ARG_INT, &timeout,
      "Time out after N milliseconds", "N" },
+   { "all-devices", 0, 0, G_OPTION_ARG_NONE, &all_devices,
+     "Use every connected USB calculator", NULL },
+   { "device", 0, 0, G_OPTION_ARG_STRING, &device_list,
+     "Use the given USB devices", "N,M,..." },
+   { "progress", 0, 0, G_OPTION_ARG_STRING, &progress_name,
+     "Show transfer progress (auto, none, bar, or json)", "MODE" },
+   { "refresh", 0, 0, G_OPTION_ARG_NONE, &refresh,
+     "Read the directory listing again, ignoring the cache", NULL },
    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
      "Show details of link operations", NULL },
    { "version", 0, 0, G_OPTION_ARG_NONE, &showversion,
      "Display program version info", NULL },
    { 0, 0, 0, 0, 0, 0, 0 }};
 
+/* Hand the link of session S over to a child process (see
+   multicall.c): close it, and shut down the libraries, so that the
+   child opens the link itself and no libusb state is shared across
+   fork().  The child's tt_init() (in TT_LINK_SERVED mode) opens the
+   link again; tt_link_reclaim() does so in this process, once the
+   child has finished. */
+void tt_link_release(TTSession *s)
+{
+  tt_session_detach(s);
+  close_libraries();
+}
+
+/* Open the link again after tt_link_release(), and check that the
+   calculator answers.  Returns 0, or an error code. */
+int tt_link_reclaim(TTSession *s)
+{
+  int e;
+
+  open_libraries();
+  if ((e = tt_session_attach(s)))
+    return e;
+
+  ticables_options_set_timeout(s->cable, (timeout + 99) / 100);
+  return ticalcs_calc_isready(s->calc);
+}
+
+/* Use every connected device, as if --all-devices were given (for
+   options of a program's own that imply it) */
+void tt_use_all_devices()
+{
+  all_devices = TRUE;
+}
+
 static void log_output(const gchar *domain, GLogLevelFlags level,
 		       const gchar *message,
 		       G_GNUC_UNUSED gpointer data)
@@ -234,140 +325,199 @@ static void log_output(const gchar *domain, GLogLevelFlags level,
   g_printerr("%s\n", message);
 }
 
-/* General initialization for all of the titools.  Parse the
-   command-line options, and open a link cable (global cable_handle),
-   and a calculator handle (global calc_handle).
+/* Check that the calculator supports REQUIRED_FEATURES */
+static void check_features(CalcFeatures required_features)
+{
+  CalcFeatures feats;
 
-   ARGC and ARGV are the arguments to main().
+  feats = ticalcs_calc_features(session->calc);
+  if (required_features & ~feats) {
+    fprintf(stderr, "%s: calculator model %s does not support this operation\n",
+	    g_get_prgname(), ticalcs_model_to_string(session->model));
+    tt_exit();
+    exit(EXIT_CALC_UNSUPPORTED);
+  }
+}
 
-   APP_OPTIONS is an array of GOptionEntries describing app-specific
-   command-line options.  If "rest" arguments are allowed, APP_OPTIONS
-   must contain a G_OPTION_REMAINING entry.  MIN_FN is the minimum
-   allowed number of "rest" arguments.
+/* Check that the calculator is ready to communicate */
+static void check_ready()
+{
+  int e;
 
-   REQUIRED_FEATURES is a bit mask of calculator features that are
-   required in order for the tool to be useful (e.g., OPS_DIRLIST must
-   be available in order to use 'tils'.)
+  if ((e = ticalcs_calc_isready(session->calc))) {
+    tt_print_error(e, "calculator not ready");
+    tt_exit();
+    exit(EXIT_CABLE_FAILED);
+  }
+}
 
-   SILENT_PROBE is 1 if it's OK to probe for the calculator type
-   without asking.
- */
-void tt_init(int argc, char **argv, const GOptionEntry *app_options,
-	     int min_fn, CalcFeatures required_features, int silent_probe)
+/* When running on a shared link (titoolsd or titools batch), check
+   that any -c or -m option (or TITOOLS_CABLE or TITOOLS_CALC) agrees
+   with the link being served, rather than silently using another
+   calculator. */
+static void check_served_link()
 {
-  GOptionContext *ctx;
-  GError *err = NULL;
-  CableModel cable_model = CABLE_NUL;
-  int port_number = 0;
-  int *usbpids = NULL, nusbpids;
-  CableHandle *tmpcable;
-  int probe_status;
-  CalcFeatures feats;
-  const char *v;
+  CalcModel model = CALC_NONE;
   char *cname, *cport, *p;
-  char ***a;
-  int i, j, e;
+  int port;
 
-  calc_model = CALC_NONE;
-  cable_handle = NULL;
-  calc_handle = NULL;
+  if (calc_name && g_ascii_strcasecmp(calc_name, "auto")
+      && g_ascii_strcasecmp(calc_name, "dwim")
+      && !(model = calc_name_to_model(calc_name))) {
+    g_printerr("%s: unknown model '%s'\n", g_get_prgname(), calc_name);
+    tt_exit();
+    exit(EXIT_INVALID_OPTIONS);
+  }
 
-  setlocale(LC_ALL, "");
+  /* (as in open_link) */
+  if (session->cable_model == CABLE_USB) {
+    if (model == CALC_TI83P || model == CALC_TI84P)
+      model = CALC_TI84P_USB;
+    else if (model == CALC_TI89)
+      model = CALC_TI89T_USB;
+  }
 
-  if ((v = g_getenv("TITOOLS_CABLE")))
-    cable_name = g_strdup(v);
+  if (model && model != session->model) {
+    g_printerr("%s: -m %s does not match the shared link (%s)\n",
+	       g_get_prgname(), calc_name,
+	       ticalcs_model_to_string(session->model));
+    tt_exit();
+    exit(EXIT_INVALID_OPTIONS);
+  }
 
-  if ((v = g_getenv("TITOOLS_CALC")))
-    calc_name = g_strdup(v);
+  if (!cable_name || !g_ascii_strcasecmp(cable_name, "auto"))
+    return;
 
-  if ((v = g_getenv("TITOOLS_TIMEOUT"))) {
-    i = strtol(v, &p, 10);
-    if (i > 0)
-      timeout = i;
+  cname = g_strdup(cable_name);
+  if ((cport = strchr(cname, ':')))
+    *cport++ = 0;
+
+  port = session->port;
+  if (cport && g_ascii_strcasecmp(cport, "auto")) {
+    port = strtol(cport, &p, 10);
+    if (p == cport || *p)
+      port = -1;
   }
 
-  ctx = g_option_context_new("");
+  if (cable_name_to_model(cname) != session->cable_model
+      || port != session->port) {
+    g_printerr("%s: -c %s does not match the shared link (%s:%d)\n",
+	       g_get_prgname(), cable_name,
+	       ticables_model_to_string(session->cable_model),
+	       session->port);
+    g_free(cname);
+    tt_exit();
+    exit(EXIT_INVALID_OPTIONS);
+  }
 
-  if (app_options)
-    g_option_context_add_main_entries(ctx, app_options, NULL);
+  g_free(cname);
+}
 
-  g_option_context_add_main_entries(ctx, comm_options, NULL);
+#define PROBE_PORTS 4
 
-  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
-    g_printerr("%s: %s\n", g_get_prgname(), err->message);
-    g_error_free(err);
-    print_usage(ctx);
-  }
+/* A port being probed by probe_port() */
+typedef struct {
+  CableModel cable_model;
+  int port;
+  int found;
+  gint64 latency;		/* microseconds */
+} ProbeJob;
 
-  if (showversion) {
-    g_print("%s (%s)\n"
-	    "Copyright (C) 2010 Benjamin Moody\n"
-	    "This program is free software. "
-	    " There is NO WARRANTY of any kind.\n"
-	    "Report bugs to %s.\n",
-	    g_get_prgname(), PACKAGE_STRING, PACKAGE_BUGREPORT);
-    tt_exit();
-    exit(0);
+static gpointer probe_worker(gpointer data)
+{
+  ProbeJob *job = data;
+  CableHandle *tmpcable;
+  int probe_status = 0;
+  gint64 start;
+
+  start = g_get_monotonic_time();
+  if ((tmpcable = ticables_handle_new(job->cable_model, job->port))) {
+    ticables_options_set_timeout(tmpcable, (timeout + 99) / 100);
+    job->found = (!ticables_cable_probe(tmpcable, &probe_status)
+		  && probe_status);
+    ticables_handle_del(tmpcable);
   }
+  job->latency = g_get_monotonic_time() - start;
+  return NULL;
+}
 
-  /* check for unparsed options/filenames */
-  if (argc != 1)
-    print_usage(ctx);
+/* Search for a cable of the given type on ports 1 through 4.  All
+   ports are probed at once, each giving up after the link timeout;
+   every probe is finished before this returns, so none is still
+   using a port when the link is opened.  (There is no overall
+   deadline: a probe cannot be stopped early, so one whose driver
+   ignores the timeout holds up the rest.)  Returns the lowest port
+   number on which a cable was found, or 0 if none was. */
+static int probe_port(CableModel cable_model)
+{
+  ProbeJob jobs[PROBE_PORTS];
+  GThread *threads[PROBE_PORTS];
+  int i, port = 0;
+
+  for (i = 0; i < PROBE_PORTS; i++) {
+    jobs[i].cable_model = cable_model;
+    jobs[i].port = i + 1;
+    jobs[i].found = 0;
+    jobs[i].latency = 0;
+
+    /* (if a thread cannot be created, probe this port directly) */
+    if (!(threads[i] = g_thread_try_new("probe", &probe_worker,
+					&jobs[i], NULL)))
+      probe_worker(&jobs[i]);
+  }
 
-  /* if "rest" arguments are allowed, check that the number is OK */
-  for (i = 0; app_options && app_options[i].long_name; i++) {
-    if (!strcmp(app_options[i].long_name, G_OPTION_REMAINING)) {
-      a = app_options[i].arg_data;
-      if (a && *a) {
-	for (j = 0; (*a)[j]; j++)
-	  ;
-      }
-      else {
-	j = 0;
-      }
+  for (i = 0; i < PROBE_PORTS; i++) {
+    if (threads[i])
+      g_thread_join(threads[i]);
+    if (jobs[i].found && !port)
+      port = i + 1;
+  }
 
-      if (j < min_fn)
-	print_usage(ctx);
+  if (verbose) {
+    for (i = 0; i < PROBE_PORTS; i++) {
+      if (jobs[i].found)
+	g_printerr(" [titools] probe %s:%d: found (%d ms)\n",
+		   ticables_model_to_string(cable_model), i + 1,
+		   (int) (jobs[i].latency / 1000));
+      else if (jobs[i].latency >= (gint64) timeout * 1000)
+	g_printerr(" [titools] probe %s:%d: no answer after %d ms\n",
+		   ticables_model_to_string(cable_model), i + 1,
+		   (int) (jobs[i].latency / 1000));
+      else
+	g_printerr(" [titools] probe %s:%d: not found (%d ms)\n",
+		   ticables_model_to_string(cable_model), i + 1,
+		   (int) (jobs[i].latency / 1000));
     }
   }
 
-  g_option_context_free(ctx);
+  return port;
+}
 
-  g_log_set_handler("ticables", G_LOG_LEVEL_MASK, &log_output, 0);
-  g_log_set_handler("tifiles", G_LOG_LEVEL_MASK, &log_output, 0);
-  g_log_set_handler("ticalcs", G_LOG_LEVEL_MASK, &log_output, 0);
-  g_log_set_handler("calccables", G_LOG_LEVEL_MASK, &log_output, 0);
-  g_log_set_handler("calcfiles", G_LOG_LEVEL_MASK, &log_output, 0);
-  g_log_set_handler("calcprotocols", G_LOG_LEVEL_MASK, &log_output, 0);
+/* Open the link cable and calculator handle for the process's
+   session.  MODEL is the calculator model requested by
+   the user, or CALC_NONE to probe.
 
-  ticables_library_init();
-  tifiles_library_init();
-  ticalcs_library_init();
+   If USE_CACHE is set, the cable port and calculator model found by
+   a previous run (saved in the "links" cache file) are used rather
+   than probing again.  If the calculator does not respond using those
+   settings, they are removed from the cache and -1 is returned.
 
-  /* Set calculator model based on options, if possible */
+   Other errors are fatal. */
+static int open_link(CalcModel model, CalcFeatures required_features,
+		     int use_cache)
+{
+  CableModel cable_model = CABLE_NUL;
+  int port_number = 0;
+  int *usbpids = NULL, nusbpids;
+  int from_cache = 0, cache_dirty = 0;
+  char *port_key = NULL, *mname;
+  char *cname, *cport, *p;
+  int i, e;
 
-  if (!calc_name || !g_ascii_strcasecmp(calc_name, "dwim")) {
-    /* try to guess calc model based on filenames */
-    calc_model = guess_model_from_options(app_options);
+  if (!cache)
+    cache = tt_cache_load("links");
 
-    if (!calc_model && !silent_probe) {
-      g_printerr("%s: unable to determine calculator type\n"
-		 "(use -m MODEL, or -m 'auto' to probe)\n",
-		 g_get_prgname());
-      tt_exit();
-      exit(EXIT_INVALID_OPTIONS);
-    }
-  }
-  else if (calc_name && g_ascii_strcasecmp(calc_name, "auto")) {
-    /* user set model explicitly */
-    calc_model = calc_name_to_model(calc_name);
-    if (!calc_model) {
-      g_printerr("%s: unknown model '%s'\n",
-		 g_get_prgname(), calc_name);
-      tt_exit();
-      exit(EXIT_INVALID_OPTIONS);
-    }
-  }
+  session->model = model;
 
   /* Set cable model and port number */
 
@@ -423,23 +573,23 @@ void tt_init(int argc, char **argv, const GOptionEntry *app_options,
       /* probe for port (except for TiEmu virtual link, which probes
 	 automatically when port number is set to 0) */
 
-      for (i = 1; i <= 4; i++) {
-	tmpcable = ticables_handle_new(cable_model, i);
-	if (tmpcable
-	    && !ticables_cable_probe(tmpcable, &probe_status)
-	    && probe_status) {
-	  ticables_handle_del(tmpcable);
-	  port_number = i;
-	  break;
-	}
-	ticables_handle_del(tmpcable);
+      port_key = g_strdup_printf("%s:auto",
+				 ticables_model_to_string(cable_model));
+      if (use_cache
+	  && (port_number = g_key_file_get_integer(cache, port_key,
+						   "port", NULL)) > 0) {
+	from_cache = 1;
       }
-
-      if (i > 4) {
+      else if ((port_number = probe_port(cable_model))) {
+	g_key_file_set_integer(cache, port_key, "port", port_number);
+	cache_dirty = 1;
+      }
+      else {
 	g_printerr("%s: no %s cable detected\n",
 		   g_get_prgname(),
 		   ticables_model_to_string(cable_model));
 	g_free(cname);
+	g_free(port_key);
 	tt_exit();
 	exit(EXIT_NO_CABLE_FOUND);
       }
@@ -451,12 +601,12 @@ void tt_init(int argc, char **argv, const GOptionEntry *app_options,
     /* auto-detect cable */
 
     if (!ticables_get_usb_devices(&usbpids, &nusbpids)) {
-      if (calc_model) {
+      if (session->model) {
 	/* Calc model known - if user has specified a USB calculator
 	   and we see that device plugged in, use it; otherwise, use a
 	   SilverLink if one is plugged in */
 	for (i = 0; i < nusbpids; i++) {
-	  if (model_matches_pid(calc_model, usbpids[i])) {
+	  if (model_matches_pid(session->model, usbpids[i])) {
 	    cable_model = CABLE_USB;
 	    port_number = i + 1;
 	    break;
@@ -464,9 +614,9 @@ void tt_init(int argc, char **argv, const GOptionEntry *app_options,
 	}
 
 	if (!cable_model
-	    && calc_model != CALC_TI84P_USB
-	    && calc_model != CALC_TI89T_USB
-	    && calc_model != CALC_NSPIRE) {
+	    && session->model != CALC_TI84P_USB
+	    && session->model != CALC_TI89T_USB
+	    && session->model != CALC_NSPIRE) {
 	  for (i = 0; i < nusbpids; i++) {
 	    if (usbpids[i] == PID_TIGLUSB) {
 	      cable_model = CABLE_SLV;
@@ -501,45 +651,56 @@ void tt_init(int argc, char **argv, const GOptionEntry *app_options,
 
   /* Switch to USB protocol if needed */
   if (cable_model == CABLE_USB) {
-    if (calc_model == CALC_TI83P || calc_model == CALC_TI84P)
-      calc_model = CALC_TI84P_USB;
-    else if (calc_model == CALC_TI89)
-      calc_model = CALC_TI89T_USB;
+    if (session->model == CALC_TI83P || session->model == CALC_TI84P)
+      session->model = CALC_TI84P_USB;
+    else if (session->model == CALC_TI89)
+      session->model = CALC_TI89T_USB;
   }
 
+  g_free(session->link_key);
+  session->link_key = tt_link_key(cable_model, port_number);
+
   /* Probe for calculator model, if still unknown (we only get to this
      point if SILENT_PROBE is set or user requested probing with -m
      auto.)  If -m auto is set, do a more thorough probe. */
-  if (!calc_model) {
-    if ((e = ticalcs_probe(cable_model, port_number, &calc_model,
+  if (!session->model && use_cache
+      && (mname = g_key_file_get_string(cache, session->link_key,
+					"model", NULL))) {
+    session->model = ticalcs_string_to_model(mname);
+    g_free(mname);
+    if (session->model)
+      from_cache = 1;
+  }
+
+  if (!session->model) {
+    if ((e = ticalcs_probe(cable_model, port_number, &session->model,
 			   (calc_name ? 1 : 0)))) {
       tt_print_error(e, "unable to detect calculator");
+      g_free(port_key);
       tt_exit();
       exit(EXIT_NO_CALC_FOUND);
     }
+
+    g_key_file_set_string(cache, session->link_key, "model",
+			  ticalcs_model_to_string(session->model));
+    cache_dirty = 1;
   }
 
   /* Create calc handle */
-  calc_handle = ticalcs_handle_new(calc_model);
-  if (!calc_handle) {
+  session->calc = ticalcs_handle_new(session->model);
+  if (!session->calc) {
     g_printerr("%s: unable to initialize calc %s\n",
-	       g_get_prgname(), ticalcs_model_to_string(calc_model));
+	       g_get_prgname(), ticalcs_model_to_string(session->model));
     tt_exit();
     exit(EXIT_INTERNAL_ERROR);
   }
 
   /* Check for required features */
-  feats = ticalcs_calc_features(calc_handle);
-  if (required_features & ~feats) {
-    fprintf(stderr, "%s: calculator model %s does not support this operation\n",
-	    g_get_prgname(), ticalcs_model_to_string(calc_model));
-    tt_exit();
-    exit(EXIT_CALC_UNSUPPORTED);
-  }
+  check_features(required_features);
 
   /* Create cable handle */
-  cable_handle = ticables_handle_new(cable_model, port_number);
-  if (!cable_handle) {
+  session->cable = ticables_handle_new(cable_model, port_number);
+  if (!session->cable) {
     fprintf(stderr, "%s: unable to initialize cable %s (port %d)\n",
 	    g_get_prgname(), ticables_model_to_string(cable_model),
 	    port_number);
@@ -547,86 +708,586 @@ void tt_init(int argc, char **argv, const GOptionEntry *app_options,
     exit(EXIT_CABLE_FAILED);
   }
 
-  ticables_options_set_timeout(cable_handle, (timeout + 99) / 100);
+  ticables_options_set_timeout(session->cable, (timeout + 99) / 100);
+
+  /* Attach and open cable, and check if calc is ready.  If either
+     fails when using cached settings, forget them and let the caller
+     try again. */
+  if (from_cache
+      && (ticalcs_cable_attach(session->calc, session->cable)
+	  || ticalcs_calc_isready(session->calc))) {
+    g_key_file_remove_group(cache, session->link_key, NULL);
+    if (port_key)
+      g_key_file_remove_group(cache, port_key, NULL);
+    tt_cache_save("links", cache);
+    g_free(port_key);
+
+    ticalcs_handle_del(session->calc);
+    session->calc = NULL;
+    ticables_handle_del(session->cable);
+    session->cable = NULL;
+    return -1;
+  }
 
-  /* Attach and open cable */
-  if ((e = ticalcs_cable_attach(calc_handle, cable_handle))) {
-    tt_print_error(e, "unable to connect to calculator");
-    tt_exit();
-    exit(EXIT_CABLE_FAILED);
+  g_free(port_key);
+
+  if (!from_cache) {
+    if ((e = ticalcs_cable_attach(session->calc, session->cable))) {
+      tt_print_error(e, "unable to connect to calculator");
+      tt_exit();
+      exit(EXIT_CABLE_FAILED);
+    }
+
+    check_ready();
   }
 
-  /*Check if calc is ready */
-  if ((e = ticalcs_calc_isready(calc_handle))) {
-    tt_print_error(e, "calculator not ready");
-    tt_exit();
-    exit(EXIT_CABLE_FAILED);
+  if (cache_dirty)
+    tt_cache_save("links", cache);
+
+  return 0;
+}
+
+/* Choose the USB devices to be used for --all-devices or --device.
+   Returns the number of devices found, and stores their port numbers
+   in *PORTS and product IDs in *PIDS. */
+static int select_devices(int **ports, int **pids)
+{
+  int *usbpids = NULL, nusbpids = 0;
+  char **specs;
+  int i, j, n = 0, k;
+  char *p;
+
+  if (ticables_get_usb_devices(&usbpids, &nusbpids))
+    nusbpids = 0;
+
+  *ports = g_new(int, nusbpids + 1);
+  *pids = g_new(int, nusbpids + 1);
+
+  if (device_list) {
+    specs = g_strsplit(device_list, ",", -1);
+    for (i = 0; specs[i]; i++) {
+      k = strtol(specs[i], &p, 10);
+      if (p == specs[i] || *p || k < 1 || k > nusbpids) {
+	g_printerr("%s: no such device '%s'\n", g_get_prgname(), specs[i]);
+	g_strfreev(specs);
+	if (usbpids)
+	  free(usbpids);
+	tt_exit();
+	exit(EXIT_NO_CABLE_FOUND);
+      }
+
+      /* (two processes cannot share one device) */
+      for (j = 0; j < n && (*ports)[j] != k; j++)
+	;
+      if (j < n) {
+	g_printerr("%s: device %d given more than once\n",
+		   g_get_prgname(), k);
+	g_strfreev(specs);
+	if (usbpids)
+	  free(usbpids);
+	tt_exit();
+	exit(EXIT_INVALID_OPTIONS);
+      }
+
+      *ports = g_renew(int, *ports, n + 1);
+      *pids = g_renew(int, *pids, n + 1);
+      (*ports)[n] = k;
+      (*pids)[n] = usbpids[k - 1];
+      n++;
+    }
+    g_strfreev(specs);
   }
+  else {
+    /* if the calc model is known, use only devices that might be
+       that model (as when auto-detecting a single cable) */
+    for (i = 0; i < nusbpids; i++) {
+      if (!session->model
+	  || model_matches_pid(session->model, usbpids[i])
+	  || (usbpids[i] == PID_TIGLUSB
+	      && session->model != CALC_TI84P_USB
+	      && session->model != CALC_TI89T_USB
+	      && session->model != CALC_NSPIRE)) {
+	(*ports)[n] = i + 1;
+	(*pids)[n] = usbpids[i];
+	n++;
+      }
+    }
+  }
+
+  if (usbpids)
+    free(usbpids);
+  return n;
 }
 
-void tt_exit()
+#ifdef MULTI_DEVICE
+
+/* Output from one device's child process */
+typedef struct {
+  int fd;			/* read end of pipe, or -1 at EOF */
+  FILE *dest;			/* stdout or stderr */
+  const char *label;
+  GString *line;		/* incomplete line */
+} DeviceOutput;
+
+/* Copy output from a child process, prefixing each line with the
+   device label.  Returns 0 at end of file. */
+static int relay_output(DeviceOutput *out)
 {
-  if (calc_handle) {
-    ticalcs_handle_del(calc_handle); /* detaches + closes cable if
-					necessary */
-    calc_handle = NULL;
+  char buf[1024], *nl;
+  ssize_t k;
+
+  do
+    k = read(out->fd, buf, sizeof(buf));
+  while (k < 0 && errno == EINTR);
+
+  if (k > 0)
+    g_string_append_len(out->line, buf, k);
+
+  while ((nl = memchr(out->line->str, '\n', out->line->len))) {
+    fprintf(out->dest, "[%s] %.*s\n", out->label,
+	    (int) (nl - out->line->str), out->line->str);
+    g_string_erase(out->line, 0, nl + 1 - out->line->str);
   }
 
-  if (cable_handle) {
-    ticables_handle_del(cable_handle);
-    cable_handle = NULL;
+  if (k > 0)
+    return 1;
+
+  if (out->line->len > 0) {
+    fprintf(out->dest, "[%s] %s\n", out->label, out->line->str);
+    g_string_truncate(out->line, 0);
   }
+  fflush(out->dest);
+  close(out->fd);
+  out->fd = -1;
+  return 0;
+}
 
+/* Run the program once per device, in parallel.  In each child
+   process, this function returns (with cable_name set to the chosen
+   device) and initialization continues as usual; the parent collects
+   the children's output and exits when all are finished.  The exit
+   status is that of the first device that failed, if any. */
+static void fork_devices(const int *ports, const int *pids, int n)
+{
+  DeviceOutput *outs;
+  struct pollfd *pfds;
+  char **labels;
+  pid_t *children;
+  int fds[2][2];
+  int i, j, nopen, e, status = 0;
+
+  /* libusb must not be shared across fork(); reinitialize in each
+     child */
   ticalcs_library_exit();
   tifiles_library_exit();
   ticables_library_exit();
+
+  fflush(stdout);
+  fflush(stderr);
+
+  outs = g_new0(DeviceOutput, 2 * n);
+  pfds = g_new0(struct pollfd, 2 * n);
+  labels = g_new0(char *, n + 1);
+  children = g_new0(pid_t, n);
+
+  for (i = 0; i < n; i++) {
+    labels[i] = g_strdup_printf("%s%d", (pids[i] == PID_TIGLUSB
+					 ? "slv" : "usb"), ports[i]);
+
+    if (pipe(fds[0]) || pipe(fds[1])
+	|| (children[i] = fork()) < 0) {
+      g_printerr("%s: unable to start process for %s: %s\n",
+		 g_get_prgname(), labels[i], g_strerror(errno));
+      exit(EXIT_INTERNAL_ERROR);
+    }
+
+    if (children[i] == 0) {
+      for (j = 0; j < 2 * i; j++)
+	close(outs[j].fd);
+      close(fds[0][0]);
+      close(fds[1][0]);
+      dup2(fds[0][1], 1);
+      dup2(fds[1][1], 2);
+      close(fds[0][1]);
+      close(fds[1][1]);
+
+      /* the devices' processes can't all ask questions at once, and
+	 their questions would not be seen until a whole line had been
+	 written; anything they read from stdin finds end of file */
+      if ((j = open("/dev/null", O_RDONLY)) >= 0) {
+	dup2(j, 0);
+	close(j);
+      }
+
+      g_free(cable_name);
+      cable_name = g_strdup_printf("%s:%d", (pids[i] == PID_TIGLUSB
+					     ? "slv" : "usb"), ports[i]);
+      device_label = labels[i];
+
+      ticables_library_init();
+      tifiles_library_init();
+      ticalcs_library_init();
+      return;
+    }
+
+    close(fds[0][1]);
+    close(fds[1][1]);
+    outs[2 * i].fd = fds[0][0];
+    outs[2 * i].dest = stdout;
+    outs[2 * i + 1].fd = fds[1][0];
+    outs[2 * i + 1].dest = stderr;
+    for (j = 2 * i; j < 2 * i + 2; j++) {
+      outs[j].label = labels[i];
+      outs[j].line = g_string_new(NULL);
+    }
+  }
+
+  nopen = 2 * n;
+  while (nopen > 0) {
+    for (i = 0; i < 2 * n; i++) {
+      pfds[i].fd = outs[i].fd;
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+
+    if (poll(pfds, 2 * n, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      g_printerr("%s: poll: %s\n", g_get_prgname(), g_strerror(errno));
+      exit(EXIT_INTERNAL_ERROR);
+    }
+
+    for (i = 0; i < 2 * n; i++)
+      if (outs[i].fd >= 0 && pfds[i].revents
+	  && !relay_output(&outs[i]))
+	nopen--;
+  }
+
+  for (i = 0; i < n; i++) {
+    while (waitpid(children[i], &e, 0) < 0 && errno == EINTR)
+      ;
+
+    if (!WIFEXITED(e)) {
+      g_printerr("[%s] %s: terminated abnormally\n",
+		 labels[i], g_get_prgname());
+      e = EXIT_INTERNAL_ERROR;
+    }
+    else if ((e = WEXITSTATUS(e))) {
+      g_printerr("[%s] %s: failed (exit status %d)\n",
+		 labels[i], g_get_prgname(), e);
+    }
+
+    if (!status)
+      status = e;
+  }
+
+  for (i = 0; i < 2 * n; i++)
+    g_string_free(outs[i].line, TRUE);
+  g_strfreev(labels);
+  g_free(outs);
+  g_free(pfds);
+  g_free(children);
+
   g_free(cable_name);
-  cable_name = NULL;
   g_free(calc_name);
-  calc_name = NULL;
+  exit(status);
 }
 
-void tt_print_error(int e, const char *msg, ...)
+#else /* !MULTI_DEVICE */
+
+static void fork_devices(G_GNUC_UNUSED const int *ports,
+			 G_GNUC_UNUSED const int *pids,
+			 G_GNUC_UNUSED int n)
 {
-  va_list ap;
-  char *ms, *es = NULL;
+  g_printerr("%s: multiple devices are not supported on this system\n",
+	     g_get_prgname());
+  tt_exit();
+  exit(EXIT_INVALID_OPTIONS);
+}
 
-  va_start(ap, msg);
-  ms = g_strdup_vprintf(msg, ap);
-  va_end(ap);
+#endif /* !MULTI_DEVICE */
 
-  if (e && (!ticalcs_error_get(e, &es)
-	    || !ticables_error_get(e, &es)
-	    || !tifiles_error_get(e, &es)))
-    g_printerr("%s: %s\n%s\n", g_get_prgname(), ms, es);
-  else
-    g_printerr("%s: %s\n", g_get_prgname(), ms);
+/* Handle the --all-devices and --device options.  If more than one
+   device is selected, this returns in one child process per device;
+   if only one, the cable is simply set to that device. */
+static void use_devices()
+{
+  int *ports, *pids, n, e;
+
+  if (cable_name && g_ascii_strcasecmp(cable_name, "auto")) {
+    g_printerr("%s: --all-devices and --device cannot be used with -c\n",
+	       g_get_prgname());
+    tt_exit();
+    exit(EXIT_INVALID_OPTIONS);
+  }
+
+  n = select_devices(&ports, &pids);
+
+  if (n == 0) {
+    g_printerr("%s: no USB devices detected\n", g_get_prgname());
+    g_free(ports);
+    g_free(pids);
+    tt_exit();
+    exit(EXIT_NO_CABLE_FOUND);
+  }
+  else if (n == 1) {
+    g_free(cable_name);
+    cable_name = g_strdup_printf("%s:%d", (pids[0] == PID_TIGLUSB
+					   ? "slv" : "usb"), ports[0]);
+  }
+  else if (link_mode == TT_LINK_DIRECT) {
+    /* titoolsd serves a single link */
+    g_printerr("%s: only one device may be used at a time\n",
+	       g_get_prgname());
+    tt_exit();
+    exit(EXIT_INVALID_OPTIONS);
+  }
+  else {
+    if (device_setup && (e = (*device_setup)(session))) {
+      g_free(ports);
+      g_free(pids);
+      tt_exit();
+      exit(e);
+    }
+    fork_devices(ports, pids, n);
+  }
 
-  g_free(ms);
-  g_free(es);
+  g_free(ports);
+  g_free(pids);
 }
 
-char * tt_format_varname(const VarEntry *ve)
+/* Called by programs that write files to the current directory.
+   When running on several devices at once (--all-devices), each
+   device's files are placed in a separate subdirectory, named after
+   the device (e.g., "usb1"); relative output filenames are then
+   interpreted relative to that directory. */
+void tt_enter_output_dir()
 {
-  const char *type;
-  char *folder;
-  char *name;
-  char *s;
+  if (!device_label)
+    return;
+
+  if (g_mkdir_with_parents(device_label, 0777) || g_chdir(device_label)) {
+    g_printerr("%s: %s: %s\n", g_get_prgname(), device_label,
+	       g_strerror(errno));
+    tt_exit();
+    exit(EXIT_INTERNAL_ERROR);
+  }
+}
+
+/* General initialization for all of the titools.  Parse the
+   command-line options, and open a session with the calculator.
+
+   ARGC and ARGV are the arguments to main().
+
+   APP_OPTIONS is an array of GOptionEntries describing app-specific
+   command-line options.  If "rest" arguments are allowed, APP_OPTIONS
+   must contain a G_OPTION_REMAINING entry.  MIN_FN is the minimum
+   allowed number of "rest" arguments.
 
-  type = tifiles_vartype2string(calc_model, ve->type);
+   REQUIRED_FEATURES is a bit mask of calculator features that are
+   required in order for the tool to be useful (e.g., OPS_DIRLIST must
+   be available in order to use 'tils'.)
 
-  if (ve->folder[0]) {
-    folder = ticonv_varname_to_utf8(calc_model, ve->folder, -1);
-    name = ticonv_varname_to_utf8(calc_model, ve->name, ve->type);
-    s = g_strdup_printf("%s %s/%s", type, folder, name);
-    g_free(folder);
-    g_free(name);
-    return s;
+   SILENT_PROBE is 1 if it's OK to probe for the calculator type
+   without asking.
+
+   Returns the session, which remains valid until tt_exit() is
+   called.
+ */
+TTSession * tt_init(int argc, char **argv, const GOptionEntry *app_options,
+	     int min_fn, CalcFeatures required_features, int silent_probe)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  CalcModel user_model;
+  const char *v;
+  char *p;
+  char ***a;
+  int i, j, e, progress_mode;
+
+  /* if a titoolsd is running, it owns the link; let it do the work */
+  if (link_mode == TT_LINK_AUTO
+      && (e = tt_daemon_forward(argc, argv)) >= 0)
+    exit(e);
+
+  if (link_mode != TT_LINK_SERVED)
+    session = tt_session_new(CALC_NONE, NULL, NULL, NULL);
+
+  setlocale(LC_ALL, "");
+
+  if ((v = g_getenv("TITOOLS_CABLE")))
+    cable_name = g_strdup(v);
+
+  if ((v = g_getenv("TITOOLS_CALC")))
+    calc_name = g_strdup(v);
+
+  if ((v = g_getenv("TITOOLS_PROGRESS")))
+    progress_name = g_strdup(v);
+
+  if ((v = g_getenv("TITOOLS_TIMEOUT"))) {
+    i = strtol(v, &p, 10);
+    if (i > 0)
+      timeout = i;
   }
-  else {
-    name = ticonv_varname_to_utf8(calc_model, ve->name, ve->type);
-    s = g_strdup_printf("%s %s", type, name);
-    g_free(name);
-    return s;
+
+  ctx = g_option_context_new("");
+
+  if (app_options)
+    g_option_context_add_main_entries(ctx, app_options, NULL);
+
+  g_option_context_add_main_entries(ctx, comm_options, NULL);
+
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    print_usage(ctx);
+  }
+
+  if (showversion) {
+    g_print("%s (%s)\n"
+	    "Copyright (C) 2010 Benjamin Moody\n"
+	    "This program is free software. "
+	    " There is NO WARRANTY of any kind.\n"
+	    "Report bugs to %s.\n",
+	    g_get_prgname(), PACKAGE_STRING, PACKAGE_BUGREPORT);
+    tt_exit();
+    exit(0);
   }
+
+  /* check for unparsed options/filenames */
+  if (argc != 1)
+    print_usage(ctx);
+
+  if ((progress_mode = tt_progress_mode(progress_name)) < 0) {
+    g_printerr("%s: unknown progress mode '%s'\n",
+	       g_get_prgname(), progress_name);
+    print_usage(ctx);
+  }
+
+  /* if "rest" arguments are allowed, check that the number is OK */
+  for (i = 0; app_options && app_options[i].long_name; i++) {
+    if (!strcmp(app_options[i].long_name, G_OPTION_REMAINING)) {
+      a = app_options[i].arg_data;
+      if (a && *a) {
+	for (j = 0; (*a)[j]; j++)
+	  ;
+      }
+      else {
+	j = 0;
+      }
+
+      if (j < min_fn)
+	print_usage(ctx);
+    }
+  }
+
+  g_option_context_free(ctx);
+
+  g_log_set_handler("ticables", G_LOG_LEVEL_MASK, &log_output, 0);
+  g_log_set_handler("tifiles", G_LOG_LEVEL_MASK, &log_output, 0);
+  g_log_set_handler("ticalcs", G_LOG_LEVEL_MASK, &log_output, 0);
+  g_log_set_handler("calccables", G_LOG_LEVEL_MASK, &log_output, 0);
+  g_log_set_handler("calcfiles", G_LOG_LEVEL_MASK, &log_output, 0);
+  g_log_set_handler("calcprotocols", G_LOG_LEVEL_MASK, &log_output, 0);
+
+  if (link_mode == TT_LINK_SERVED) {
+    /* titoolsd (or titools batch) has already found the cable and
+       calculator, and closed the link for us to open again (see
+       tt_link_release) */
+    if (all_devices || device_list) {
+      g_printerr("%s: --all-devices and --device cannot be used with"
+		 " a shared link (titoolsd or titools batch)\n",
+		 g_get_prgname());
+      tt_exit();
+      exit(EXIT_INVALID_OPTIONS);
+    }
+
+    check_served_link();
+
+    open_libraries();
+    if ((e = tt_session_attach(session))) {
+      tt_print_error(e, "unable to open link");
+      tt_exit();
+      exit(EXIT_CABLE_FAILED);
+    }
+
+    check_features(required_features);
+    ticables_options_set_timeout(session->cable, (timeout + 99) / 100);
+    check_ready();
+    session->refresh = refresh;
+    tt_progress_init(session, progress_mode, NULL);
+    return session;
+  }
+
+  open_libraries();
+
+  /* Set calculator model based on options, if possible */
+
+  if (!calc_name || !g_ascii_strcasecmp(calc_name, "dwim")) {
+    /* try to guess calc model based on filenames */
+    session->model = guess_model_from_options(app_options);
+
+    if (!session->model && !silent_probe) {
+      g_printerr("%s: unable to determine calculator type\n"
+		 "(use -m MODEL, or -m 'auto' to probe)\n",
+		 g_get_prgname());
+      tt_exit();
+      exit(EXIT_INVALID_OPTIONS);
+    }
+  }
+  else if (calc_name && g_ascii_strcasecmp(calc_name, "auto")) {
+    /* user set model explicitly */
+    session->model = calc_name_to_model(calc_name);
+    if (!session->model) {
+      g_printerr("%s: unknown model '%s'\n",
+		 g_get_prgname(), calc_name);
+      tt_exit();
+      exit(EXIT_INVALID_OPTIONS);
+    }
+  }
+
+  if (all_devices || device_list) {
+    use_devices();
+
+    /* (commands run by 'titools batch' inherit these, and should
+       not act on them again) */
+    all_devices = FALSE;
+    g_free(device_list);
+    device_list = NULL;
+  }
+
+  /* Open the link, using settings found by a previous run if
+     possible; if those no longer work, search again */
+  user_model = session->model;
+  if (open_link(user_model, required_features, 1))
+    open_link(user_model, required_features, 0);
+
+  session->refresh = refresh;
+  refresh = FALSE;		/* (not for every command of titools batch) */
+  tt_progress_init(session, progress_mode, device_label);
+  return session;
+}
+
+void tt_exit()
+{
+  tt_progress_init(NULL, TT_PROGRESS_NONE, NULL);
+
+  if (link_mode != TT_LINK_SERVED) {
+    tt_session_free(session);
+    session = NULL;
+  }
+  else if (session) {
+    /* (the session belongs to titoolsd; only close our link) */
+    tt_session_detach(session);
+  }
+
+  close_libraries();
+
+  g_free(cable_name);
+  cable_name = NULL;
+  g_free(calc_name);
+  calc_name = NULL;
+  g_free(progress_name);
+  progress_name = NULL;
+  device_setup = NULL;
 }
@@ -0,0 +1,451 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Communication between the tools and titoolsd.
+
+   A client connects to the daemon's Unix socket and sends its
+   standard input, output, and error descriptors (as SCM_RIGHTS
+   ancillary data), followed by a request:
+
+     4 bytes       length of the remainder (native byte order)
+     tool\0        program name
+     cwd\0         working directory
+     argc\0        number of arguments, in decimal
+     argv[i]\0     arguments
+     env[i]\0      environment, to the end of the request
+
+   The daemon runs the tool and replies with its exit status (4
+   bytes, native byte order.) */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "titools.h"
+
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define MAX_REQUEST_SIZE 0x100000
+
+/* seconds to wait for a client to send its request (the daemon
+   serves one client at a time) */
+#define CLIENT_TIMEOUT 10
+
+extern char **environ;
+
+/* Get the path to the titoolsd socket ($TITOOLS_SOCKET, or
+   "titoolsd" in the user's runtime directory.)  Returns NULL if the
+   daemon has been disabled by setting TITOOLS_SOCKET to an empty
+   string. */
+char * tt_daemon_socket_path()
+{
+  const char *v;
+
+  if ((v = g_getenv("TITOOLS_SOCKET")))
+    return (v[0] ? g_strdup(v) : NULL);
+
+  return g_build_filename(g_get_user_runtime_dir(), "titoolsd", NULL);
+}
+
+static int make_address(struct sockaddr_un *addr, const char *path)
+{
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return -1;
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static int read_full(int fd, void *buf, size_t n)
+{
+  char *p = buf;
+  ssize_t k;
+
+  while (n > 0) {
+    k = read(fd, p, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return -1;
+    p += k;
+    n -= k;
+  }
+
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n)
+{
+  const char *p = buf;
+  ssize_t k;
+
+  while (n > 0) {
+    k = write(fd, p, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return -1;
+    p += k;
+    n -= k;
+  }
+
+  return 0;
+}
+
+/* Send the request header, together with descriptors 0, 1, and 2 */
+static int send_header(int sock, guint32 length)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  int fds[3] = { 0, 1, 2 };
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+
+  iov.iov_base = &length;
+  iov.iov_len = sizeof(length);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  while (sendmsg(sock, &msg, 0) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Receive the request header and the client's descriptors */
+static int recv_header(int sock, guint32 *length, int *fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  ssize_t k;
+
+  memset(&msg, 0, sizeof(msg));
+
+  iov.iov_base = length;
+  iov.iov_len = sizeof(guint32);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  do
+    k = recvmsg(sock, &msg, 0);
+  while (k < 0 && errno == EINTR);
+
+  if (k != sizeof(guint32))
+    return -1;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET
+	&& cmsg->cmsg_type == SCM_RIGHTS
+	&& cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+      memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/* If titoolsd is running, ask it to run this program (ARGC and ARGV
+   are the arguments to main().)  Returns the program's exit status,
+   or -1 if no daemon is available. */
+int tt_daemon_forward(int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  char *path, *cwd, *tool;
+  GString *req;
+  gint32 status;
+  int sock, i;
+
+  if (!(path = tt_daemon_socket_path()))
+    return -1;
+
+  if (make_address(&addr, path)) {
+    g_free(path);
+    return -1;
+  }
+  g_free(path);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+    close(sock);
+    return -1;
+  }
+
+  tool = g_path_get_basename(argv[0]);
+  cwd = g_get_current_dir();
+
+  req = g_string_new(NULL);
+  g_string_append_len(req, tool, strlen(tool) + 1);
+  g_string_append_len(req, cwd, strlen(cwd) + 1);
+  g_string_append_printf(req, "%d", argc);
+  g_string_append_c(req, 0);
+  for (i = 0; i < argc; i++)
+    g_string_append_len(req, argv[i], strlen(argv[i]) + 1);
+  for (i = 0; environ[i]; i++)
+    g_string_append_len(req, environ[i], strlen(environ[i]) + 1);
+
+  g_free(cwd);
+
+  if (send_header(sock, req->len)
+      || write_full(sock, req->str, req->len)
+      || read_full(sock, &status, sizeof(status))) {
+    g_printerr("%s: lost connection to titoolsd\n", tool);
+    status = EXIT_INTERNAL_ERROR;
+  }
+
+  g_string_free(req, TRUE);
+  g_free(tool);
+  close(sock);
+  return status;
+}
+
+/* Create the daemon's listening socket.  Returns -1 (after printing
+   an error message) if the socket cannot be created. */
+int tt_daemon_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  int sock;
+
+  if (make_address(&addr, path)) {
+    g_printerr("%s: socket path '%s' is too long\n",
+	       g_get_prgname(), path);
+    return -1;
+  }
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    g_printerr("%s: unable to create socket: %s\n",
+	       g_get_prgname(), g_strerror(errno));
+    return -1;
+  }
+
+  /* refuse to replace the socket of a running daemon */
+  if (!connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+    g_printerr("%s: titoolsd is already running on %s\n",
+	       g_get_prgname(), path);
+    close(sock);
+    return -1;
+  }
+
+  close(sock);
+  unlink(path);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    g_printerr("%s: unable to create socket: %s\n",
+	       g_get_prgname(), g_strerror(errno));
+    return -1;
+  }
+
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr))
+      || chmod(path, 0600)
+      || listen(sock, 8)) {
+    g_printerr("%s: unable to listen on %s: %s\n",
+	       g_get_prgname(), path, g_strerror(errno));
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+/* Wait for a client to connect, and read its request.  Returns NULL
+   if the request could not be read; otherwise, *CLIENT is set to the
+   connection on which to send the reply. */
+TTRequest * tt_daemon_accept(int sock, int *client)
+{
+  TTRequest *req;
+  struct timeval tv;
+  guint32 length;
+  char *buf, *p, *end;
+  long n = 0;
+  int fds[3], i;
+
+  if ((*client = accept(sock, NULL, NULL)) < 0)
+    return NULL;
+
+  /* don't let a client that never sends its request hold up the
+     others */
+  tv.tv_sec = CLIENT_TIMEOUT;
+  tv.tv_usec = 0;
+  if (setsockopt(*client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+    close(*client);
+    return NULL;
+  }
+
+  if (recv_header(*client, &length, fds)) {
+    close(*client);
+    return NULL;
+  }
+
+  if (length > MAX_REQUEST_SIZE) {
+    for (i = 0; i < 3; i++)
+      close(fds[i]);
+    close(*client);
+    return NULL;
+  }
+
+  buf = g_new(char, length + 1);
+  if (read_full(*client, buf, length)) {
+    g_free(buf);
+    for (i = 0; i < 3; i++)
+      close(fds[i]);
+    close(*client);
+    return NULL;
+  }
+  buf[length] = 0;
+  end = buf + length;
+
+  req = g_slice_new0(TTRequest);
+  memcpy(req->fds, fds, sizeof(fds));
+
+  p = buf;
+  req->tool = g_strdup(p);
+  p += strlen(p) + 1;
+  if (p < end) {
+    req->cwd = g_strdup(p);
+    p += strlen(p) + 1;
+  }
+  if (p < end) {
+    n = strtol(p, NULL, 10);
+    p += strlen(p) + 1;
+  }
+
+  /* (each argument takes at least one byte) */
+  if (!req->cwd || n < 1 || n > end - p) {
+    g_free(buf);
+    tt_request_free(req);
+    close(*client);
+    return NULL;
+  }
+
+  req->argc = n;
+  req->argv = g_new0(char *, req->argc + 1);
+  for (i = 0; i < req->argc && p < end; i++) {
+    req->argv[i] = g_strdup(p);
+    p += strlen(p) + 1;
+  }
+  req->argc = i;
+
+  req->env = g_new0(char *, length / 2 + 1);
+  for (i = 0; p < end; i++) {
+    req->env[i] = g_strdup(p);
+    p += strlen(p) + 1;
+  }
+
+  g_free(buf);
+
+  if (!req->cwd || req->argc < 1) {
+    tt_request_free(req);
+    close(*client);
+    return NULL;
+  }
+
+  return req;
+}
+
+/* Send the exit status of a request back to the client */
+void tt_daemon_reply(int client, int status)
+{
+  gint32 s = status;
+  write_full(client, &s, sizeof(s));
+}
+
+/* Free a request, closing any descriptors still held */
+void tt_request_free(TTRequest *req)
+{
+  int i;
+
+  if (!req)
+    return;
+
+  for (i = 0; i < 3; i++)
+    if (req->fds[i] >= 0)
+      close(req->fds[i]);
+
+  g_free(req->tool);
+  g_free(req->cwd);
+  g_strfreev(req->argv);
+  g_strfreev(req->env);
+  g_slice_free(TTRequest, req);
+}
+
+#else /* !HAVE_SYS_UN_H */
+
+char * tt_daemon_socket_path()
+{
+  return NULL;
+}
+
+int tt_daemon_forward(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv)
+{
+  return -1;
+}
+
+int tt_daemon_listen(G_GNUC_UNUSED const char *path)
+{
+  g_printerr("%s: not supported on this system\n", g_get_prgname());
+  return -1;
+}
+
+TTRequest * tt_daemon_accept(G_GNUC_UNUSED int sock,
+			     G_GNUC_UNUSED int *client)
+{
+  return NULL;
+}
+
+void tt_daemon_reply(G_GNUC_UNUSED int client, G_GNUC_UNUSED int status)
+{
+}
+
+void tt_request_free(G_GNUC_UNUSED TTRequest *req)
+{
+}
+
+#endif
@@ -0,0 +1,798 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Directory listings, cached in the session (and optionally in a
+   file, so that they can be shared between processes.)
+
+   Listings are also kept in the user's cache directory, one file per
+   link, so that they need not be read from the calculator on every
+   run.  A cached listing is used only if the calculator's free RAM
+   and Flash (its "fingerprint") are the same as when the listing was
+   saved; our own changes (tt_dirlist_changed) remove the file.
+
+   On the Nspire, when only some folders are needed, the listing can
+   also be read one folder at a time (tt_get_dir_entries_in); such a
+   partial listing is kept only in the session, and never saved.
+
+   File format (all integers in native byte order):
+
+     "TTDL2\n"
+     8 bytes        free RAM when the listing was read
+     8 bytes        free Flash when the listing was read
+     for the variable tree, then the application tree:
+       1 byte       1 if the tree is present, 0 if not
+       TreeInfo     model, mem_mask, mem_used, mem_free (4 bytes each)
+       4 bytes      number of folders
+       for each folder:
+         1 byte     1 if the folder has an entry, 0 if not
+         VarEntry   the folder entry, if present
+         4 bytes    number of variables
+         VarEntry   each variable
+
+     VarEntry: folder and name (2-byte length, then bytes), type,
+     attr, version (1 byte each), size (4 bytes) */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include "titools.h"
+
+#ifdef HAVE_CMDNSP_H
+# include <cmdnsp.h>
+#endif
+
+#define DIRLIST_MAGIC "TTDL2\n"
+
+static void put_bytes(GString *buf, const void *p, gsize n)
+{
+  g_string_append_len(buf, p, n);
+}
+
+static void put_string(GString *buf, const char *s)
+{
+  guint16 n = strlen(s);
+  put_bytes(buf, &n, sizeof(n));
+  put_bytes(buf, s, n);
+}
+
+static void put_ve(GString *buf, const VarEntry *ve)
+{
+  guint32 size = ve->size;
+
+  put_string(buf, ve->folder);
+  put_string(buf, ve->name);
+  put_bytes(buf, &ve->type, 1);
+  put_bytes(buf, &ve->attr, 1);
+  put_bytes(buf, &ve->version, 1);
+  put_bytes(buf, &size, sizeof(size));
+}
+
+static void put_tree(GString *buf, GNode *tree)
+{
+  TreeInfo *ti;
+  GNode *f, *v;
+  guint32 n;
+  gint32 i;
+  guint8 present;
+
+  present = (tree != NULL);
+  put_bytes(buf, &present, 1);
+  if (!tree)
+    return;
+
+  ti = tree->data;
+  i = ti->model;
+  put_bytes(buf, &i, sizeof(i));
+  i = ti->mem_mask;
+  put_bytes(buf, &i, sizeof(i));
+  n = ti->mem_used;
+  put_bytes(buf, &n, sizeof(n));
+  n = ti->mem_free;
+  put_bytes(buf, &n, sizeof(n));
+
+  n = g_node_n_children(tree);
+  put_bytes(buf, &n, sizeof(n));
+
+  for (f = tree->children; f; f = f->next) {
+    present = (f->data != NULL);
+    put_bytes(buf, &present, 1);
+    if (f->data)
+      put_ve(buf, f->data);
+
+    n = g_node_n_children(f);
+    put_bytes(buf, &n, sizeof(n));
+    for (v = f->children; v; v = v->next)
+      put_ve(buf, v->data);
+  }
+}
+
+/* Save a directory listing to a file, along with the calculator's
+   FINGERPRINT (two values; may be NULL.)  Returns 0 on success. */
+int tt_dirlist_save(const char *filename, GNode *vars, GNode *apps,
+		    const guint64 *fingerprint)
+{
+  GString *buf;
+  guint64 fp[2] = { 0, 0 };
+  int status;
+
+  if (fingerprint)
+    memcpy(fp, fingerprint, sizeof(fp));
+
+  buf = g_string_new(DIRLIST_MAGIC);
+  put_bytes(buf, fp, sizeof(fp));
+  put_tree(buf, vars);
+  put_tree(buf, apps);
+
+  status = (g_file_set_contents(filename, buf->str, buf->len, NULL)
+	    ? 0 : -1);
+  g_string_free(buf, TRUE);
+  return status;
+}
+
+typedef struct {
+  const char *p;
+  const char *end;
+} Reader;
+
+static int get_bytes(Reader *r, void *out, gsize n)
+{
+  if ((gsize) (r->end - r->p) < n)
+    return -1;
+  memcpy(out, r->p, n);
+  r->p += n;
+  return 0;
+}
+
+static int get_string(Reader *r, char *out, gsize size)
+{
+  guint16 n;
+
+  if (get_bytes(r, &n, sizeof(n))
+      || n >= size
+      || get_bytes(r, out, n))
+    return -1;
+  out[n] = 0;
+  return 0;
+}
+
+static VarEntry * get_ve(Reader *r)
+{
+  VarEntry *ve;
+  guint32 size;
+
+  ve = tifiles_ve_create();
+  if (get_string(r, ve->folder, sizeof(ve->folder))
+      || get_string(r, ve->name, sizeof(ve->name))
+      || get_bytes(r, &ve->type, 1)
+      || get_bytes(r, &ve->attr, 1)
+      || get_bytes(r, &ve->version, 1)
+      || get_bytes(r, &size, sizeof(size))) {
+    tifiles_ve_delete(ve);
+    return NULL;
+  }
+
+  ve->size = size;
+  return ve;
+}
+
+static int get_tree(Reader *r, GNode **tree, const char *type)
+{
+  TreeInfo *ti;
+  GNode *f;
+  VarEntry *ve;
+  guint32 nf, nv, i, j;
+  gint32 model, mask;
+  guint32 used, avail;
+  guint8 present;
+
+  *tree = NULL;
+
+  if (get_bytes(r, &present, 1))
+    return -1;
+  if (!present)
+    return 0;
+
+  if (get_bytes(r, &model, sizeof(model))
+      || get_bytes(r, &mask, sizeof(mask))
+      || get_bytes(r, &used, sizeof(used))
+      || get_bytes(r, &avail, sizeof(avail))
+      || get_bytes(r, &nf, sizeof(nf)))
+    return -1;
+
+  ti = g_new0(TreeInfo, 1);
+  ti->model = model;
+  ti->type = type;
+  ti->mem_mask = mask;
+  ti->mem_used = used;
+  ti->mem_free = avail;
+  *tree = g_node_new(ti);
+
+  for (i = 0; i < nf; i++) {
+    if (get_bytes(r, &present, 1))
+      return -1;
+
+    ve = NULL;
+    if (present && !(ve = get_ve(r)))
+      return -1;
+
+    f = g_node_new(ve);
+    g_node_append(*tree, f);
+
+    if (get_bytes(r, &nv, sizeof(nv)))
+      return -1;
+
+    for (j = 0; j < nv; j++) {
+      if (!(ve = get_ve(r)))
+	return -1;
+      g_node_append(f, g_node_new(ve));
+    }
+  }
+
+  return 0;
+}
+
+/* Load a directory listing saved by tt_dirlist_save(), and the
+   fingerprint saved with it (if FINGERPRINT is not NULL.)  Returns 0
+   on success, or -1 if the file does not exist or is invalid. */
+int tt_dirlist_load(const char *filename, GNode **vars, GNode **apps,
+		    guint64 *fingerprint)
+{
+  Reader r;
+  char *data;
+  gsize length;
+  guint64 fp[2];
+  int status;
+
+  *vars = *apps = NULL;
+
+  if (!g_file_get_contents(filename, &data, &length, NULL))
+    return -1;
+
+  r.p = data;
+  r.end = data + length;
+
+  if (length < strlen(DIRLIST_MAGIC)
+      || memcmp(data, DIRLIST_MAGIC, strlen(DIRLIST_MAGIC)))
+    status = -1;
+  else {
+    r.p += strlen(DIRLIST_MAGIC);
+    status = (get_bytes(&r, fp, sizeof(fp))
+	      || get_tree(&r, vars, VAR_NODE_NAME)
+	      || get_tree(&r, apps, APP_NODE_NAME)
+	      || (!*vars && !*apps)) ? -1 : 0;
+  }
+
+  g_free(data);
+
+  if (status) {
+    ticalcs_dirlist_destroy(vars);
+    ticalcs_dirlist_destroy(apps);
+  }
+  else if (fingerprint) {
+    memcpy(fingerprint, fp, sizeof(fp));
+  }
+
+  return status;
+}
+
+/* Get the name of the cache file for the session's calculator (or
+   NULL if the calculator has no ID; a listing saved for a link could
+   be read back for some other calculator plugged into it) */
+static char * cache_filename(TTSession *s)
+{
+  char *id, *name, *path;
+
+  if (!(id = tt_calc_id(s)))
+    return NULL;
+
+  name = g_strconcat("dirlist-", id, NULL);
+  path = tt_cache_filename(name);
+  g_free(name);
+  g_free(id);
+  return path;
+}
+
+/* Get the calculator's free RAM and Flash, which change whenever
+   variables are added, removed, or resized.  Returns -1 if this
+   calculator cannot tell us. */
+static int get_fingerprint(TTSession *s, guint64 *fp)
+{
+  return tt_get_memfree(s, &fp[0], &fp[1]);
+}
+
+/* Snapshot of a directory listing: every variable, in order, with
+   the names needed for matching and display converted only once.
+   All of the strings are kept in a single GStringChunk (type names
+   are shared between entries.) */
+struct _TTSnapshot {
+  TTDirEntry *entries;
+  int n;
+  GStringChunk *strings;
+  GHashTable *index;		/* VarEntry -> TTDirEntry */
+  GHashTable *by_key;		/* tt_var_key() -> VarEntry */
+  GPtrArray *added;		/* entries added by tt_dirlist_add() */
+};
+
+/* Key identifying a variable by type, folder, and name (folder names
+   never contain a slash) */
+char * tt_var_key(const VarEntry *ve)
+{
+  return g_strdup_printf("%d/%s/%s", ve->type, ve->folder, ve->name);
+}
+
+/* Index VE by its key.  If another variable already has that key, VE
+   replaces it only if REPLACE is set; otherwise the first is kept. */
+static void snapshot_index_key(TTSnapshot *snap, VarEntry *ve, int replace)
+{
+  gpointer oldkey;
+  char *key;
+
+  key = tt_var_key(ve);
+  if (!g_hash_table_lookup_extended(snap->by_key, key, &oldkey, NULL))
+    g_hash_table_insert(snap->by_key,
+			g_string_chunk_insert(snap->strings, key), ve);
+  else if (replace)
+    g_hash_table_insert(snap->by_key, oldkey, ve);
+  g_free(key);
+}
+
+/* Copy a string into the snapshot, and free the original */
+static const char * snapshot_take(TTSnapshot *snap, char *str)
+{
+  const char *r;
+
+  r = g_string_chunk_insert(snap->strings, str ? str : "");
+  g_free(str);
+  return r;
+}
+
+static const char * snapshot_type(TTSnapshot *snap, const char *str)
+{
+  char buf[64];
+  int i;
+
+  for (i = 0; str[i] && i < (int) sizeof(buf) - 1; i++)
+    buf[i] = g_ascii_toupper(str[i]);
+  buf[i] = 0;
+  return g_string_chunk_insert_const(snap->strings, buf);
+}
+
+static int tree_count(GNode *tree)
+{
+  GNode *f, *v;
+  int n = 0;
+
+  if (tree)
+    for (f = tree->children; f; f = f->next)
+      for (v = f->children; v; v = v->next)
+	if (v->data)
+	  n++;
+  return n;
+}
+
+static void snapshot_add_tree(TTSnapshot *snap, CalcModel model, GNode *tree)
+{
+  GNode *f, *v;
+  VarEntry *ve;
+  TTDirEntry *de;
+  const char *t;
+
+  if (!tree)
+    return;
+
+  for (f = tree->children; f; f = f->next) {
+    for (v = f->children; v; v = v->next) {
+      if (!(ve = v->data))
+	continue;
+      ve->type &= VAR_TYPE_MASK;
+
+      de = &snap->entries[snap->n++];
+      de->ve = ve;
+      de->name = snapshot_take
+	(snap, ticonv_varname_detokenize(model, ve->name, ve->type));
+      de->utf8_name = snapshot_take
+	(snap, ticonv_varname_to_utf8(model, ve->name, ve->type));
+      if (ve->folder[0])
+	de->utf8_folder = snapshot_take
+	  (snap, ticonv_varname_to_utf8(model, ve->folder, -1));
+      else
+	de->utf8_folder = "";
+
+      t = tifiles_vartype2string(model, ve->type);
+      if (t && t[0]) {
+	de->type_name = snapshot_type(snap, t);
+	de->type_fext = snapshot_type(snap, tifiles_vartype2fext(model,
+								 ve->type));
+      }
+      else {
+	de->type_name = de->type_fext = NULL;
+      }
+
+      g_hash_table_insert(snap->index, ve, de);
+      snapshot_index_key(snap, ve, 0);
+    }
+  }
+}
+
+static TTSnapshot * snapshot_new(CalcModel model, GNode *vars, GNode *apps)
+{
+  TTSnapshot *snap;
+
+  snap = g_slice_new(TTSnapshot);
+  snap->entries = g_new(TTDirEntry, tree_count(vars) + tree_count(apps));
+  snap->n = 0;
+  snap->strings = g_string_chunk_new(4096);
+  snap->index = g_hash_table_new(&g_direct_hash, &g_direct_equal);
+  snap->by_key = g_hash_table_new(&g_str_hash, &g_str_equal);
+  snap->added = g_ptr_array_new();
+
+  snapshot_add_tree(snap, model, vars);
+  snapshot_add_tree(snap, model, apps);
+  return snap;
+}
+
+static void snapshot_free(TTSnapshot *snap)
+{
+  guint i;
+
+  if (!snap)
+    return;
+
+  g_free(snap->entries);
+  g_string_chunk_free(snap->strings);
+  g_hash_table_destroy(snap->index);
+  g_hash_table_destroy(snap->by_key);
+  for (i = 0; i < snap->added->len; i++)
+    tifiles_ve_delete(g_ptr_array_index(snap->added, i));
+  g_ptr_array_free(snap->added, TRUE);
+  g_slice_free(TTSnapshot, snap);
+}
+
+#ifdef HAVE_CMDNSP_H
+
+/* Enumerate one directory on an Nspire.  If FOLDER is NULL, PATH is
+   the root directory, and each subdirectory is added to TREE as a
+   folder; otherwise each file (but not subdirectory) is added to TREE
+   as a variable in FOLDER. */
+static int nsp_enum_dir(CalcHandle *calc, const char *path,
+			const char *folder, GNode *tree)
+{
+  char name[VARNAME_MAX], *ext;
+  uint32_t size;
+  uint8_t type;
+  VarEntry *ve;
+  int e;
+
+  if ((e = nsp_cmd_s_dir_enum_init(calc, path))
+      || (e = nsp_cmd_r_dir_enum_init(calc)))
+    return e;
+
+  for (;;) {
+    if ((e = nsp_cmd_s_dir_enum_next(calc)))
+      return e;
+    if ((e = nsp_cmd_r_dir_enum_next(calc, name, &size, &type))) {
+      if (e == ERR_EOT)
+	break;
+      return e;
+    }
+
+    /* (a directory within a folder is not a variable) */
+    if (folder && type)
+      continue;
+
+    ve = tifiles_ve_create();
+    ve->size = size;
+    ve->attr = ATTRB_NONE;
+
+    if (!folder) {
+      /* (documents in the root directory, such as themes.csv, are not
+	 folders) */
+      if (!type) {
+	tifiles_ve_delete(ve);
+	continue;
+      }
+      strncpy(ve->folder, name, sizeof(ve->folder) - 1);
+      strncpy(ve->name, name, sizeof(ve->name) - 1);
+      ve->type = type;
+    }
+    else {
+      strncpy(ve->folder, folder, sizeof(ve->folder) - 1);
+      if ((ext = (char *) tifiles_fext_get(name)) && *ext) {
+	ext[-1] = 0;
+	ve->type = tifiles_fext2vartype(calc->model, ext);
+      }
+      strncpy(ve->name, name, sizeof(ve->name) - 1);
+    }
+
+    g_node_append(tree, g_node_new(ve));
+  }
+
+  if ((e = nsp_cmd_s_dir_enum_done(calc))
+      || (e = nsp_cmd_r_dir_enum_done(calc)))
+    return e;
+  return 0;
+}
+
+static GNode * new_tree(CalcModel model, const char *type)
+{
+  TreeInfo *ti;
+
+  ti = g_new0(TreeInfo, 1);
+  ti->model = model;
+  ti->type = type;
+  return g_node_new(ti);
+}
+
+/* Read the listing of only those folders for which WANT returns
+   nonzero, in the same form as ticalcs_calc_get_dirlist().  Returns a
+   libticalcs error code. */
+static int nsp_get_dirlist(TTSession *s, TTFolderFunc want, gpointer data,
+			   GNode **vars, GNode **apps)
+{
+  GNode *folders, *f, *next;
+  int e;
+
+  *vars = new_tree(s->model, VAR_NODE_NAME);
+  *apps = new_tree(s->model, APP_NODE_NAME);
+  folders = g_node_new(NULL);
+
+  if ((e = nsp_session_open(s->calc, SID_FILE_MGMT)))
+    goto out;
+
+  e = nsp_enum_dir(s->calc, "/", NULL, folders);
+
+  for (f = folders->children; !e && f; f = next) {
+    VarEntry *ve = f->data;
+    char *path;
+
+    next = f->next;
+    if (!(*want)(ve->folder, data))
+      continue;
+
+    g_node_unlink(f);
+    g_node_append(*vars, f);
+
+    path = g_strconcat("/", ve->folder, NULL);
+    e = nsp_enum_dir(s->calc, path, ve->folder, f);
+    g_free(path);
+  }
+
+  if (!e)
+    e = nsp_session_close(s->calc);
+  else
+    nsp_session_close(s->calc);
+
+ out:
+  for (f = folders->children; f; f = f->next)
+    tifiles_ve_delete(f->data);
+  g_node_destroy(folders);
+
+  if (e) {
+    ticalcs_dirlist_destroy(vars);
+    ticalcs_dirlist_destroy(apps);
+  }
+  return e;
+}
+
+#endif /* HAVE_CMDNSP_H */
+
+/* Read the listing into the session, if it is not there already.  If
+   WANT is not NULL, only the folders for which it returns nonzero are
+   needed (a saved listing of every folder will still be used if
+   there is one.) */
+static int get_listing(TTSession *s, TTFolderFunc want, gpointer data)
+{
+  guint64 fp[2], cached_fp[2];
+  int have_fp = 0, e;
+  char *path;
+
+  /* a partial listing is good only for the request that read it */
+  if (s->dirlist_partial)
+    tt_dirlist_clear(s);
+
+  /* (the session's file is always current, since it belongs to a
+     single run of titools batch) */
+  if (!s->vars && !s->apps && s->dirlist_file)
+    tt_dirlist_load(s->dirlist_file, &s->vars, &s->apps, NULL);
+
+  if (s->vars || s->apps)
+    return 0;
+
+  path = cache_filename(s);
+  if (path)
+    have_fp = !get_fingerprint(s, fp);
+
+  if (have_fp && !s->refresh
+      && !tt_dirlist_load(path, &s->vars, &s->apps, cached_fp)
+      && memcmp(fp, cached_fp, sizeof(fp))) {
+    ticalcs_dirlist_destroy(&s->vars);
+    ticalcs_dirlist_destroy(&s->apps);
+  }
+
+#ifdef HAVE_CMDNSP_H
+  if (!s->vars && !s->apps && want && s->model == CALC_NSPIRE) {
+    e = nsp_get_dirlist(s, want, data, &s->vars, &s->apps);
+    g_free(path);
+    if (!e) {
+      s->dirlist_partial = 1;
+      s->refresh = 0;
+    }
+    return e;
+  }
+#else
+  (void) want;
+  (void) data;
+#endif
+
+  if (!s->vars && !s->apps) {
+    if ((e = ticalcs_calc_get_dirlist(s->calc, &s->vars, &s->apps))) {
+      ticalcs_dirlist_destroy(&s->vars);
+      ticalcs_dirlist_destroy(&s->apps);
+      g_free(path);
+      return e;
+    }
+
+    if (have_fp)
+      tt_dirlist_save(path, s->vars, s->apps, fp);
+  }
+
+  if (s->dirlist_file)
+    tt_dirlist_save(s->dirlist_file, s->vars, s->apps, NULL);
+  s->refresh = 0;
+  g_free(path);
+  return 0;
+}
+
+/* Get the directory listing of the calculator.  The listing is kept
+   in the session (and in the session's dirlist_file, if any, and the
+   cache directory) until tt_dirlist_changed() is called; *VARS and
+   *APPS belong to the session and must not be freed.  If the
+   session's refresh flag is set, the cache directory is not used the
+   first time.  Returns a libticalcs error code. */
+int tt_get_dirlist(TTSession *s, GNode **vars, GNode **apps)
+{
+  int e;
+
+  if ((e = get_listing(s, NULL, NULL))) {
+    *vars = *apps = NULL;
+    return e;
+  }
+
+  *vars = s->vars;
+  *apps = s->apps;
+  return 0;
+}
+
+/* Get the directory listing as an array of entries (vars first, then
+   apps, in directory order.)  The array belongs to the session, like
+   the listing itself.  Returns a libticalcs error code. */
+int tt_get_dir_entries(TTSession *s, const TTDirEntry **entries, int *n)
+{
+  return tt_get_dir_entries_in(s, NULL, NULL, entries, n);
+}
+
+/* Get the entries in those folders for which WANT returns nonzero
+   (given the folder's name, as stored in VarEntry.folder.)  Other
+   folders may be included as well, and are included if WANT is NULL;
+   the caller must still check each entry.  Only the Nspire can list
+   folders one at a time.  Returns a libticalcs error code. */
+int tt_get_dir_entries_in(TTSession *s, TTFolderFunc want, gpointer data,
+			  const TTDirEntry **entries, int *n)
+{
+  int e;
+
+  if (((!s->vars && !s->apps) || s->dirlist_partial)
+      && (e = get_listing(s, want, data))) {
+    *entries = NULL;
+    *n = 0;
+    return e;
+  }
+
+  if (!s->snapshot)
+    s->snapshot = snapshot_new(s->model, s->vars, s->apps);
+
+  *entries = s->snapshot->entries;
+  *n = s->snapshot->n;
+  return 0;
+}
+
+/* Find the entry for a variable in the session's listing.  Returns
+   NULL if VE is not part of the listing (e.g., an exact name given by
+   the user, which was never looked up.) */
+const TTDirEntry * tt_find_dir_entry(const TTSession *s, const VarEntry *ve)
+{
+  if (!s->snapshot)
+    return NULL;
+  return g_hash_table_lookup(s->snapshot->index, ve);
+}
+
+/* Look up a variable in the listing by type, folder, and name.  *OLDVE
+   is set to the existing entry, or NULL if there is none.  Returns a
+   libticalcs error code. */
+int tt_dirlist_lookup(TTSession *s, const VarEntry *ve, VarEntry **oldve)
+{
+  const TTDirEntry *entries;
+  char *key;
+  int n, e;
+
+  *oldve = NULL;
+
+  if ((e = tt_get_dir_entries(s, &entries, &n)))
+    return e;
+
+  key = tt_var_key(ve);
+  *oldve = g_hash_table_lookup(s->snapshot->by_key, key);
+  g_free(key);
+  return 0;
+}
+
+/* Record that a variable has been sent to the calculator, so that
+   later lookups in the same session will find it (with its new size
+   and attribute, if it replaced one already there).  (The listing
+   itself is not changed; tt_dirlist_changed() must still be called
+   when finished.)  Does nothing if the listing has not been read. */
+void tt_dirlist_add(TTSession *s, const VarEntry *ve)
+{
+  VarEntry *copy;
+
+  if (!s->snapshot)
+    return;
+
+  copy = tifiles_ve_create();
+  strncpy(copy->folder, ve->folder, sizeof(copy->folder) - 1);
+  strncpy(copy->name, ve->name, sizeof(copy->name) - 1);
+  copy->type = ve->type;
+  copy->attr = ve->attr;
+  copy->size = ve->size;
+
+  g_ptr_array_add(s->snapshot->added, copy);
+  snapshot_index_key(s->snapshot, copy, 1);
+}
+
+/* Free the session's directory listing */
+void tt_dirlist_clear(TTSession *s)
+{
+  snapshot_free(s->snapshot);
+  s->snapshot = NULL;
+  ticalcs_dirlist_destroy(&s->vars);
+  ticalcs_dirlist_destroy(&s->apps);
+  s->dirlist_partial = 0;
+}
+
+/* Discard the session's directory listing.  This must be called
+   after any operation that might change the calculator's contents. */
+void tt_dirlist_changed(TTSession *s)
+{
+  char *path;
+
+  tt_dirlist_clear(s);
+
+  if (s->dirlist_file)
+    g_unlink(s->dirlist_file);
+
+  if ((path = cache_filename(s))) {
+    g_unlink(path);
+    g_free(path);
+  }
+}
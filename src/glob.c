@@ -28,7 +28,7 @@
 
 /* Convert string (either a name like "PRGM" or a file type like
    "82p") to variable type */
-static int name_to_type(const char *str)
+static int name_to_type(CalcModel model, const char *str)
 {
   int t;
   const char *s;
@@ -36,13 +36,13 @@ static int name_to_type(const char *str)
   /* vartype2string returns an empty string if it's not a valid
      type */
 
-  t = tifiles_fext2vartype(calc_model, str);
-  s = tifiles_vartype2string(calc_model, t);
+  t = tifiles_fext2vartype(model, str);
+  s = tifiles_vartype2string(model, t);
   if (s && s[0])
     return t;
 
-  t = tifiles_string2vartype(calc_model, str);
-  s = tifiles_vartype2string(calc_model, t);
+  t = tifiles_string2vartype(model, str);
+  s = tifiles_vartype2string(model, t);
   if (s && s[0])
     return t;
   else
@@ -67,64 +67,6 @@ static int model_uses_utf8(CalcModel model)
     return 1;
 }
 
-/* Convert UTF-16 to TI (ticonv_charset_utf16_to_ti() is not
-   implemented for most calcs) */
-static char * utf16_to_ti(CalcModel model, const guint16 *str)
-{
-  int i, j, k, n;
-  char *s;
-  unsigned long c;
-  const unsigned long *cs;
-
-  if (!str || !*str)
-    return g_strdup("");
-
-  n = ticonv_utf16_strlen(str);
-  s = g_new(char, n + 1);
-  s[0] = 0;
-  ticonv_charset_utf16_to_ti_s(model, str, s);
-  if (s[0])
-    return s;
-
-  switch (model) {
-  case CALC_TI73: cs = ti73_charset; break;
-  case CALC_TI82: cs = ti82_charset; break;
-  case CALC_TI83: cs = ti83_charset; break;
-  case CALC_TI83P:
-  case CALC_TI84P: cs = ti83p_charset; break;
-  case CALC_TI85: cs = ti85_charset; break;
-  case CALC_TI86: cs = ti86_charset; break;
-  case CALC_TI89:
-  case CALC_TI92:
-  case CALC_TI92P:
-  case CALC_V200: cs = ti9x_charset; break;
-  default:
-    return ticonv_utf16_to_utf8(str);
-  }
-
-  for (i = j = 0; i < n; i++) {
-    c = str[i];
-    if ((c & 0xfc00) == 0xd800)
-      c = (c << 16) | str[++i];
-
-    if (c < 256 && cs[c] == c)
-      s[j] = c;
-    else {
-      s[j] = '?';
-      for (k = 0; k < 256; k++) {
-	if (cs[k] == c) {
-	  s[j] = k;
-	  break;
-	}
-      }
-    }
-    j++;
-  }
-
-  s[j] = 0;
-  return s;
-}
-
 typedef struct _TTGlobPattern {
   enum { LITERAL, BRACKETS, QUESTION, STAR, SLASH, DOT } type;
   int n;			/* length of str */
@@ -132,28 +74,57 @@ typedef struct _TTGlobPattern {
   struct _TTGlobPattern *next;
 } TTGlobPattern;
 
+/* Compiled form of a TTGlobPattern list: an array of elements, each
+   matching one character (or, for STAR, any number of characters.)
+   Characters are bytes for single-byte models, and Unicode code
+   points for models that use UTF-8. */
+typedef struct _TTGlobElem {
+  enum { ELEM_CHAR, ELEM_ANY, ELEM_SET, ELEM_STAR } type;
+  gunichar c;			/* character (ELEM_CHAR) */
+  guint32 bits[8];		/* characters below 256 (ELEM_SET) */
+  gunichar *ranges;		/* first/last pairs above 255 (ELEM_SET) */
+  int n_ranges;
+} TTGlobElem;
+
+typedef struct _TTGlobProg {
+  int n;
+  int utf8;
+  TTGlobElem *elems;
+} TTGlobProg;
+
+/* A condition on a variable's entry, written in braces after the
+   pattern (e.g. "*{attr=archived,size>4k}") */
+typedef struct _TTGlobPred {
+  enum { PRED_SIZE, PRED_ATTR, PRED_TYPE, PRED_FOLDER } field;
+  enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE } op;
+  guint32 value;		/* size, attribute, or type */
+  char *s;			/* folder name in ticalcs encoding */
+} TTGlobPred;
+
 typedef struct _TTGlob {
   TTGlobPattern *folder_pattern;
   TTGlobPattern *name_pattern;
   TTGlobPattern *type_pattern;
+  TTGlobProg *folder_prog;
+  TTGlobProg *name_prog;
+  TTGlobProg *type_prog;
   int exact_type;
+  TTGlobPred *preds;
+  int n_preds;
 } TTGlob;
 
-static void pat_append(TTGlobPattern **head, int type,
+static void pat_append(CalcModel model, TTGlobPattern **head, int type,
 		       GString *str)
 {
   TTGlobPattern *p, *q;
-  guint16 *utf16;
   char *s;
   int n;
 
   if (str) {
     if (!str->str || !str->str[0])
       return;
-    utf16 = ticonv_utf8_to_utf16(str->str);
-    s = utf16_to_ti(calc_model, utf16);
+    s = tt_utf8_to_ti(model, str->str);
     n = strlen(s);
-    g_free(utf16);
   }
   else {
     s = NULL;
@@ -189,9 +160,280 @@ static void pat_free(TTGlobPattern *p)
   }
 }
 
-/* Parse a glob string into a TTGlob object that can be used to match
-   filenames. */
-static TTGlob * tt_glob_parse(const char *pattern)
+/* Get the next character of a pattern or variable name */
+static gunichar next_char(const char **s, int utf8)
+{
+  gunichar c;
+
+  if (utf8) {
+    c = g_utf8_get_char(*s);
+    *s = g_utf8_next_char(*s);
+  }
+  else {
+    c = (guchar) **s;
+    (*s)++;
+  }
+  return c;
+}
+
+static void set_add_range(TTGlobElem *el, gunichar first, gunichar last)
+{
+  gunichar c;
+
+  for (c = first; c <= last && c < 256; c++)
+    el->bits[c >> 5] |= (1U << (c & 31));
+
+  if (last >= 256) {
+    el->ranges = g_renew(gunichar, el->ranges, 2 * el->n_ranges + 2);
+    el->ranges[2 * el->n_ranges] = MAX(first, 256);
+    el->ranges[2 * el->n_ranges + 1] = last;
+    el->n_ranges++;
+  }
+}
+
+/* Compile the contents of a bracket expression (e.g. "A-Z0") */
+static void set_compile(TTGlobElem *el, const char *s, int utf8)
+{
+  gunichar first, last;
+
+  while (*s) {
+    first = last = next_char(&s, utf8);
+    if (s[0] == '-' && s[1]) {
+      s++;
+      last = next_char(&s, utf8);
+    }
+    set_add_range(el, first, last);
+  }
+}
+
+static TTGlobProg * prog_compile(CalcModel model, const TTGlobPattern *pat)
+{
+  TTGlobProg *prog;
+  GArray *elems;
+  TTGlobElem el;
+  const char *s;
+  int utf8;
+
+  if (!pat)
+    return NULL;
+
+  utf8 = model_uses_utf8(model);
+  elems = g_array_new(FALSE, FALSE, sizeof(TTGlobElem));
+
+  for (; pat; pat = pat->next) {
+    memset(&el, 0, sizeof(TTGlobElem));
+
+    switch (pat->type) {
+    case LITERAL:
+      el.type = ELEM_CHAR;
+      for (s = pat->s; *s; ) {
+	el.c = next_char(&s, utf8);
+	g_array_append_val(elems, el);
+      }
+      break;
+
+    case BRACKETS:
+      el.type = ELEM_SET;
+      set_compile(&el, pat->s, utf8);
+      g_array_append_val(elems, el);
+      break;
+
+    case QUESTION:
+      el.type = ELEM_ANY;
+      g_array_append_val(elems, el);
+      break;
+
+    case STAR:
+      el.type = ELEM_STAR;
+      g_array_append_val(elems, el);
+      break;
+
+    case SLASH:
+    case DOT:
+      break;
+    }
+  }
+
+  prog = g_slice_new(TTGlobProg);
+  prog->n = elems->len;
+  prog->utf8 = utf8;
+  prog->elems = (TTGlobElem *) g_array_free(elems, FALSE);
+  return prog;
+}
+
+static void prog_free(TTGlobProg *prog)
+{
+  int i;
+
+  if (!prog)
+    return;
+
+  for (i = 0; i < prog->n; i++)
+    g_free(prog->elems[i].ranges);
+  g_free(prog->elems);
+  g_slice_free(TTGlobProg, prog);
+}
+
+static const char * const attr_names[] =
+  { "none", "locked", "protected", "archived", NULL };
+
+static int name_to_attr(const char *str)
+{
+  int i;
+
+  for (i = 0; attr_names[i]; i++)
+    if (!g_ascii_strcasecmp(str, attr_names[i]))
+      return i;
+  return -1;
+}
+
+/* Parse one predicate ("size>4k", "attr!=archived", "!locked",
+   "type=PRGM", "folder=MAIN").  Returns -1 if it is invalid. */
+static int pred_parse(CalcModel model, const char *str, TTGlobPred *pred)
+{
+  static const struct { const char *s; int op; } ops[] =
+    {{ "<=", OP_LE }, { ">=", OP_GE }, { "!=", OP_NE },
+     { "<", OP_LT }, { ">", OP_GT }, { "=", OP_EQ }};
+  const char *v;
+  char *field, *end;
+  gulong n;
+  int i, k, t = 0;
+
+  memset(pred, 0, sizeof(TTGlobPred));
+
+  /* a bare attribute name is short for attr=NAME */
+  if (str[0] == '!' && (k = name_to_attr(str + 1)) >= 0) {
+    pred->field = PRED_ATTR;
+    pred->op = OP_NE;
+    pred->value = k;
+    return 0;
+  }
+  else if ((k = name_to_attr(str)) >= 0) {
+    pred->field = PRED_ATTR;
+    pred->op = OP_EQ;
+    pred->value = k;
+    return 0;
+  }
+
+  for (v = str; g_ascii_isalpha(*v); v++)
+    ;
+  for (i = 0; i < (int) G_N_ELEMENTS(ops); i++)
+    if (!strncmp(v, ops[i].s, strlen(ops[i].s)))
+      break;
+  if (v == str || i == G_N_ELEMENTS(ops))
+    return -1;
+
+  field = g_strndup(str, v - str);
+  pred->op = ops[i].op;
+  v += strlen(ops[i].s);
+  k = (pred->op == OP_EQ || pred->op == OP_NE);
+
+  if (!g_ascii_strcasecmp(field, "size")) {
+    pred->field = PRED_SIZE;
+    n = strtoul(v, &end, 10);
+    if (end == v)
+      k = -1;
+    else if (*end == 'k' || *end == 'K') {
+      n *= 1024;
+      end++;
+    }
+    if (*end)
+      k = -1;
+    pred->value = n;
+  }
+  else if (!g_ascii_strcasecmp(field, "attr")) {
+    pred->field = PRED_ATTR;
+    if (!k || (t = name_to_attr(v)) < 0)
+      k = -1;
+    pred->value = t;
+  }
+  else if (!g_ascii_strcasecmp(field, "type")) {
+    pred->field = PRED_TYPE;
+    if (!k || (t = name_to_type(model, v)) < 0)
+      k = -1;
+    pred->value = t;
+  }
+  else if (!g_ascii_strcasecmp(field, "folder")) {
+    pred->field = PRED_FOLDER;
+    if (!k)
+      k = -1;
+    pred->s = tt_utf8_to_ti(model, v);
+  }
+  else {
+    k = -1;
+  }
+
+  g_free(field);
+  if (k < 0) {
+    g_free(pred->s);
+    pred->s = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void preds_free(TTGlobPred *preds, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    g_free(preds[i].s);
+  g_free(preds);
+}
+
+/* Find the predicates at the end of a pattern: a '{' (not escaped or
+   in brackets) whose matching '}' ends the pattern.  Returns a
+   pointer to the '{', or NULL if there are none. */
+static const char * find_preds(const char *pattern)
+{
+  const char *s;
+  int in_brackets = 0;
+
+  for (s = pattern; *s; s++) {
+    if (s[0] == '\\' && s[1])
+      s++;
+    else if (s[0] == '[')
+      in_brackets = 1;
+    else if (s[0] == ']')
+      in_brackets = 0;
+    else if (s[0] == '{' && !in_brackets) {
+      if (strchr(s, '}') == s + strlen(s) - 1)
+	return s;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* Parse the predicates in STR (separated by commas.)  Returns -1 if
+   any is invalid. */
+static int preds_parse(CalcModel model, const char *str, TTGlobPred **preds,
+		       int *n)
+{
+  char **items;
+  int i, status = 0;
+
+  items = g_strsplit(str, ",", -1);
+  *n = g_strv_length(items);
+  *preds = g_new0(TTGlobPred, *n);
+
+  for (i = 0; i < *n; i++) {
+    g_strstrip(items[i]);
+    if (pred_parse(model, items[i], &(*preds)[i]))
+      status = -1;
+  }
+
+  g_strfreev(items);
+  if (status) {
+    preds_free(*preds, *n);
+    *preds = NULL;
+    *n = 0;
+  }
+  return status;
+}
+
+/* Parse the pattern itself (without predicates) */
+static TTGlob * glob_parse_names(CalcModel model, const char *pattern)
 {
   TTGlob *glob;
   TTGlobPattern *pat, *pslash, *pdot, *p;
@@ -200,8 +442,6 @@ static TTGlob * tt_glob_parse(const char *pattern)
   int in_type = 0;
   const char *s, *e;
 
-  g_return_val_if_fail(g_utf8_validate(pattern, -1, NULL), NULL);
-
   pat = NULL;
   pstr = g_string_new(NULL);
   s = pattern;
@@ -218,7 +458,7 @@ static TTGlob * tt_glob_parse(const char *pattern)
 	return NULL;
       }
 
-      pat_append(&pat, LITERAL, pstr);
+      pat_append(model, &pat, LITERAL, pstr);
       g_string_truncate(pstr, 0);
       in_brackets = 1;
       s++;
@@ -230,32 +470,40 @@ static TTGlob * tt_glob_parse(const char *pattern)
 	return NULL;
       }
 
-      pat_append(&pat, BRACKETS, pstr);
+      pat_append(model, &pat, BRACKETS, pstr);
       g_string_truncate(pstr, 0);
       in_brackets = 0;
       s++;
     }
+    else if (!in_brackets && s[0] == '*' && s[1] == '*') {
+      /* folders are only one level deep, so there is nothing for a
+	 recursive wildcard to do */
+      g_printerr("%s: '**' is not supported; use '*'\n", g_get_prgname());
+      g_string_free(pstr, TRUE);
+      pat_free(pat);
+      return NULL;
+    }
     else if (!in_brackets && s[0] == '*') {
-      pat_append(&pat, LITERAL, pstr);
-      pat_append(&pat, STAR, NULL);
+      pat_append(model, &pat, LITERAL, pstr);
+      pat_append(model, &pat, STAR, NULL);
       g_string_truncate(pstr, 0);
       s++;
     }
     else if (!in_brackets && s[0] == '?') {
-      pat_append(&pat, LITERAL, pstr);
-      pat_append(&pat, QUESTION, NULL);
+      pat_append(model, &pat, LITERAL, pstr);
+      pat_append(model, &pat, QUESTION, NULL);
       g_string_truncate(pstr, 0);
       s++;
     }
     else if (!in_brackets && s[0] == '/') {
-      pat_append(&pat, LITERAL, pstr);
-      pat_append(&pat, SLASH, NULL);
+      pat_append(model, &pat, LITERAL, pstr);
+      pat_append(model, &pat, SLASH, NULL);
       g_string_truncate(pstr, 0);
       s++;
     }
     else if (!in_brackets && s[0] == '.') {
-      pat_append(&pat, LITERAL, pstr);
-      pat_append(&pat, DOT, NULL);
+      pat_append(model, &pat, LITERAL, pstr);
+      pat_append(model, &pat, DOT, NULL);
       g_string_truncate(pstr, 0);
       in_type = 1;
       s++;
@@ -282,7 +530,7 @@ static TTGlob * tt_glob_parse(const char *pattern)
     return NULL;
   }
 
-  pat_append(&pat, LITERAL, pstr);
+  pat_append(model, &pat, LITERAL, pstr);
   g_string_free(pstr, TRUE);
 
   if (!pat)
@@ -336,10 +584,57 @@ static TTGlob * tt_glob_parse(const char *pattern)
   if (glob->type_pattern
       && glob->type_pattern->type == LITERAL
       && !glob->type_pattern->next)
-    glob->exact_type = name_to_type(glob->type_pattern->s);
+    glob->exact_type = name_to_type(model, glob->type_pattern->s);
   else
     glob->exact_type = -1;
 
+  glob->folder_prog = prog_compile(model, glob->folder_pattern);
+  glob->name_prog = prog_compile(model, glob->name_pattern);
+  glob->type_prog = prog_compile(model, glob->type_pattern);
+  glob->preds = NULL;
+  glob->n_preds = 0;
+
+  return glob;
+}
+
+/* Parse a glob string into a TTGlob object that can be used to match
+   filenames on a calculator of the given model.  Predicates, if any,
+   are written in braces after the pattern; a pattern with nothing but
+   predicates matches every name. */
+static TTGlob * tt_glob_parse(CalcModel model, const char *pattern)
+{
+  TTGlob *glob;
+  TTGlobPred *preds;
+  const char *b;
+  char *str;
+  int n, e;
+
+  g_return_val_if_fail(g_utf8_validate(pattern, -1, NULL), NULL);
+
+  if (!(b = find_preds(pattern)))
+    return glob_parse_names(model, pattern);
+
+  str = g_strndup(b + 1, strlen(b) - 2);
+  e = preds_parse(model, str, &preds, &n);
+  g_free(str);
+  if (e)
+    return NULL;
+
+  if (b == pattern)
+    glob = glob_parse_names(model, "*");
+  else {
+    str = g_strndup(pattern, b - pattern);
+    glob = glob_parse_names(model, str);
+    g_free(str);
+  }
+
+  if (!glob) {
+    preds_free(preds, n);
+    return NULL;
+  }
+
+  glob->preds = preds;
+  glob->n_preds = n;
   return glob;
 }
 
@@ -351,6 +646,10 @@ static void tt_glob_free(TTGlob *glob)
   pat_free(glob->name_pattern);
   pat_free(glob->folder_pattern);
   pat_free(glob->type_pattern);
+  prog_free(glob->name_prog);
+  prog_free(glob->folder_prog);
+  prog_free(glob->type_prog);
+  preds_free(glob->preds, glob->n_preds);
   g_slice_free(TTGlob, glob);
 }
 
@@ -383,14 +682,15 @@ static int is_tokenized_vartype(CalcModel model, int type)
 
 /* Check if glob is an exact variable name (no wildcards, includes a
    valid variable type, includes folder name if necessary) */
-static int tt_glob_check_exact(const TTGlob *glob, VarRequest *vr)
+static int tt_glob_check_exact(const TTSession *s, const TTGlob *glob,
+			       VarRequest *vr)
 {
   char *tokstr;
 
   if (vr)
     memset(vr, 0, sizeof(VarRequest));
 
-  if (glob->exact_type < 0)
+  if (glob->exact_type < 0 || glob->n_preds)
     return 0;
 
   if (vr)
@@ -402,8 +702,8 @@ static int tt_glob_check_exact(const TTGlob *glob, VarRequest *vr)
     return 0;
 
   if (vr) {
-    if (is_tokenized_vartype(calc_model, vr->type)) {
-      tokstr = ticonv_varname_tokenize(calc_model, glob->name_pattern->s,
+    if (is_tokenized_vartype(s->model, vr->type)) {
+      tokstr = ticonv_varname_tokenize(s->model, glob->name_pattern->s,
 				       vr->type);
       strncpy(vr->name, tokstr, sizeof(vr->name) - 1);
       g_free(tokstr);
@@ -413,7 +713,7 @@ static int tt_glob_check_exact(const TTGlob *glob, VarRequest *vr)
     }
   }
 
-  if (ticalcs_calc_features(calc_handle) & FTS_FOLDER) {
+  if (ticalcs_calc_features(s->calc) & FTS_FOLDER) {
     if (!glob->folder_pattern)
       return 0;
     if (glob->folder_pattern->type != LITERAL
@@ -421,7 +721,7 @@ static int tt_glob_check_exact(const TTGlob *glob, VarRequest *vr)
       return 0;
 
     if (vr) {
-      strncpy(vr->folder, glob->name_pattern->s, sizeof(vr->folder) - 1);
+      strncpy(vr->folder, glob->folder_pattern->s, sizeof(vr->folder) - 1);
     }
   }
   else {
@@ -432,233 +732,232 @@ static int tt_glob_check_exact(const TTGlob *glob, VarRequest *vr)
   return 1;
 }
 
-static int char_in_set_sbcs(const char *s, char c)
+static int elem_matches(const TTGlobElem *el, gunichar c)
 {
-  while (*s) {
-    if (s[1] == '-' && s[2]) {
-      if (c >= s[0] && c <= s[2])
-	return 1;
-      s += 3;
-    }
-    else {
-      if (c == s[0])
-	return 1;
-      s++;
-    }
-  }
+  int i;
 
-  return 0;
-}
+  switch (el->type) {
+  case ELEM_CHAR:
+    return (c == el->c);
 
-static int char_in_set_utf8(const char *s, const char *c)
-{
-  const char *c1 = g_utf8_next_char(c);
-  const char *s1;
+  case ELEM_ANY:
+    return 1;
 
-  while (*s) {
-    s1 = g_utf8_next_char(s);
-    if (s1[0] == '-' && s1[1]) {
-      if (memcmp(c, s, c1 - c) >= 0
-	  && memcmp(c, s1 + 1, c1 - c) <= 0)
-	return 1;
-      s = g_utf8_next_char(s1);
-    }
-    else {
-      if (memcmp(c, s, c1 - c) == 0)
+  case ELEM_SET:
+    if (c < 256)
+      return ((el->bits[c >> 5] >> (c & 31)) & 1);
+
+    for (i = 0; i < el->n_ranges; i++)
+      if (c >= el->ranges[2 * i] && c <= el->ranges[2 * i + 1])
 	return 1;
-      s = s1;
-    }
+    return 0;
+
+  case ELEM_STAR:
+    break;
   }
 
   return 0;
 }
 
-static int pat_match_sub(const TTGlobPattern *pat, const char *str, int utf8)
+/* Match a string against a compiled pattern.  Rather than trying
+   every way of dividing the string among the stars, this remembers
+   only the most recent star, and on a mismatch lets that star absorb
+   one more character; an earlier star never needs to absorb more,
+   since whatever it could match can equally be matched by the later
+   one.  So the time is at worst proportional to the length of the
+   string times the length of the pattern. */
+static int prog_match(const TTGlobProg *prog, const char *str)
 {
-  while (pat) {
-    switch (pat->type) {
-    case LITERAL:
-      if (memcmp(str, pat->s, pat->n) != 0)
-	return 0;
-      str += pat->n;
-      break;
+  const TTGlobElem *el = prog->elems;
+  const char *s, *next, *star_str = NULL;
+  int i = 0, star = -1;
+  gunichar c;
 
-    case BRACKETS:
-      if (!*str)
-	return 0;
-
-      if (utf8) {
-	if (!char_in_set_utf8(pat->s, str))
-	  return 0;
-	str = g_utf8_next_char(str);
-      }
-      else {
-	if (!char_in_set_sbcs(pat->s, *str))
-	  return 0;
-	str++;
-      }
-      break;
-
-    case QUESTION:
-      if (!*str)
-	return 0;
-      if (utf8)
-	str = g_utf8_next_char(str);
-      else
-	str++;
-      break;
+  if (prog->utf8 && !g_utf8_validate(str, -1, NULL))
+    return 0;
 
-    case STAR:
-      if (!pat->next)
-	return 1;
+  s = str;
+  while (*s) {
+    if (i < prog->n && el[i].type == ELEM_STAR) {
+      star = ++i;
+      star_str = s;
+      continue;
+    }
 
-      while (*str) {
-	if (pat_match_sub(pat->next, str, utf8))
-	  return 1;
-	if (utf8)
-	  str = g_utf8_next_char(str);
-	else
-	  str++;
-      }
-      return 0;
+    next = s;
+    c = next_char(&next, prog->utf8);
 
-    case SLASH:
-    case DOT:
+    if (i < prog->n && elem_matches(&el[i], c)) {
+      i++;
+      s = next;
+    }
+    else if (star >= 0) {
+      next_char(&star_str, prog->utf8);
+      s = star_str;
+      i = star;
+    }
+    else {
       return 0;
     }
-
-    pat = pat->next;
   }
 
-  return (!*str);
+  while (i < prog->n && el[i].type == ELEM_STAR)
+    i++;
+
+  return (i == prog->n);
 }
 
-static int pat_match(const TTGlobPattern *pat, const char *str)
+static int match_type(const TTGlobProg *prog, const TTDirEntry *de)
 {
-  if (model_uses_utf8(calc_model)) {
-    if (!g_utf8_validate(str, -1, NULL))
-      return 0;
-    return pat_match_sub(pat, str, 1);
-  }
-  else {
-    return pat_match_sub(pat, str, 0);
+  if (!de->type_name)
+    return 0;
+
+  return (prog_match(prog, de->type_name)
+	  || prog_match(prog, de->type_fext));
+}
+
+static int pred_compare(int op, guint32 a, guint32 b)
+{
+  switch (op) {
+  case OP_EQ: return (a == b);
+  case OP_NE: return (a != b);
+  case OP_LT: return (a < b);
+  case OP_LE: return (a <= b);
+  case OP_GT: return (a > b);
+  case OP_GE: return (a >= b);
   }
+  return 0;
 }
 
-static int pat_match_type(const TTGlobPattern *pat, int type)
+/* Check if a variable satisfies all of the glob's predicates */
+static int preds_match(const TTGlob *glob, const VarEntry *ve)
 {
-  const char *s;
-  char *us;
+  const TTGlobPred *pred;
+  int i, r;
 
-  s = tifiles_vartype2string(calc_model, type);
-  if (!s || !s[0])
-    return 0;
-  us = g_ascii_strup(s, -1);
-  if (pat_match(pat, us)) {
-    g_free(us);
-    return 1;
-  }
-  g_free(us);
+  for (i = 0; i < glob->n_preds; i++) {
+    pred = &glob->preds[i];
 
-  s = tifiles_vartype2fext(calc_model, type);
-  us = g_ascii_strup(s, -1);
-  if (pat_match(pat, us)) {
-    g_free(us);
-    return 1;
+    switch (pred->field) {
+    case PRED_SIZE:
+      r = pred_compare(pred->op, ve->size, pred->value);
+      break;
+    case PRED_ATTR:
+      r = pred_compare(pred->op, ve->attr, pred->value);
+      break;
+    case PRED_TYPE:
+      r = pred_compare(pred->op, ve->type, pred->value);
+      break;
+    case PRED_FOLDER:
+      r = pred_compare(pred->op, strcmp(ve->folder, pred->s) != 0, 0);
+      break;
+    default:
+      r = 0;
+    }
+
+    if (!r)
+      return 0;
   }
-  g_free(us);
-  return 0;
+  return 1;
 }
 
 /* Check if glob matches this variable */
-static int glob_matches_var(const TTGlob *glob, const VarEntry *ve)
+static int glob_matches_var(const TTGlob *glob, const TTDirEntry *de)
 {
-  char *s;
+  const VarEntry *ve = de->ve;
 
-  if (!ve)
+  if (!preds_match(glob, ve))
     return 0;
-  if (!glob)
-    return 1;
 
   if (glob->exact_type >= 0) {
     if (ve->type != glob->exact_type)
       return 0;
   }
-  else if (glob->type_pattern) {
-    if (!pat_match_type(glob->type_pattern, ve->type))
+  else if (glob->type_prog) {
+    if (!match_type(glob->type_prog, de))
       return 0;
   }
 
-  if (glob->folder_pattern) {
-    if (!pat_match(glob->folder_pattern, ve->folder))
+  if (glob->folder_prog) {
+    if (!prog_match(glob->folder_prog, ve->folder))
       return 0;
   }
 
-  s = ticonv_varname_detokenize(calc_model, ve->name, ve->type);
-  if (!pat_match(glob->name_pattern, s)) {
-    g_free(s);
-    return 0;
-  }
-  g_free(s);
-
-  return 1;
+  return prog_match(glob->name_prog, de->name);
 }
 
-/* Run func for every variable that matches */
-static int tt_glob_foreach(const TTGlob *glob, GNode *vars, GNode *apps,
-			   int (*func)(VarEntry *ve))
+/* Find the variables that match any of the N GLOBS.  Each variable
+   is added to PLAN[i] for every glob i that matches it, and
+   MATCHED[i] is set.  The listing is scanned once, however many
+   patterns there are. */
+static void match_entries(const TTDirEntry *entries, int n_entries,
+			  TTGlob **globs, int n, int *matched,
+			  GPtrArray **plan)
 {
-  GNode *f, *v;
-  int matched = 0, e;
-  VarEntry *ve;
-
-  if (vars) {
-    for (f = vars->children; f; f = f->next) {
-      for (v = f->children; v; v = v->next) {
-	ve = v->data;
-	ve->type &= VAR_TYPE_MASK;
-
-	if (!glob_matches_var(glob, ve))
-	  continue;
-
-	if ((e = (*func)(ve)))
-	  return e;
+  int i, j;
 
-	matched = 1;
+  for (j = 0; j < n_entries; j++) {
+    for (i = 0; i < n; i++) {
+      if (globs[i] && glob_matches_var(globs[i], &entries[j])) {
+	matched[i] = 1;
+	g_ptr_array_add(plan[i], entries[j].ve);
       }
     }
   }
+}
 
-  if (apps) {
-    for (f = apps->children; f; f = f->next) {
-      for (v = f->children; v; v = v->next) {
-	ve = v->data;
-	ve->type &= VAR_TYPE_MASK;
+/* Check whether any of the folder programs in DATA (a GPtrArray) can
+   match FOLDER */
+static int folder_wanted(const char *folder, gpointer data)
+{
+  GPtrArray *progs = data;
+  guint i;
 
-	if (!glob_matches_var(glob, ve))
-	  continue;
+  for (i = 0; i < progs->len; i++)
+    if (prog_match(g_ptr_array_index(progs, i), folder))
+      return 1;
+  return 0;
+}
 
-	if ((e = (*func)(ve)))
-	  return e;
+/* Collect the folder programs of the N GLOBS, so that only the
+   folders they can match need to be listed.  Returns NULL if some
+   glob can match any folder. */
+static GPtrArray * folder_progs(TTGlob **globs, int n)
+{
+  GPtrArray *progs;
+  int i;
 
-	matched = 1;
-      }
+  progs = g_ptr_array_new();
+  for (i = 0; i < n; i++) {
+    if (!globs[i])
+      continue;
+    if (!globs[i]->folder_prog) {
+      g_ptr_array_free(progs, TRUE);
+      return NULL;
     }
+    g_ptr_array_add(progs, globs[i]->folder_prog);
   }
-
-  if (matched)
-    return 0;
-  else
-    return -1;
+  return progs;
 }
 
-/* Run func for every variable matching one of the input patterns */
-int tt_globs_foreach(char **patterns, int (*func)(VarEntry *ve))
+/* Run func for every variable matching one of the input patterns.
+   DATA is passed to FUNC.  FUNC is called once for each variable,
+   even if several patterns match it; variables are taken in the order
+   of the first pattern that matches them, then in directory order.
+   (FUNC must not call tt_dirlist_changed(); do that after this
+   function returns.) */
+int tt_globs_foreach(TTSession *s, char **patterns,
+		     TTVarFunc func, gpointer data)
 {
-  int i, n, e, status = 0;
-  TTGlob **globs;
-  VarEntry ve;
-  GNode *vars = NULL, *apps = NULL;
+  int i, j, n, e, status = 0, notfound = 0;
+  TTGlob **globs, **scan = NULL;
+  int *matched = NULL;
+  VarEntry *exact, *ve;
+  GPtrArray **plan, *folders = NULL;
+  GHashTable *seen;
+  const TTDirEntry *entries;
+  int n_entries;
+  char *key;
 
   for (i = 0; patterns && patterns[i]; i++)
     ;
@@ -668,9 +967,12 @@ int tt_globs_foreach(char **patterns, int (*func)(VarEntry *ve))
 
   n = i;
   globs = g_new(TTGlob *, n);
+  exact = g_new0(VarEntry, n);
+  plan = g_new(GPtrArray *, n);
 
   for (i = 0; i < n; i++) {
-    globs[i] = tt_glob_parse(patterns[i]);
+    plan[i] = g_ptr_array_new();
+    globs[i] = tt_glob_parse(s->model, patterns[i]);
 
     if (!globs[i]) {
       g_printerr("%s: invalid pattern '%s'\n",
@@ -679,65 +981,107 @@ int tt_globs_foreach(char **patterns, int (*func)(VarEntry *ve))
     }
   }
 
+  /* exact names can be requested without reading the directory;
+     everything else is matched in a single pass over the listing */
   for (i = 0; !status && i < n; i++) {
-    if (!tt_glob_check_exact(globs[i], NULL)) {
-      if (!(ticalcs_calc_features(calc_handle) & OPS_DIRLIST)) {
-	g_printerr("%s: calculator does not support"
-		   " directory listing\n",
-		   g_get_prgname());
-	status = 10;
-      }
-      else if ((e = ticalcs_calc_get_dirlist(calc_handle, &vars, &apps))) {
-	tt_print_error(e, "unable to read directory listing");
-	status = 2;
+    if (tt_glob_check_exact(s, globs[i], &exact[i])) {
+      g_ptr_array_add(plan[i], &exact[i]);
+    }
+    else {
+      if (!scan) {
+	scan = g_new0(TTGlob *, n);
+	matched = g_new0(int, n);
       }
-      break;
+      scan[i] = globs[i];
     }
   }
 
-  for (i = 0; !status && i < n; i++) {
-    if (tt_glob_check_exact(globs[i], &ve)) {
-      status = (*func)(&ve);
+  if (!status && scan) {
+    /* if every pattern names its folders, only those need be listed */
+    folders = folder_progs(scan, n);
+
+    if (!(ticalcs_calc_features(s->calc) & OPS_DIRLIST)) {
+      g_printerr("%s: calculator does not support"
+		 " directory listing\n",
+		 g_get_prgname());
+      status = 10;
+    }
+    else if ((e = tt_get_dir_entries_in(s, folders ? &folder_wanted : NULL,
+					folders, &entries, &n_entries))) {
+      tt_print_error(e, "unable to read directory listing");
+      status = 2;
     }
     else {
-      status = tt_glob_foreach(globs[i], vars, apps, func);
-      if (status < 0) {
-	g_printerr("%s: variable '%s' not found\n",
-		   g_get_prgname(), patterns[i]);
-	status = 2;
+      match_entries(entries, n_entries, scan, n, matched, plan);
+
+      for (i = 0; i < n; i++) {
+	if (scan[i] && !matched[i]) {
+	  g_printerr("%s: variable '%s' not found\n",
+		     g_get_prgname(), patterns[i]);
+	  notfound = 1;
+	}
       }
     }
   }
 
-  for (i = 0; i < n; i++)
+  /* run the plan, skipping variables already done */
+  seen = g_hash_table_new_full(&g_str_hash, &g_str_equal, &g_free, NULL);
+
+  for (i = 0; !status && i < n; i++) {
+    for (j = 0; !status && j < (int) plan[i]->len; j++) {
+      ve = g_ptr_array_index(plan[i], j);
+      key = tt_var_key(ve);
+
+      if (g_hash_table_lookup(seen, key)) {
+	g_free(key);
+	continue;
+      }
+
+      g_hash_table_insert(seen, key, ve);
+      status = (*func)(s, ve, data);
+    }
+  }
+
+  if (!status && notfound)
+    status = 2;
+
+  g_hash_table_destroy(seen);
+
+  for (i = 0; i < n; i++) {
     tt_glob_free(globs[i]);
+    g_ptr_array_free(plan[i], TRUE);
+  }
   g_free(globs);
+  g_free(exact);
+  g_free(plan);
+  g_free(scan);
+  if (folders)
+    g_ptr_array_free(folders, TRUE);
+  g_free(matched);
 
-  ticalcs_dirlist_destroy(&vars);
-  ticalcs_dirlist_destroy(&apps);
   return status;
 }
 
-int tt_vars_foreach(int (*func)(VarEntry *ve))
+/* Run func for every variable on the calculator */
+int tt_vars_foreach(TTSession *s, TTVarFunc func, gpointer data)
 {
-  GNode *vars = NULL, *apps = NULL;
-  int status, e;
+  const TTDirEntry *entries;
+  int i, n, e;
 
-  if (!(ticalcs_calc_features(calc_handle) & OPS_DIRLIST)) {
+  if (!(ticalcs_calc_features(s->calc) & OPS_DIRLIST)) {
     g_printerr("%s: calculator does not support"
 	       " directory listing\n",
 	       g_get_prgname());
     return 10;
   }
-  else if ((e = ticalcs_calc_get_dirlist(calc_handle, &vars, &apps))) {
+  else if ((e = tt_get_dir_entries(s, &entries, &n))) {
     tt_print_error(e, "unable to read directory listing");
-    ticalcs_dirlist_destroy(&vars);
-    ticalcs_dirlist_destroy(&apps);
     return 2;
   }
 
-  status = tt_glob_foreach(NULL, vars, apps, func);
-  ticalcs_dirlist_destroy(&vars);
-  ticalcs_dirlist_destroy(&apps);
-  return status;
+  for (i = 0; i < n; i++)
+    if ((e = (*func)(s, entries[i].ve, data)))
+      return e;
+
+  return 0;
 }
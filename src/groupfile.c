@@ -0,0 +1,1568 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Writing group and TIGroup files one variable at a time, so that
+   variables need not be kept in memory until the end of a transfer.
+
+   Each variable is first written as a single-variable file by
+   libtifiles (so the encoding of each entry is libtifiles' own), and
+   the entry is then copied out of that file:
+
+   - TI-8x group files are simply the entries of single files one
+     after another, so they are written straight to the output file;
+     the data length and checksum are filled in at the end.
+
+   - TI-9x group files begin with a table of the entries, so the data
+     is written to a spool file, and the output file (header, table,
+     then data) is written at the end.
+
+   - TIGroup files are ZIP archives of single files; each file is
+     written as it arrives, and the central directory at the end.
+     Files are compressed (deflated) by a pool of threads, one per
+     processor, while later variables are still being received, and
+     written out in the order they arrived; a file that does not get
+     any smaller is stored instead.
+
+   - A backup store is a directory in which each single file is kept
+     once, named after a SHA-256 hash of its name, attributes and
+     contents (objects/XX/HASH.ext), however many calculators or
+     backups include it.  The file's header (date and comment) is not
+     part of the hash, so an unchanged variable is not stored again.  Each backup writes a
+     snapshot (snapshots/DEVICE/DATE-TIME.snap), listing the files it
+     includes, one per line, as paths relative to the snapshot's
+     directory, each followed by a tab and the file's name as it would
+     appear in a TIGroup.  tiput accepts snapshot files in place of the
+     files they list.
+
+   - Packs (.tpk files) are meant to be read in place, by mapping the
+     file into memory, so that any one variable can be found and sent
+     without reading or unpacking the rest.  All numbers are
+     little-endian:
+
+       header (PACK_HEADER_SIZE bytes):
+	 0  magic, "TTPACK1\n"
+	 8  calculator model (CalcModel)
+	12  number of entries
+	16  offset of the index
+	20  offset of the string table
+	24  size of the string table
+	28  (reserved)
+
+       then the data of each entry, each starting at a multiple of
+       PACK_ALIGN bytes;
+
+       then the index (PACK_ENTRY_SIZE bytes per entry), sorted by
+       folder and name (compared as bytes), then type:
+	 0  folder name (offset in the string table)
+	 4  variable name (offset in the string table)
+	 8  kind (TT_PACK_VAR = variable data, TT_PACK_FILE = a
+	    single file as written by libtifiles, used for
+	    applications)
+	 9  type
+	10  attributes
+	11  version
+	12  offset of data
+	16  length of data
+	20  (reserved)
+	24  SHA-256 hash of data (32 bytes)
+	56  (reserved)
+
+       then the string table, of NUL-terminated names in the
+       calculator's own encoding.
+
+     The data is written as it arrives, and the index at the end.
+
+   Whatever has been added is still written out when the writer is
+   closed after an error, so a failed transfer leaves a usable file
+   containing the variables received before the failure. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#include <glib/gstdio.h>
+#include "titools.h"
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+/* TI-8x: signature, 3 bytes, comment, then the 2-byte data length */
+#define HEADER_8X_SIZE 55
+#define LENGTH_8X_OFFSET 53
+
+/* TI-9x: signature, 2 bytes, default folder, comment, then the 2-byte
+   number of entries and the table (16 bytes per entry); a single
+   file's data begins after the end offset and the 0xA5 0x5A mark */
+#define HEADER_9X_SIZE 58
+#define TABLE_9X_OFFSET 60
+#define DATA_9X_OFFSET 82
+
+#define SNAPSHOT_HEADER "# TITools snapshot\n"
+
+#define PACK_MAGIC "TTPACK1\n"
+#define PACK_HEADER_SIZE 64
+#define PACK_ENTRY_SIZE 64
+#define PACK_ALIGN 16
+
+/* TIG: files that may be waiting to be compressed, per thread */
+#define ZIP_PENDING_PER_THREAD 2
+
+enum { GROUP_8X, GROUP_9X, GROUP_TIG, GROUP_STORE, GROUP_PACK };
+
+typedef struct _TTGroupEntry {
+  char folder[8];		/* folder name, padded with zeros */
+  guint8 name[8];		/* name as in the file's table */
+  guint8 type;
+  guint8 attr;
+  guint32 size;			/* size of the data block */
+} TTGroupEntry;
+
+typedef struct _TTZipMember {
+  char *name;
+  guint16 version;		/* version needed to extract */
+  guint16 flags;
+  guint16 method;		/* 0 = stored, 8 = deflated */
+  guint32 crc;
+  guint32 csize;		/* compressed size */
+  guint32 size;			/* uncompressed size */
+  guint32 offset;		/* offset of the local header */
+} TTZipMember;
+
+/* A TIGroup file waiting to be written (see add_tig) */
+typedef struct _TTZipJob {
+  TTZipMember m;
+  guint8 *data;			/* uncompressed data */
+  guint8 *cdata;		/* compressed data, or NULL to store */
+  int done;			/* compression finished */
+} TTZipJob;
+
+struct _TTGroupWriter {
+  CalcModel model;
+  char *filename;
+  char *partname;		/* written here, then renamed */
+  int format;
+  int failed;			/* something could not be added */
+  int broken;			/* the file cannot be completed */
+  FILE *out;			/* output file, once opened */
+  char *tmpname;		/* single files are written here first */
+
+  int nvars;
+  int napps;
+
+  guint32 length;		/* 8x: data length so far */
+  guint16 sum;			/* 8x: checksum so far */
+
+  FILE *spool;			/* 9x: data blocks */
+  char *spoolname;
+  guint8 header[HEADER_9X_SIZE]; /* 9x: header of the first file */
+  GArray *entries;		/* 9x: TTGroupEntry */
+
+  GArray *members;		/* TIG: TTZipMember */
+  guint16 dos_time, dos_date;
+  int level;			/* TIG: compression level, 0 to store */
+  GThreadPool *pool;		/* TIG: compression threads */
+  int nthreads;
+  GQueue jobs;			/* TIG: TTZipJob, in order of arrival */
+  GMutex lock;			/* (protects jobs' done flags) */
+  GCond cond;
+
+  char *store;			/* store: top directory */
+
+  GArray *records;		/* pack: TTPackRecord */
+  GString *strings;		/* pack: string table */
+  guint32 pos;			/* pack: current offset */
+};
+
+typedef struct _TTPackRecord {
+  guint32 folder;		/* offset in string table */
+  guint32 name;			/* offset in string table */
+  guint8 kind, type, attr, version;
+  guint32 offset, length;
+  guint8 hash[32];
+} TTPackRecord;
+
+static int write_failed(TTGroupWriter *w, const char *filename)
+{
+  if (!w->broken)
+    g_printerr("%s: %s: %s\n", g_get_prgname(), filename,
+	       g_strerror(errno));
+  w->failed = w->broken = 1;
+  return 1;
+}
+
+static void put_le16(GString *buf, guint16 n)
+{
+  g_string_append_c(buf, n & 0xff);
+  g_string_append_c(buf, (n >> 8) & 0xff);
+}
+
+static void put_le32(GString *buf, guint32 n)
+{
+  put_le16(buf, n & 0xffff);
+  put_le16(buf, (n >> 16) & 0xffff);
+}
+
+static int out_write(TTGroupWriter *w, const void *data, gsize n)
+{
+  if (n && fwrite(data, 1, n, w->out) != n)
+    return write_failed(w, w->partname);
+  return 0;
+}
+
+/* Set up the parts of a writer common to all formats.  Returns NULL
+   (after freeing the writer) on failure. */
+static TTGroupWriter * writer_init(TTGroupWriter *w)
+{
+  GError *err = NULL;
+  int fd;
+
+  w->partname = g_strconcat(w->filename, ".part", NULL);
+
+  if ((fd = g_file_open_tmp("titools-XXXXXX", &w->tmpname, &err)) < 0) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    g_free(w->store);
+    g_free(w->filename);
+    g_free(w->partname);
+    g_slice_free(TTGroupWriter, w);
+    return NULL;
+  }
+  close(fd);
+
+  w->entries = g_array_new(FALSE, FALSE, sizeof(TTGroupEntry));
+  w->members = g_array_new(FALSE, FALSE, sizeof(TTZipMember));
+  w->records = g_array_new(FALSE, FALSE, sizeof(TTPackRecord));
+  w->strings = g_string_new(NULL);
+  w->level = Z_DEFAULT_COMPRESSION;
+  g_queue_init(&w->jobs);
+  g_mutex_init(&w->lock);
+  g_cond_init(&w->cond);
+  return w;
+}
+
+/* Create a group file writer.  If FILENAME ends in ".tig", a TIGroup
+   file is written; if it ends in ".tpk", a pack; otherwise, a group
+   file for the given model.
+   Nothing is created until the first variable is added.  Returns NULL
+   (after printing a message) if the file cannot be written. */
+TTGroupWriter * tt_group_writer_new(CalcModel model, const char *filename)
+{
+  TTGroupWriter *w;
+  const char *p;
+
+  w = g_slice_new0(TTGroupWriter);
+  w->model = model;
+
+  if ((p = strrchr(filename, '.')) && !g_ascii_strcasecmp(p, ".tig"))
+    w->format = GROUP_TIG;
+  else if (p && !g_ascii_strcasecmp(p, ".tpk"))
+    w->format = GROUP_PACK;
+  else if (tifiles_calc_is_ti8x(model))
+    w->format = GROUP_8X;
+  else if (tifiles_calc_is_ti9x(model) && model != CALC_NSPIRE)
+    w->format = GROUP_9X;
+  else {
+    g_printerr("%s: group files are not supported for this calculator"
+	       " (use a .tig file)\n", g_get_prgname());
+    g_slice_free(TTGroupWriter, w);
+    return NULL;
+  }
+
+  w->filename = g_strdup(filename);
+  return writer_init(w);
+}
+
+/* Create a writer that adds files to the backup store STORE, and
+   writes a new snapshot of them for the calculator named DEVICE (see
+   tt_device_id.)  Returns NULL (after printing a message) on
+   failure. */
+TTGroupWriter * tt_group_writer_new_store(CalcModel model, const char *store,
+					  const char *device)
+{
+  TTGroupWriter *w;
+  char *dir, date[32];
+  time_t t;
+
+  dir = g_build_filename(store, "snapshots", device, NULL);
+  if (g_mkdir_with_parents(dir, 0777)) {
+    g_printerr("%s: %s: %s\n", g_get_prgname(), dir, g_strerror(errno));
+    g_free(dir);
+    return NULL;
+  }
+
+  t = time(NULL);
+  strftime(date, sizeof(date), "%Y%m%d-%H%M%S.snap", localtime(&t));
+
+  w = g_slice_new0(TTGroupWriter);
+  w->model = model;
+  w->format = GROUP_STORE;
+  w->store = g_strdup(store);
+  w->filename = g_build_filename(dir, date, NULL);
+  g_free(dir);
+  return writer_init(w);
+}
+
+/* Get the name of the file being written */
+const char * tt_group_writer_filename(const TTGroupWriter *w)
+{
+  return w->filename;
+}
+
+/* Set the compression level (1 to 9, 0 to store files uncompressed,
+   or -1 for zlib's default) for a TIGroup file.  Must be called
+   before anything is added. */
+void tt_group_writer_set_compression(TTGroupWriter *w, int level)
+{
+  w->level = level;
+}
+
+/* Get the name of a variable's file within a TIGroup */
+char * tt_group_member_name(CalcModel model, const VarEntry *ve)
+{
+  return tifiles_build_filename(model, ve);
+}
+
+/* Open the output (and spool) file for the first variable */
+static int open_output(TTGroupWriter *w)
+{
+  GError *err = NULL;
+  char block[PACK_HEADER_SIZE];
+  struct tm *tm;
+  time_t t;
+  int fd;
+
+  if (w->broken)
+    return 1;
+  if (w->out)
+    return 0;
+
+  if (!(w->out = g_fopen(w->partname, "wb")))
+    return write_failed(w, w->partname);
+
+  if (w->format == GROUP_9X) {
+    if ((fd = g_file_open_tmp("titools-XXXXXX", &w->spoolname, &err)) < 0) {
+      g_printerr("%s: %s\n", g_get_prgname(), err->message);
+      g_error_free(err);
+      w->failed = w->broken = 1;
+      return 1;
+    }
+    if (!(w->spool = fdopen(fd, "w+b"))) {
+      close(fd);
+      return write_failed(w, w->spoolname);
+    }
+  }
+
+  if (w->format == GROUP_STORE)
+    return out_write(w, SNAPSHOT_HEADER, strlen(SNAPSHOT_HEADER));
+
+  /* (the header is filled in at the end) */
+  if (w->format == GROUP_PACK) {
+    memset(block, 0, PACK_HEADER_SIZE);
+    w->pos = PACK_HEADER_SIZE;
+    return out_write(w, block, PACK_HEADER_SIZE);
+  }
+
+  if (w->format == GROUP_TIG) {
+    t = time(NULL);
+    tm = localtime(&t);
+    w->dos_time = ((tm->tm_hour << 11) | (tm->tm_min << 5)
+		   | (tm->tm_sec / 2));
+    w->dos_date = (((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5)
+		   | tm->tm_mday);
+  }
+
+  return 0;
+}
+
+/* Add one single-variable file (DATA, LENGTH bytes) to an 8x group */
+static int add_8x(TTGroupWriter *w, const guint8 *data, gsize length)
+{
+  gsize n, i;
+
+  if (length < HEADER_8X_SIZE + 2 || strncmp((char *) data, "**TI", 4)) {
+    g_printerr("%s: unexpected file format from libtifiles\n",
+	       g_get_prgname());
+    w->failed = 1;
+    return 1;
+  }
+
+  n = length - HEADER_8X_SIZE - 2;
+  if (w->length + n > 0xffff) {
+    g_printerr("%s: too many variables for a single group file\n",
+	       g_get_prgname());
+    return 1;
+  }
+
+  /* the first file's header is kept, and its length corrected at the
+     end */
+  if (w->nvars == 0 && out_write(w, data, HEADER_8X_SIZE))
+    return 1;
+
+  if (out_write(w, data + HEADER_8X_SIZE, n))
+    return 1;
+
+  for (i = 0; i < n; i++)
+    w->sum += data[HEADER_8X_SIZE + i];
+  w->length += n;
+  return 0;
+}
+
+/* Add one single-variable file to a 9x group */
+static int add_9x(TTGroupWriter *w, const VarEntry *ve,
+		  const guint8 *data, gsize length)
+{
+  TTGroupEntry ent;
+
+  if (length < DATA_9X_OFFSET + 6 || strncmp((char *) data, "**TI", 4)) {
+    g_printerr("%s: unexpected file format from libtifiles\n",
+	       g_get_prgname());
+    w->failed = 1;
+    return 1;
+  }
+
+  if (w->nvars == 0)
+    memcpy(w->header, data, HEADER_9X_SIZE);
+
+  memset(&ent, 0, sizeof(ent));
+  strncpy(ent.folder, ve->folder, sizeof(ent.folder));
+  memcpy(ent.name, data + TABLE_9X_OFFSET + 4, 8);
+  ent.type = data[TABLE_9X_OFFSET + 12];
+  ent.attr = data[TABLE_9X_OFFSET + 13];
+  ent.size = length - DATA_9X_OFFSET;
+
+  if (fwrite(data + DATA_9X_OFFSET, 1, ent.size, w->spool) != ent.size)
+    return write_failed(w, w->spoolname);
+
+  g_array_append_val(w->entries, ent);
+  return 0;
+}
+
+/* Write the local header for a TIGroup member, and record the
+   member for the central directory.  The member's data must be
+   written next. */
+static int tig_begin(TTGroupWriter *w, TTZipMember *m)
+{
+  GString *hdr;
+  long pos;
+  int e;
+
+  if ((pos = ftell(w->out)) < 0)
+    return write_failed(w, w->partname);
+  m->offset = pos;
+
+  hdr = g_string_new(NULL);
+  put_le32(hdr, 0x04034b50);	/* local file header */
+  put_le16(hdr, m->version);
+  put_le16(hdr, m->flags);
+  put_le16(hdr, m->method);
+  put_le16(hdr, w->dos_time);
+  put_le16(hdr, w->dos_date);
+  put_le32(hdr, m->crc);
+  put_le32(hdr, m->csize);
+  put_le32(hdr, m->size);
+  put_le16(hdr, strlen(m->name));
+  put_le16(hdr, 0);		/* extra field length */
+  g_string_append(hdr, m->name);
+
+  e = out_write(w, hdr->str, hdr->len);
+  g_string_free(hdr, TRUE);
+
+  if (e)
+    return 1;
+
+  g_array_append_val(w->members, *m);
+  m->name = NULL;
+  return 0;
+}
+
+/* Compress a TIGroup file (run by the writer's thread pool) */
+static void tig_deflate(gpointer data, gpointer user_data)
+{
+  TTZipJob *job = data;
+  TTGroupWriter *w = user_data;
+  z_stream z;
+  uLong bound;
+
+  job->m.crc = crc32(crc32(0, NULL, 0), job->data, job->m.size);
+
+  /* (raw deflate data, without a zlib header) */
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, w->level, Z_DEFLATED, -MAX_WBITS, 8,
+		   Z_DEFAULT_STRATEGY) == Z_OK) {
+    bound = deflateBound(&z, job->m.size);
+    job->cdata = g_malloc(bound);
+    z.next_in = job->data;
+    z.avail_in = job->m.size;
+    z.next_out = job->cdata;
+    z.avail_out = bound;
+
+    if (deflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out < job->m.size) {
+      job->m.version = 20;
+      job->m.method = 8;
+      job->m.csize = z.total_out;
+    }
+    else {
+      g_free(job->cdata);
+      job->cdata = NULL;
+    }
+    deflateEnd(&z);
+  }
+
+  g_mutex_lock(&w->lock);
+  job->done = 1;
+  g_cond_broadcast(&w->cond);
+  g_mutex_unlock(&w->lock);
+}
+
+static void job_free(TTZipJob *job)
+{
+  g_free(job->m.name);
+  g_free(job->data);
+  g_free(job->cdata);
+  g_slice_free(TTZipJob, job);
+}
+
+/* Write out the TIGroup files that have been compressed, in order.
+   If WAIT is nonzero, wait for all of them; otherwise, wait only
+   until few enough are left waiting. */
+static int tig_flush(TTGroupWriter *w, int wait)
+{
+  TTZipJob *job;
+  guint max;
+  int done, e = 0;
+
+  max = (wait ? 0 : (guint) w->nthreads * ZIP_PENDING_PER_THREAD);
+
+  while ((job = g_queue_peek_head(&w->jobs))) {
+    g_mutex_lock(&w->lock);
+    while (!job->done && w->jobs.length > max)
+      g_cond_wait(&w->cond, &w->lock);
+    done = job->done;
+    g_mutex_unlock(&w->lock);
+
+    if (!done)
+      break;
+
+    g_queue_pop_head(&w->jobs);
+    if (!e && !w->broken) {
+      if (!(e = tig_begin(w, &job->m))) {
+	if (job->cdata)
+	  e = out_write(w, job->cdata, job->m.csize);
+	else
+	  e = out_write(w, job->data, job->m.size);
+      }
+    }
+    job_free(job);
+  }
+
+  return e;
+}
+
+/* Add a file (NAME within the archive) to a TIGroup.  DATA is freed
+   once it has been written. */
+static int add_tig(TTGroupWriter *w, const char *name,
+		   guint8 *data, gsize length)
+{
+  TTZipJob *job;
+
+  job = g_slice_new0(TTZipJob);
+  job->m.name = g_strdup(name);
+  job->m.version = 10;
+  job->m.csize = job->m.size = length;
+  job->data = data;
+
+  if (w->level != 0 && !w->pool) {
+    w->nthreads = MAX(1, (int) g_get_num_processors());
+    w->pool = g_thread_pool_new(&tig_deflate, w, w->nthreads, FALSE, NULL);
+  }
+
+  /* (stored files, or if no threads can be started) */
+  if (!w->pool) {
+    job->m.crc = crc32(crc32(0, NULL, 0), data, length);
+    job->done = 1;
+    g_queue_push_tail(&w->jobs, job);
+    return tig_flush(w, 1);
+  }
+
+  g_queue_push_tail(&w->jobs, job);
+  g_thread_pool_push(w->pool, job, NULL);
+  return tig_flush(w, 0);
+}
+
+/* Name of a store object: the hash of the file's NAME within a
+   TIGroup (which includes the folder and type), its ATTR, and the hash
+   of its CONTENTS (from tt_var_hash or tt_flash_hash) */
+static char * store_hash(const char *name, guint8 attr, const char *contents)
+{
+  GChecksum *sum;
+  char *str;
+
+  sum = g_checksum_new(G_CHECKSUM_SHA256);
+  g_checksum_update(sum, (const guchar *) name, strlen(name) + 1);
+  g_checksum_update(sum, &attr, 1);
+  g_checksum_update(sum, (const guchar *) contents, strlen(contents));
+  str = g_strdup(g_checksum_get_string(sum));
+  g_checksum_free(sum);
+  return str;
+}
+
+/* Add a file (NAME within a TIGroup, with the given store HASH) to the
+   store, if it is not there already, and list it in the snapshot */
+static int add_store(TTGroupWriter *w, const char *name, const char *hash,
+		     const guint8 *data, gsize length)
+{
+  GError *err = NULL;
+  char *rel, *path, *dir, *line;
+  const char *ext;
+  int e = 0;
+
+  ext = strrchr(name, '.');
+  rel = g_strdup_printf("objects/%.2s/%s%s", hash, hash + 2, ext ? ext : "");
+  path = g_build_filename(w->store, rel, NULL);
+
+  /* (files are written under a temporary name and then renamed, so a
+     file in the store is always complete) */
+  if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+    dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0777);
+    g_free(dir);
+
+    if (!g_file_set_contents(path, (const gchar *) data, length, &err)) {
+      g_printerr("%s: %s\n", g_get_prgname(), err->message);
+      g_error_free(err);
+      e = 1;
+    }
+  }
+
+  if (!e) {
+    /* the snapshot is two levels below the top of the store */
+    line = g_strdup_printf("../../%s\t%s\n", rel, name);
+    e = out_write(w, line, strlen(line));
+    g_free(line);
+  }
+
+  g_free(rel);
+  g_free(path);
+  return e;
+}
+
+/* Add an entry to a pack */
+static int add_pack(TTGroupWriter *w, int kind, const char *folder,
+		    const char *name, guint8 type, guint8 attr,
+		    guint8 version, const guint8 *data, guint32 length)
+{
+  static const char zeros[PACK_ALIGN];
+  TTPackRecord r;
+  GChecksum *sum;
+  gsize n;
+
+  n = (PACK_ALIGN - w->pos % PACK_ALIGN) % PACK_ALIGN;
+  if (out_write(w, zeros, n) || out_write(w, data, length))
+    return 1;
+
+  memset(&r, 0, sizeof(r));
+  r.kind = kind;
+  r.type = type;
+  r.attr = attr;
+  r.version = version;
+  r.offset = w->pos + n;
+  r.length = length;
+  w->pos += n + length;
+
+  r.folder = w->strings->len;
+  g_string_append_len(w->strings, folder, strlen(folder) + 1);
+  r.name = w->strings->len;
+  g_string_append_len(w->strings, name, strlen(name) + 1);
+
+  sum = g_checksum_new(G_CHECKSUM_SHA256);
+  g_checksum_update(sum, data, length);
+  n = sizeof(r.hash);
+  g_checksum_get_digest(sum, r.hash, &n);
+  g_checksum_free(sum);
+
+  g_array_append_val(w->records, r);
+  return 0;
+}
+
+/* Read back the file libtifiles has just written */
+static int read_tmp(TTGroupWriter *w, gchar **data, gsize *length)
+{
+  GError *err = NULL;
+
+  if (!g_file_get_contents(w->tmpname, data, length, &err)) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    w->failed = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Add the variables in CONTENT (which is not freed) to the file.
+   Returns 0 on success, or nonzero (after printing a message) if the
+   variables could not be added; the file is still written, without
+   them, when the writer is closed. */
+int tt_group_writer_add_regular(TTGroupWriter *w, FileContent *content)
+{
+  FileContent single;
+  VarEntry *list[2], *ve;
+  gchar *data, *name, *hash, *contents;
+  gsize length;
+  int i, e;
+
+  if (w->napps > 0 && w->format != GROUP_TIG && w->format != GROUP_STORE
+      && w->format != GROUP_PACK) {
+    g_printerr("%s: cannot write vars and apps to a single group file\n",
+	       g_get_prgname());
+    return 1;
+  }
+
+  if (open_output(w))
+    return 1;
+
+  for (i = 0; i < content->num_entries; i++) {
+    /* (packs hold the variable's data as it is) */
+    if (w->format == GROUP_PACK) {
+      ve = content->entries[i];
+      if (add_pack(w, TT_PACK_VAR, ve->folder, ve->name, ve->type, ve->attr,
+		   ve->version, ve->data, ve->size))
+	return 1;
+      w->nvars++;
+      continue;
+    }
+
+    single = *content;
+    list[0] = content->entries[i];
+    list[1] = NULL;
+    single.num_entries = 1;
+    single.entries = list;
+
+    if ((e = tifiles_file_write_regular(w->tmpname, &single, NULL))) {
+      tt_print_error(e, "unable to write output file");
+      return 1;
+    }
+
+    if (read_tmp(w, &data, &length))
+      return 1;
+
+    if (w->format == GROUP_8X)
+      e = add_8x(w, (guint8 *) data, length);
+    else if (w->format == GROUP_9X)
+      e = add_9x(w, list[0], (guint8 *) data, length);
+    else {
+      name = tt_group_member_name(w->model, list[0]);
+      if (w->format == GROUP_STORE) {
+	contents = tt_var_hash(list[0]);
+	hash = store_hash(name, list[0]->attr, contents);
+	e = add_store(w, name, hash, (guint8 *) data, length);
+	g_free(contents);
+	g_free(hash);
+      }
+      else {
+	e = add_tig(w, name, (guint8 *) data, length);
+	data = NULL;
+      }
+      g_free(name);
+    }
+
+    g_free(data);
+    if (e)
+      return 1;
+    w->nvars++;
+  }
+
+  return 0;
+}
+
+/* Add an application to the file.  Apart from TIGroup files, packs,
+   and stores, an output file can hold only a single application, and
+   no other variables. */
+int tt_group_writer_add_flash(TTGroupWriter *w, FlashContent *content)
+{
+  VarEntry ve;
+  gchar *data, *name, *hash, *contents;
+  gsize length;
+  int e;
+
+  if (w->format != GROUP_TIG && w->format != GROUP_STORE
+      && w->format != GROUP_PACK) {
+    if (w->nvars > 0) {
+      g_printerr("%s: cannot write vars and apps to a single group file\n",
+		 g_get_prgname());
+      return 1;
+    }
+    if (w->napps > 0) {
+      g_printerr("%s: cannot write multiple apps to a single file\n",
+		 g_get_prgname());
+      return 1;
+    }
+    if ((e = tifiles_file_write_flash(w->filename, content))) {
+      tt_print_error(e, "unable to write output file");
+      return 1;
+    }
+    w->napps++;
+    return 0;
+  }
+
+  if (open_output(w))
+    return 1;
+
+  if ((e = tifiles_file_write_flash(w->tmpname, content))) {
+    tt_print_error(e, "unable to write output file");
+    return 1;
+  }
+
+  if (read_tmp(w, &data, &length))
+    return 1;
+
+  memset(&ve, 0, sizeof(ve));
+  strncpy(ve.name, content->name, sizeof(ve.name) - 1);
+  ve.type = tifiles_flash_type(w->model);
+  name = tt_group_member_name(w->model, &ve);
+  if (w->format == GROUP_STORE) {
+    contents = tt_flash_hash(content);
+    hash = store_hash(name, 0, contents);
+    e = add_store(w, name, hash, (guint8 *) data, length);
+    g_free(contents);
+    g_free(hash);
+  }
+  else if (w->format == GROUP_PACK)
+    e = add_pack(w, TT_PACK_FILE, "", ve.name, ve.type, 0, 0,
+		 (guint8 *) data, length);
+  else {
+    e = add_tig(w, name, (guint8 *) data, length);
+    data = NULL;
+  }
+  g_free(name);
+  g_free(data);
+
+  if (e)
+    return 1;
+  w->napps++;
+  return 0;
+}
+
+static int finish_8x(TTGroupWriter *w)
+{
+  GString *buf;
+  int e;
+
+  buf = g_string_new(NULL);
+  put_le16(buf, w->sum);
+  e = out_write(w, buf->str, buf->len);
+
+  g_string_truncate(buf, 0);
+  put_le16(buf, w->length);
+  if (!e && fseek(w->out, LENGTH_8X_OFFSET, SEEK_SET))
+    e = write_failed(w, w->filename);
+  if (!e)
+    e = out_write(w, buf->str, buf->len);
+
+  g_string_free(buf, TRUE);
+  return e;
+}
+
+static int finish_9x(TTGroupWriter *w)
+{
+  TTGroupEntry *ent;
+  GString *buf;
+  char block[4096];
+  guint32 offset;
+  guint i, j, count;
+  gsize n;
+  int grouped, e;
+
+  ent = (TTGroupEntry *) w->entries->data;
+
+  /* a single variable has no folder entry (its folder is the default
+     folder in the header); otherwise each run of variables in the
+     same folder is preceded by an entry for the folder */
+  grouped = (w->entries->len > 1);
+  count = w->entries->len;
+  for (i = 0; grouped && i < w->entries->len; i++)
+    if (i == 0 || strncmp(ent[i].folder, ent[i - 1].folder, 8))
+      count++;
+
+  buf = g_string_new(NULL);
+  g_string_append_len(buf, (char *) w->header, HEADER_9X_SIZE);
+  put_le16(buf, count);
+
+  offset = TABLE_9X_OFFSET + 16 * count + 6;
+  for (i = 0; i < w->entries->len; i++) {
+    if (grouped && (i == 0 || strncmp(ent[i].folder, ent[i - 1].folder, 8))) {
+      for (j = i; j < w->entries->len; j++)
+	if (strncmp(ent[j].folder, ent[i].folder, 8))
+	  break;
+
+      put_le32(buf, offset);
+      g_string_append_len(buf, ent[i].folder, 8);
+      g_string_append_c(buf, tifiles_folder_type(w->model));
+      g_string_append_c(buf, 0);
+      put_le16(buf, j - i);
+    }
+
+    put_le32(buf, offset);
+    g_string_append_len(buf, (char *) ent[i].name, 8);
+    g_string_append_c(buf, ent[i].type);
+    g_string_append_c(buf, ent[i].attr);
+    put_le16(buf, 0);
+    offset += ent[i].size;
+  }
+
+  put_le32(buf, offset);
+  g_string_append_c(buf, 0xa5);
+  g_string_append_c(buf, 0x5a);
+
+  e = out_write(w, buf->str, buf->len);
+  g_string_free(buf, TRUE);
+
+  if (!e && fseek(w->spool, 0, SEEK_SET))
+    e = write_failed(w, w->spoolname);
+
+  while (!e && (n = fread(block, 1, sizeof(block), w->spool)) > 0)
+    e = out_write(w, block, n);
+
+  if (!e && ferror(w->spool))
+    e = write_failed(w, w->spoolname);
+
+  return e;
+}
+
+static int finish_tig(TTGroupWriter *w)
+{
+  TTZipMember *m;
+  GString *buf;
+  long start;
+  gsize size;
+  guint i;
+  int e;
+
+  if (tig_flush(w, 1))
+    return 1;
+
+  if ((start = ftell(w->out)) < 0)
+    return write_failed(w, w->partname);
+
+  buf = g_string_new(NULL);
+  for (i = 0; i < w->members->len; i++) {
+    m = &g_array_index(w->members, TTZipMember, i);
+    put_le32(buf, 0x02014b50);	/* central directory header */
+    put_le16(buf, 20);		/* version made by */
+    put_le16(buf, m->version);
+    put_le16(buf, m->flags);
+    put_le16(buf, m->method);
+    put_le16(buf, w->dos_time);
+    put_le16(buf, w->dos_date);
+    put_le32(buf, m->crc);
+    put_le32(buf, m->csize);
+    put_le32(buf, m->size);
+    put_le16(buf, strlen(m->name));
+    put_le16(buf, 0);		/* extra field length */
+    put_le16(buf, 0);		/* comment length */
+    put_le16(buf, 0);		/* disk number */
+    put_le16(buf, 0);		/* internal attributes */
+    put_le32(buf, 0);		/* external attributes */
+    put_le32(buf, m->offset);
+    g_string_append(buf, m->name);
+  }
+
+  size = buf->len;
+  put_le32(buf, 0x06054b50);	/* end of central directory */
+  put_le16(buf, 0);		/* disk number */
+  put_le16(buf, 0);		/* disk with central directory */
+  put_le16(buf, w->members->len);
+  put_le16(buf, w->members->len);
+  put_le32(buf, size);
+  put_le32(buf, start);
+  put_le16(buf, 0);		/* comment length */
+
+  e = out_write(w, buf->str, buf->len);
+  g_string_free(buf, TRUE);
+  return e;
+}
+
+static int pack_compare(gconstpointer a, gconstpointer b, gpointer data)
+{
+  const TTPackRecord *ra = a, *rb = b;
+  const char *strings = data;
+  int c;
+
+  if ((c = strcmp(strings + ra->folder, strings + rb->folder)))
+    return c;
+  if ((c = strcmp(strings + ra->name, strings + rb->name)))
+    return c;
+  return (ra->type - rb->type);
+}
+
+static int finish_pack(TTGroupWriter *w)
+{
+  static const char zeros[PACK_ALIGN];
+  TTPackRecord *r;
+  GString *buf;
+  guint32 index, n;
+  guint i;
+  int e;
+
+  g_array_sort_with_data(w->records, &pack_compare, w->strings->str);
+
+  n = (PACK_ALIGN - w->pos % PACK_ALIGN) % PACK_ALIGN;
+  if (out_write(w, zeros, n))
+    return 1;
+  index = w->pos + n;
+
+  buf = g_string_new(NULL);
+  for (i = 0; i < w->records->len; i++) {
+    r = &g_array_index(w->records, TTPackRecord, i);
+    put_le32(buf, r->folder);
+    put_le32(buf, r->name);
+    g_string_append_c(buf, r->kind);
+    g_string_append_c(buf, r->type);
+    g_string_append_c(buf, r->attr);
+    g_string_append_c(buf, r->version);
+    put_le32(buf, r->offset);
+    put_le32(buf, r->length);
+    put_le32(buf, 0);
+    g_string_append_len(buf, (char *) r->hash, sizeof(r->hash));
+    put_le32(buf, 0);
+    put_le32(buf, 0);
+  }
+  g_string_append_len(buf, w->strings->str, w->strings->len);
+  e = out_write(w, buf->str, buf->len);
+
+  g_string_truncate(buf, 0);
+  g_string_append_len(buf, PACK_MAGIC, 8);
+  put_le32(buf, w->model);
+  put_le32(buf, w->records->len);
+  put_le32(buf, index);
+  put_le32(buf, index + w->records->len * PACK_ENTRY_SIZE);
+  put_le32(buf, w->strings->len);
+  if (!e && fseek(w->out, 0, SEEK_SET))
+    e = write_failed(w, w->partname);
+  if (!e)
+    e = out_write(w, buf->str, buf->len);
+
+  g_string_free(buf, TRUE);
+  return e;
+}
+
+/* An existing TIGroup file, from which members can be copied
+   without unpacking them */
+struct _TTArchive {
+  FILE *f;
+  GHashTable *members;		/* name -> TTZipMember */
+};
+
+static guint16 get_le16(const guint8 *p)
+{
+  return (p[0] | (p[1] << 8));
+}
+
+static guint32 get_le32(const guint8 *p)
+{
+  return (get_le16(p) | ((guint32) get_le16(p + 2) << 16));
+}
+
+static void member_free(gpointer data)
+{
+  TTZipMember *m = data;
+  g_free(m->name);
+  g_slice_free(TTZipMember, m);
+}
+
+/* Read the central directory of a ZIP file */
+static int read_directory(TTArchive *a)
+{
+  guint8 tail[22], *dir, *p;
+  guint32 size, offset, n, i;
+  TTZipMember *m;
+  long end;
+
+  /* (archives with a comment are not recognized; we never write
+     one) */
+  if (fseek(a->f, -22, SEEK_END) || (end = ftell(a->f)) < 0
+      || fread(tail, 1, 22, a->f) != 22
+      || get_le32(tail) != 0x06054b50)
+    return -1;
+
+  n = get_le16(tail + 10);
+  size = get_le32(tail + 12);
+  offset = get_le32(tail + 16);
+  if (offset + size > (guint32) end)
+    return -1;
+
+  dir = g_malloc(size);
+  if (fseek(a->f, offset, SEEK_SET) || fread(dir, 1, size, a->f) != size) {
+    g_free(dir);
+    return -1;
+  }
+
+  for (i = 0, p = dir; i < n; i++) {
+    if (p + 46 > dir + size || get_le32(p) != 0x02014b50
+	|| p + 46 + get_le16(p + 28) > dir + size)
+      break;
+
+    m = g_slice_new(TTZipMember);
+    m->version = get_le16(p + 6);
+    m->flags = get_le16(p + 8);
+    m->method = get_le16(p + 10);
+    m->crc = get_le32(p + 16);
+    m->csize = get_le32(p + 20);
+    m->size = get_le32(p + 24);
+    m->offset = get_le32(p + 42);
+    m->name = g_strndup((char *) p + 46, get_le16(p + 28));
+    g_hash_table_replace(a->members, m->name, m);
+
+    p += 46 + get_le16(p + 28) + get_le16(p + 30) + get_le16(p + 32);
+  }
+
+  g_free(dir);
+  return (i == n ? 0 : -1);
+}
+
+/* Open a TIGroup file written earlier.  Returns NULL if the file does
+   not exist or cannot be read. */
+TTArchive * tt_archive_open(const char *filename)
+{
+  TTArchive *a;
+
+  a = g_slice_new(TTArchive);
+  a->members = g_hash_table_new_full(&g_str_hash, &g_str_equal,
+				     NULL, &member_free);
+
+  if (!(a->f = g_fopen(filename, "rb")) || read_directory(a)) {
+    tt_archive_close(a);
+    return NULL;
+  }
+
+  return a;
+}
+
+void tt_archive_close(TTArchive *a)
+{
+  if (!a)
+    return;
+  if (a->f)
+    fclose(a->f);
+  g_hash_table_destroy(a->members);
+  g_slice_free(TTArchive, a);
+}
+
+/* Copy the member NAME of archive A into a TIGroup file, as it is
+   (compressed or not.)  Returns 0 on success, -1 if A has no usable
+   member of that name, or 1 (after printing a message) if writing
+   failed. */
+int tt_group_writer_copy(TTGroupWriter *w, TTArchive *a, const char *name)
+{
+  const TTZipMember *src;
+  TTZipMember m;
+  guint8 hdr[30];
+  char block[4096];
+  guint32 left;
+  gsize n;
+
+  if (w->format != GROUP_TIG
+      || !(src = g_hash_table_lookup(a->members, name))
+      || (src->flags & 1))	/* (encrypted) */
+    return -1;
+
+  if (fseek(a->f, src->offset, SEEK_SET)
+      || fread(hdr, 1, 30, a->f) != 30
+      || get_le32(hdr) != 0x04034b50
+      || fseek(a->f, get_le16(hdr + 26) + get_le16(hdr + 28), SEEK_CUR))
+    return -1;
+
+  /* (files still being compressed come first) */
+  if (open_output(w) || tig_flush(w, 1))
+    return 1;
+
+  m = *src;
+  m.name = g_strdup(src->name);
+  m.flags &= 0x06;		/* (no data descriptor) */
+  if (tig_begin(w, &m)) {
+    g_free(m.name);
+    return 1;
+  }
+
+  /* (a short read leaves the member truncated, so the file can no
+     longer be completed) */
+  for (left = src->csize; left > 0; left -= n) {
+    n = fread(block, 1, MIN(left, sizeof(block)), a->f);
+    if (n == 0) {
+      g_printerr("%s: previous archive is truncated\n", g_get_prgname());
+      w->failed = w->broken = 1;
+      return 1;
+    }
+    if (out_write(w, block, n))
+      return 1;
+  }
+
+  w->nvars++;
+  return 0;
+}
+
+/* Finish writing the file, and free the writer.  Returns 0 on
+   success, or nonzero (after printing a message) if the file could
+   not be completed. */
+int tt_group_writer_close(TTGroupWriter *w)
+{
+  TTZipJob *job;
+  guint i;
+  int e = w->failed, f = 0;
+
+  /* (any files still being compressed are discarded if the file
+     cannot be completed) */
+  if (w->pool) {
+    if (w->broken)
+      tig_flush(w, 1);
+    g_thread_pool_free(w->pool, FALSE, TRUE);
+  }
+
+  /* the file replaces any existing file only once it is complete;
+     variables that could not be added are simply left out */
+  if (w->out) {
+    if (w->broken)
+      f = 1;
+    else if (w->format == GROUP_8X && w->nvars > 0)
+      f = finish_8x(w);
+    else if (w->format == GROUP_9X && w->entries->len > 0)
+      f = finish_9x(w);
+    else if (w->format == GROUP_TIG)
+      f = finish_tig(w);
+    else if (w->format == GROUP_PACK)
+      f = finish_pack(w);
+
+#if defined(HAVE_FSYNC) && defined(HAVE_UNISTD_H)
+    /* (the contents must be on disk before the rename) */
+    if (!f && !fflush(w->out))
+      fsync(fileno(w->out));
+#endif
+
+    if (fclose(w->out) && !f)
+      f = write_failed(w, w->partname);
+
+    if (!f && g_rename(w->partname, w->filename)) {
+      g_printerr("%s: %s: %s\n", g_get_prgname(), w->filename,
+		 g_strerror(errno));
+      f = 1;
+    }
+    if (f)
+      g_unlink(w->partname);
+  }
+
+  if (w->spool) {
+    fclose(w->spool);
+    g_unlink(w->spoolname);
+  }
+
+  g_unlink(w->tmpname);
+
+  /* (if the output was never opened) */
+  while ((job = g_queue_pop_head(&w->jobs)))
+    job_free(job);
+  g_mutex_clear(&w->lock);
+  g_cond_clear(&w->cond);
+
+  for (i = 0; i < w->members->len; i++)
+    g_free(g_array_index(w->members, TTZipMember, i).name);
+  g_array_free(w->members, TRUE);
+  g_array_free(w->entries, TRUE);
+  g_array_free(w->records, TRUE);
+  g_string_free(w->strings, TRUE);
+  g_free(w->spoolname);
+  g_free(w->tmpname);
+  g_free(w->partname);
+  g_free(w->filename);
+  g_free(w->store);
+  g_slice_free(TTGroupWriter, w);
+  return (e || f);
+}
+
+/* Read a snapshot written to a backup store.  Returns the full paths
+   of the files it lists, or NULL if FILENAME is not a snapshot. */
+char ** tt_snapshot_read(const char *filename)
+{
+  gchar *data, **lines, *dir, *tab;
+  char header[sizeof(SNAPSHOT_HEADER) - 1];
+  GPtrArray *files;
+  FILE *f;
+  int i;
+
+  /* (check the header first; other files may be large) */
+  if (!(f = g_fopen(filename, "rb")))
+    return NULL;
+  i = fread(header, 1, sizeof(header), f);
+  fclose(f);
+  if (i != sizeof(header) || memcmp(header, SNAPSHOT_HEADER, i))
+    return NULL;
+
+  if (!g_file_get_contents(filename, &data, NULL, NULL))
+    return NULL;
+
+  dir = g_path_get_dirname(filename);
+  lines = g_strsplit(data + strlen(SNAPSHOT_HEADER), "\n", -1);
+  files = g_ptr_array_new();
+
+  for (i = 0; lines[i]; i++) {
+    if (!lines[i][0] || lines[i][0] == '#')
+      continue;
+    if ((tab = strchr(lines[i], '\t')))
+      *tab = 0;
+    g_ptr_array_add(files, g_build_filename(dir, lines[i], NULL));
+  }
+  g_ptr_array_add(files, NULL);
+
+  g_strfreev(lines);
+  g_free(dir);
+  g_free(data);
+  return (char **) g_ptr_array_free(files, FALSE);
+}
+
+/* A pack, mapped into memory */
+struct _TTPack {
+  GMappedFile *map;
+  const guint8 *data;
+  gsize size;
+  CalcModel model;
+  guint32 n;			/* number of entries */
+  const guint8 *index;
+  const char *strings;
+  guint32 strings_size;
+};
+
+/* Open a pack.  Returns NULL if the file cannot be read, or is not a
+   pack. */
+TTPack * tt_pack_open(const char *filename)
+{
+  TTPack *p;
+  GMappedFile *map;
+  const guint8 *d;
+  guint32 index, strings;
+  gsize size;
+
+  if (!(map = g_mapped_file_new(filename, FALSE, NULL)))
+    return NULL;
+
+  d = (const guint8 *) g_mapped_file_get_contents(map);
+  size = g_mapped_file_get_length(map);
+
+  if (size < PACK_HEADER_SIZE || memcmp(d, PACK_MAGIC, 8)) {
+    g_mapped_file_unref(map);
+    return NULL;
+  }
+
+  p = g_slice_new(TTPack);
+  p->map = map;
+  p->data = d;
+  p->size = size;
+  p->model = get_le32(d + 8);
+  p->n = get_le32(d + 12);
+  index = get_le32(d + 16);
+  strings = get_le32(d + 20);
+  p->strings_size = get_le32(d + 24);
+
+  /* (names must all end within the string table) */
+  if (index > size || p->n > (size - index) / PACK_ENTRY_SIZE
+      || strings > size || p->strings_size > size - strings
+      || (p->strings_size > 0 && d[strings + p->strings_size - 1] != 0)) {
+    tt_pack_close(p);
+    return NULL;
+  }
+
+  p->index = d + index;
+  p->strings = (const char *) d + strings;
+  return p;
+}
+
+void tt_pack_close(TTPack *p)
+{
+  if (!p)
+    return;
+  g_mapped_file_unref(p->map);
+  g_slice_free(TTPack, p);
+}
+
+CalcModel tt_pack_model(const TTPack *p)
+{
+  return p->model;
+}
+
+int tt_pack_count(const TTPack *p)
+{
+  return p->n;
+}
+
+/* Get entry I of a pack (in sorted order.)  Returns 0 on success, or
+   -1 if the entry is damaged. */
+int tt_pack_entry(const TTPack *p, int i, TTPackEntry *pe)
+{
+  const guint8 *r = p->index + (gsize) i * PACK_ENTRY_SIZE;
+  guint32 folder, name, offset, length;
+
+  folder = get_le32(r);
+  name = get_le32(r + 4);
+  offset = get_le32(r + 12);
+  length = get_le32(r + 16);
+
+  if (folder >= p->strings_size || name >= p->strings_size
+      || offset > p->size || length > p->size - offset)
+    return -1;
+
+  pe->kind = r[8];
+  pe->folder = p->strings + folder;
+  pe->name = p->strings + name;
+  pe->type = r[9];
+  pe->attr = r[10];
+  pe->version = r[11];
+  pe->data = p->data + offset;
+  pe->length = length;
+  pe->hash = r + 24;
+  return 0;
+}
+
+/* Find the first entry (of any type) for the variable NAME in FOLDER
+   (both in the calculator's encoding), or in any folder if FOLDER is
+   NULL.  Returns its number, or -1 if there is none. */
+int tt_pack_find(const TTPack *p, const char *folder, const char *name)
+{
+  const guint8 *r;
+  guint32 lo, hi, mid;
+  int c;
+
+  if (!folder) {
+    for (lo = 0; lo < p->n; lo++) {
+      r = p->index + (gsize) lo * PACK_ENTRY_SIZE;
+      if (get_le32(r + 4) < p->strings_size
+	  && !strcmp(p->strings + get_le32(r + 4), name))
+	return lo;
+    }
+    return -1;
+  }
+
+  /* (first entry not less than FOLDER, NAME) */
+  lo = 0;
+  hi = p->n;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    r = p->index + (gsize) mid * PACK_ENTRY_SIZE;
+    if (get_le32(r) >= p->strings_size || get_le32(r + 4) >= p->strings_size)
+      return -1;
+
+    if (!(c = strcmp(p->strings + get_le32(r), folder)))
+      c = strcmp(p->strings + get_le32(r + 4), name);
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < p->n) {
+    r = p->index + (gsize) lo * PACK_ENTRY_SIZE;
+    if (!strcmp(p->strings + get_le32(r), folder)
+	&& !strcmp(p->strings + get_le32(r + 4), name))
+      return lo;
+  }
+  return -1;
+}
+
+/* Make a FileContent for a variable in a pack.  The variable's data
+   is not copied; the content must be freed with tt_pack_content_free
+   before the pack is closed. */
+FileContent * tt_pack_content(const TTPack *p, const TTPackEntry *pe)
+{
+  FileContent *content;
+  VarEntry *ve;
+
+  content = tifiles_content_create_regular(p->model);
+  content->entries = tifiles_ve_create_array(1);
+  content->entries[0] = ve = tifiles_ve_create();
+  content->num_entries = 1;
+
+  strncpy(ve->folder, pe->folder, sizeof(ve->folder) - 1);
+  strncpy(ve->name, pe->name, sizeof(ve->name) - 1);
+  ve->type = pe->type;
+  ve->attr = pe->attr;
+  ve->version = pe->version;
+  ve->size = pe->length;
+  ve->data = (uint8_t *) pe->data;
+  return content;
+}
+
+void tt_pack_content_free(FileContent *content)
+{
+  int i;
+
+  for (i = 0; i < content->num_entries; i++)
+    content->entries[i]->data = NULL;
+  tifiles_content_delete_regular(content);
+}
+
+/* Read an application (or other Flash file) from a TT_PACK_FILE entry
+   of a pack.  libtifiles reads only from files, so it is first written
+   out to a temporary file.  Returns NULL (after printing a message) on
+   failure. */
+FlashContent * tt_pack_flash_content(const TTPack *p, const TTPackEntry *pe)
+{
+  GError *err = NULL;
+  FlashContent *content;
+  VarEntry ve;
+  char *name, *tmpl, *tmpname;
+  const char *ext;
+  int fd, e;
+
+  memset(&ve, 0, sizeof(ve));
+  strncpy(ve.name, pe->name, sizeof(ve.name) - 1);
+  ve.type = pe->type;
+  name = tt_group_member_name(p->model, &ve);
+  ext = strrchr(name, '.');
+  tmpl = g_strconcat("titools-XXXXXX", (ext ? ext : ""), NULL);
+  g_free(name);
+
+  fd = g_file_open_tmp(tmpl, &tmpname, &err);
+  g_free(tmpl);
+  if (fd < 0) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    return NULL;
+  }
+  close(fd);
+
+  content = tifiles_content_create_flash(p->model);
+  if (!g_file_set_contents(tmpname, (const gchar *) pe->data, pe->length,
+			   &err)) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    tifiles_content_delete_flash(content);
+    content = NULL;
+  }
+  else if ((e = tifiles_file_read_flash(tmpname, content))) {
+    tt_print_error(e, "unable to read file");
+    tifiles_content_delete_flash(content);
+    content = NULL;
+  }
+
+  g_unlink(tmpname);
+  g_free(tmpname);
+  return content;
+}
@@ -0,0 +1,333 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Transfer journals, used by 'tiget --resume' and 'tiput --resume'.
+
+   While tiget or tiput runs, each variable transferred is appended to
+   a journal in the cache directory (see cache.c), named after the
+   tool and the calculator.  The journal is deleted when the run
+   completes; if the run fails, the next run given --resume reads it
+   and skips what was already done.
+
+   The journal is a text file.  The first line is "#", a tab, and the
+   run's target (for tiget, the output file or directory); a journal
+   is only resumed by a run with the same target.  Each following line
+   describes one variable, as tab-separated fields:
+
+     KEY  TYPE  SIZE  HASH  PATH
+
+   KEY is the variable's key (see tt_var_key), TYPE its type (in hex),
+   SIZE its size as listed on the calculator, HASH a SHA-256 hash of
+   its contents, and PATH the file it was written to or read from.
+   KEY, PATH, and the target are escaped as by g_strescape.  Each line
+   is flushed as it is written, so at worst the last line of a journal
+   is incomplete; such lines are ignored.
+
+   A send record, used by 'tiput --skip-unchanged', has the same
+   format (with an empty target), but is kept from one run to the
+   next: it holds the hash of the last copy of each variable that tiput
+   sent to the calculator.  It is rewritten, with one line for each
+   variable, whenever it is opened. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+#include "titools.h"
+
+struct _TTJournal {
+  char *filename;
+  FILE *out;
+  GHashTable *entries;		/* key -> TTJournalEntry */
+};
+
+static void entry_free(gpointer data)
+{
+  TTJournalEntry *je = data;
+
+  g_free(je->hash);
+  g_free(je->path);
+  g_slice_free(TTJournalEntry, je);
+}
+
+/* Read the journal of an earlier run.  Returns FALSE if there is none,
+   or if it was for a different target.  *INCOMPLETE is set if the last
+   line is incomplete. */
+static gboolean journal_read(TTJournal *j, const char *target,
+			     gboolean *incomplete)
+{
+  gchar *data, **lines, **fields, *p;
+  TTJournalEntry *je;
+  gboolean ok;
+  int i;
+
+  if (!g_file_get_contents(j->filename, &data, NULL, NULL))
+    return FALSE;
+
+  lines = g_strsplit(data, "\n", -1);
+  g_free(data);
+
+  if (!lines[0] || strncmp(lines[0], "#\t", 2)) {
+    g_strfreev(lines);
+    return FALSE;
+  }
+
+  p = g_strcompress(lines[0] + 2);
+  ok = !strcmp(p, target ? target : "");
+  g_free(p);
+
+  /* (the last line is empty, or else incomplete) */
+  for (i = 1; ok && lines[i] && lines[i + 1]; i++) {
+    fields = g_strsplit(lines[i], "\t", 0);
+    if (g_strv_length(fields) == 5) {
+      je = g_slice_new(TTJournalEntry);
+      je->type = strtoul(fields[1], NULL, 16);
+      je->size = strtoul(fields[2], NULL, 10);
+      je->hash = g_strdup(fields[3]);
+      je->path = g_strcompress(fields[4]);
+      g_hash_table_replace(j->entries, g_strcompress(fields[0]), je);
+    }
+    g_strfreev(fields);
+  }
+  *incomplete = (lines[i] && lines[i][0]);
+
+  g_strfreev(lines);
+  return ok;
+}
+
+static void write_entry(FILE *out, const char *key, guint8 type,
+			guint32 size, const char *hash, const char *path)
+{
+  char *ekey, *epath;
+
+  ekey = g_strescape(key, NULL);
+  epath = g_strescape(path ? path : "", NULL);
+
+  fprintf(out, "%s\t%02x\t%lu\t%s\t%s\n", ekey, type,
+	  (unsigned long) size, hash, epath);
+  fflush(out);
+
+  g_free(ekey);
+  g_free(epath);
+}
+
+static TTJournal * journal_new(const char *prefix, const char *tool,
+			       const char *id)
+{
+  TTJournal *j;
+  char *name;
+
+  name = g_strconcat(prefix, tool, "-", id, NULL);
+
+  j = g_slice_new0(TTJournal);
+  j->filename = tt_cache_filename(name);
+  j->entries = g_hash_table_new_full(&g_str_hash, &g_str_equal,
+				     &g_free, &entry_free);
+  g_free(name);
+  return j;
+}
+
+static TTJournal * journal_failed(TTJournal *j)
+{
+  g_printerr("%s: %s: %s\n", g_get_prgname(), j->filename,
+	     g_strerror(errno));
+  g_hash_table_destroy(j->entries);
+  g_free(j->filename);
+  g_slice_free(TTJournal, j);
+  return NULL;
+}
+
+/* Begin the journal for a run of TOOL, writing to (or reading from)
+   TARGET.  If RESUME is nonzero, the journal of the last run is kept,
+   if it was for the same target; otherwise the journal starts out
+   empty.  Returns NULL if the calculator cannot be identified, or the
+   journal cannot be written (the run can still go ahead without
+   one.) */
+TTJournal * tt_journal_open(TTSession *s, const char *tool,
+			    const char *target, int resume)
+{
+  TTJournal *j;
+  char *id, *str;
+  gboolean incomplete;
+
+  if (!(id = tt_device_id(s))) {
+    if (resume)
+      g_printerr("%s: warning: cannot identify calculator;"
+		 " starting from the beginning\n", g_get_prgname());
+    return NULL;
+  }
+
+  j = journal_new("journal-", tool, id);
+  g_free(id);
+
+  if (resume && journal_read(j, target, &incomplete)) {
+    if ((j->out = g_fopen(j->filename, "a")) && incomplete)
+      fputc('\n', j->out);
+  }
+  else {
+    if (resume)
+      g_printerr("%s: no interrupted transfer to resume;"
+		 " starting from the beginning\n", g_get_prgname());
+    g_hash_table_remove_all(j->entries);
+
+    if ((j->out = g_fopen(j->filename, "w"))) {
+      str = g_strescape(target ? target : "", NULL);
+      fprintf(j->out, "#\t%s\n", str);
+      fflush(j->out);
+      g_free(str);
+    }
+  }
+
+  if (!j->out)
+    return journal_failed(j);
+
+  return j;
+}
+
+/* Open the send record of TOOL for the connected calculator.  Returns
+   NULL if the calculator has no ID (a record named after the link
+   would be used for any calculator connected to it), or the record
+   cannot be written.  The record is closed with
+   tt_journal_close(j, 1). */
+TTJournal * tt_record_open(TTSession *s, const char *tool)
+{
+  TTJournal *j;
+  GHashTableIter iter;
+  gpointer key, value;
+  TTJournalEntry *je;
+  char *id;
+  gboolean incomplete;
+
+  if (!(id = tt_calc_id(s)))
+    return NULL;
+
+  j = journal_new("sent-", tool, id);
+  g_free(id);
+
+  if (!journal_read(j, NULL, &incomplete))
+    g_hash_table_remove_all(j->entries);
+
+  if (!(j->out = g_fopen(j->filename, "w")))
+    return journal_failed(j);
+
+  fputs("#\t\n", j->out);
+  g_hash_table_iter_init(&iter, j->entries);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    je = value;
+    write_entry(j->out, key, je->type, je->size, je->hash, je->path);
+  }
+
+  return j;
+}
+
+/* Forget everything in a send record (after the calculator's memory
+   has been replaced) */
+void tt_record_clear(TTJournal *j)
+{
+  if (!j)
+    return;
+
+  g_hash_table_remove_all(j->entries);
+  if (j->out)
+    fclose(j->out);
+
+  if ((j->out = g_fopen(j->filename, "w"))) {
+    fputs("#\t\n", j->out);
+    fflush(j->out);
+  }
+}
+
+/* Look up a variable recorded in the journal of the run being
+   resumed.  Returns NULL if the variable was not recorded. */
+const TTJournalEntry * tt_journal_find(const TTJournal *j, const VarEntry *ve)
+{
+  const TTJournalEntry *je;
+  char *key;
+
+  if (!j)
+    return NULL;
+
+  key = tt_var_key(ve);
+  je = g_hash_table_lookup(j->entries, key);
+  g_free(key);
+
+  return je;
+}
+
+/* Record a variable that has been transferred */
+void tt_journal_add(TTJournal *j, const VarEntry *ve, guint32 size,
+		    const char *hash, const char *path)
+{
+  char *key;
+
+  if (!j || !j->out)
+    return;
+
+  key = tt_var_key(ve);
+  write_entry(j->out, key, ve->type, size, hash, path);
+  g_free(key);
+}
+
+/* Finish the journal.  If KEEP is nonzero, it is left for a later run
+   to resume; otherwise, it is deleted. */
+void tt_journal_close(TTJournal *j, int keep)
+{
+  if (!j)
+    return;
+
+  if (j->out)
+    fclose(j->out);
+  if (!keep)
+    g_unlink(j->filename);
+
+  g_hash_table_destroy(j->entries);
+  g_free(j->filename);
+  g_slice_free(TTJournal, j);
+}
+
+/* SHA-256 hash of a variable's contents (a newly allocated string) */
+char * tt_var_hash(const VarEntry *ve)
+{
+  return g_compute_checksum_for_data(G_CHECKSUM_SHA256, ve->data, ve->size);
+}
+
+/* SHA-256 hash of a Flash application's contents */
+char * tt_flash_hash(const FlashContent *fcontent)
+{
+  GChecksum *sum;
+  const FlashContent *p;
+  char *str;
+  int i;
+
+  sum = g_checksum_new(G_CHECKSUM_SHA256);
+  for (p = fcontent; p; p = p->next) {
+    if (p->data_part)
+      g_checksum_update(sum, p->data_part, p->data_length);
+    for (i = 0; i < p->num_pages; i++)
+      g_checksum_update(sum, p->pages[i]->data, p->pages[i]->size);
+  }
+  str = g_strdup(g_checksum_get_string(sum));
+  g_checksum_free(sum);
+  return str;
+}
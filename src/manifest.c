@@ -0,0 +1,185 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Backup manifests, used by 'tiget --incremental'.
+
+   The manifest records, for each calculator, the archive written by
+   the last backup and the variables it contains (with their size and
+   attributes as listed on the calculator, the name of their file in
+   the archive, and a SHA-256 hash of their contents.)  A variable
+   whose size and attributes have not changed since then is copied
+   from the old archive instead of being transferred again.
+
+   Manifests are kept in the cache directory (see cache.c), named
+   after the calculator's ID.  A calculator without an ID has no
+   manifest, and is always backed up in full: a manifest named after
+   the link would be used for any calculator connected to it. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "titools.h"
+
+struct _TTManifest {
+  char *name;			/* cache file name */
+  GKeyFile *old;		/* manifest of the last backup */
+  GKeyFile *cur;		/* manifest of this backup */
+};
+
+/* Group name for a variable.  Variable names are in the calculator's
+   own encoding, so anything other than printable ASCII (and the
+   characters GKeyFile reserves) is written as an octal escape. */
+static char * var_group(const VarEntry *ve)
+{
+  GString *str;
+  char *key;
+  const char *p;
+
+  key = tt_var_key(ve);
+  str = g_string_new("var ");
+  for (p = key; *p; p++) {
+    if ((guchar) *p < 0x20 || (guchar) *p >= 0x7f
+	|| *p == '[' || *p == ']' || *p == '\\')
+      g_string_append_printf(str, "\\%03o", (guchar) *p);
+    else
+      g_string_append_c(str, *p);
+  }
+  g_free(key);
+  return g_string_free(str, FALSE);
+}
+
+/* Name of the manifest file for the connected calculator, or NULL if
+   the calculator has no ID */
+static char * manifest_name(TTSession *s)
+{
+  char *id, *name;
+
+  if (!(id = tt_calc_id(s)))
+    return NULL;
+
+  name = g_strconcat("manifest-", id, NULL);
+  g_free(id);
+  return name;
+}
+
+/* Read the manifest of the last backup of the connected calculator.
+   If there is none, an empty manifest is returned. */
+TTManifest * tt_manifest_load(TTSession *s)
+{
+  TTManifest *m;
+
+  m = g_slice_new(TTManifest);
+  if (!(m->name = manifest_name(s)))
+    g_printerr("%s: warning: cannot identify calculator;"
+	       " transferring all variables\n", g_get_prgname());
+  m->old = (m->name ? tt_cache_load(m->name) : g_key_file_new());
+  m->cur = g_key_file_new();
+  return m;
+}
+
+/* Get the archive written by the last backup (a newly allocated
+   string), or NULL if there was none */
+char * tt_manifest_get_archive(const TTManifest *m)
+{
+  return g_key_file_get_string(m->old, "manifest", "archive", NULL);
+}
+
+/* Check whether a variable is unchanged since the last backup: it
+   must have been included, with the same size and attributes.  If so,
+   *MEMBER and *HASH are set to the name of its file in the old
+   archive and its hash (newly allocated strings.) */
+int tt_manifest_unchanged(const TTManifest *m, const VarEntry *ve,
+			  char **member, char **hash)
+{
+  GError *err = NULL;
+  char *group;
+  int size, attr = 0;
+
+  *member = *hash = NULL;
+
+  group = var_group(ve);
+  size = g_key_file_get_integer(m->old, group, "size", &err);
+  if (!err)
+    attr = g_key_file_get_integer(m->old, group, "attr", &err);
+  if (!err)
+    *member = g_key_file_get_string(m->old, group, "member", &err);
+  if (!err)
+    *hash = g_key_file_get_string(m->old, group, "hash", &err);
+  g_free(group);
+
+  if (err || (guint32) size != ve->size || attr != ve->attr) {
+    if (err)
+      g_error_free(err);
+    g_free(*member);
+    g_free(*hash);
+    *member = *hash = NULL;
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Record a variable included in this backup */
+void tt_manifest_add(TTManifest *m, const VarEntry *ve, const char *member,
+		     const char *hash)
+{
+  char *group;
+
+  group = var_group(ve);
+  g_key_file_set_integer(m->cur, group, "size", ve->size);
+  g_key_file_set_integer(m->cur, group, "attr", ve->attr);
+  g_key_file_set_string(m->cur, group, "member", member);
+  g_key_file_set_string(m->cur, group, "hash", hash);
+  g_free(group);
+}
+
+/* Save the manifest of this backup, which was written to ARCHIVE
+   (replacing the manifest of the last backup.) */
+void tt_manifest_save(TTManifest *m, const char *archive)
+{
+  char *path, *cwd;
+
+  if (!m->name)
+    return;
+
+  if (g_path_is_absolute(archive))
+    path = g_strdup(archive);
+  else {
+    cwd = g_get_current_dir();
+    path = g_build_filename(cwd, archive, NULL);
+    g_free(cwd);
+  }
+
+  g_key_file_set_string(m->cur, "manifest", "archive", path);
+  tt_cache_save(m->name, m->cur);
+  g_free(path);
+}
+
+void tt_manifest_free(TTManifest *m)
+{
+  if (!m)
+    return;
+  g_key_file_free(m->old);
+  g_key_file_free(m->cur);
+  g_free(m->name);
+  g_slice_free(TTManifest, m);
+}
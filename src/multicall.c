@@ -0,0 +1,147 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Running the tools over a link that is already open (used by
+   titoolsd and 'titools batch'.)
+
+   Each tool is linked in a second time, with its main() renamed (see
+   src/Makefile.in.)  The tools keep their options in static
+   variables, and exit() on many errors, so each command is run in a
+   child process.  The link is not shared with the child: the parent
+   closes it and shuts down the libraries before forking (so that no
+   libusb state crosses fork()), the child opens it afresh using the
+   cable, port, and model the parent found, and the parent opens it
+   again once the child has finished. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "titools.h"
+
+#ifdef HAVE_FORK
+# include <unistd.h>
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+
+int tt_tiget_main(int argc, char **argv);
+int tt_tiinfo_main(int argc, char **argv);
+int tt_tikey_main(int argc, char **argv);
+int tt_tils_main(int argc, char **argv);
+int tt_tiput_main(int argc, char **argv);
+int tt_tirm_main(int argc, char **argv);
+int tt_tiscr_main(int argc, char **argv);
+int tt_tidump_main(int argc, char **argv);
+
+static const TTTool tools[] =
+  {{ "tiget", "get", &tt_tiget_main },
+   { "tiinfo", "info", &tt_tiinfo_main },
+   { "tikey", "key", &tt_tikey_main },
+   { "tils", "ls", &tt_tils_main },
+   { "tiput", "put", &tt_tiput_main },
+   { "tirm", "rm", &tt_tirm_main },
+   { "tiscr", "scr", &tt_tiscr_main },
+   { "tidump", "dump", &tt_tidump_main },
+   { 0, 0, 0 }};
+
+/* Look up a tool by its program name ("tils") or its short name
+   ("ls").  Returns NULL if there is no such tool. */
+const TTTool * tt_find_tool(const char *name)
+{
+  int i;
+
+  for (i = 0; tools[i].name; i++)
+    if (!strcmp(tools[i].name, name) || !strcmp(tools[i].short_name, name))
+      return &tools[i];
+
+  return NULL;
+}
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+
+/* Run a tool in a child process, using the link of session S (which
+   is closed while the child runs.)  SETUP (if not NULL) is called in
+   the child, with DATA, to prepare its environment; if it returns
+   nonzero, the tool is not run.  Returns the tool's exit status. */
+int tt_run_tool(TTSession *s, const TTTool *tool, int argc, char **argv,
+		int (*setup)(gpointer data), gpointer data)
+{
+  int status, e;
+  pid_t pid, r;
+
+  fflush(stdout);
+  fflush(stderr);
+
+  tt_link_release(s);
+
+  if ((pid = fork()) < 0) {
+    g_printerr("%s: unable to fork: %s\n",
+	       g_get_prgname(), g_strerror(errno));
+    tt_link_reclaim(s);
+    return EXIT_INTERNAL_ERROR;
+  }
+
+  if (pid == 0) {
+    g_set_prgname(tool->name);
+
+    if (setup && (status = (*setup)(data)))
+      _exit(status);
+
+    tt_set_link_mode(TT_LINK_SERVED);
+    status = (*tool->main)(argc, argv);
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+  }
+
+  while ((r = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+    ;
+
+  /* (if this fails, the next command will say so) */
+  if ((e = tt_link_reclaim(s)))
+    tt_print_error(e, "unable to reopen link");
+
+  if (r >= 0 && WIFEXITED(status))
+    return WEXITSTATUS(status);
+  else
+    return EXIT_INTERNAL_ERROR;
+}
+
+#else /* !HAVE_FORK || !HAVE_SYS_WAIT_H */
+
+int tt_run_tool(G_GNUC_UNUSED TTSession *s, const TTTool *tool,
+		G_GNUC_UNUSED int argc,
+		G_GNUC_UNUSED char **argv,
+		G_GNUC_UNUSED int (*setup)(gpointer data),
+		G_GNUC_UNUSED gpointer data)
+{
+  g_printerr("%s: cannot run %s: not supported on this system\n",
+	     g_get_prgname(), tool->name);
+  return EXIT_INTERNAL_ERROR;
+}
+
+#endif
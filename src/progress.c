@@ -0,0 +1,311 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Transfer progress (--progress).
+
+   The tools mark the start and end of each transfer (a variable, an
+   application, an OS, a ROM dump) with tt_progress_begin() and
+   tt_progress_end().  In between, the main thread is inside
+   libticalcs, so a separate thread wakes up at fixed intervals, reads
+   the number of bytes the cable has moved so far
+   (ticables_progress_get), and reports it, either as a progress bar
+   on standard error, or as one JSON object per line:
+
+     {"event":"progress", "tool":"tiget", "item":"PRGM FOO",
+      "bytes":1234, "total":5000, "elapsed_ms":1250, "rate":987,
+      "eta_ms":3800}
+
+     {"event":"done", "tool":"tiget", "item":"PRGM FOO",
+      "bytes":5120, "total":5000, "elapsed_ms":5100, "rate":1003,
+      "status":0}
+
+   "bytes" counts everything sent and received over the cable,
+   including packet headers and acknowledgements, so it ends up
+   somewhat larger than "total" (the size of the data, or 0 if it is
+   not known in advance.)  "rate" is the average in bytes per second
+   since the start of the item, and "eta_ms" is null when it cannot be
+   estimated.  With --all-devices, a "device" field names the device.
+   All numbers are integers, so the output does not depend on the
+   locale. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "titools.h"
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+/* microseconds between reports */
+#define BAR_INTERVAL 200000
+#define JSON_INTERVAL 1000000
+
+#define BAR_WIDTH 20
+
+/* status passed to report() for a progress report, rather than the
+   end of an item */
+#define IN_PROGRESS G_MININT
+
+static struct {
+  GMutex lock;
+  GCond cond;
+  GThread *thread;
+  int mode;
+  CableHandle *cable;
+  char *label;			/* device label, or NULL */
+  char *item;			/* current item, or NULL if idle */
+  guint32 total;
+  gint64 start;			/* monotonic time (microseconds) */
+  int stop;
+  int bar_length;		/* length of the bar last printed */
+} prog;
+
+/* Choose the progress mode given by NAME (from --progress or
+   TITOOLS_PROGRESS.)  Returns -1 if NAME is not a valid mode. */
+int tt_progress_mode(const char *name)
+{
+  if (!name || !g_ascii_strcasecmp(name, "auto")) {
+#ifdef HAVE_UNISTD_H
+    if (isatty(2))
+      return TT_PROGRESS_BAR;
+#endif
+    return TT_PROGRESS_NONE;
+  }
+  else if (!g_ascii_strcasecmp(name, "none"))
+    return TT_PROGRESS_NONE;
+  else if (!g_ascii_strcasecmp(name, "bar"))
+    return TT_PROGRESS_BAR;
+  else if (!g_ascii_strcasecmp(name, "json"))
+    return TT_PROGRESS_JSON;
+  else
+    return -1;
+}
+
+/* Set up progress reports for transfers on the link of session S.
+   LABEL, if not NULL, names the device (for --all-devices.) */
+void tt_progress_init(TTSession *s, int mode, const char *label)
+{
+  tt_progress_end(-1);
+  prog.mode = mode;
+  prog.cable = (s ? s->cable : NULL);
+  g_free(prog.label);
+  prog.label = g_strdup(label);
+}
+
+int tt_progress_enabled()
+{
+  return (prog.mode != TT_PROGRESS_NONE);
+}
+
+static void json_string(GString *str, const char *s)
+{
+  g_string_append_c(str, '"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      g_string_append_printf(str, "\\%c", *s);
+    else if ((guchar) *s < 0x20)
+      g_string_append_printf(str, "\\u%04x", (guchar) *s);
+    else
+      g_string_append_c(str, *s);
+  }
+  g_string_append_c(str, '"');
+}
+
+static void print_json(const char *event, int bytes, gint64 elapsed,
+		       gint64 rate, int status)
+{
+  GString *str;
+
+  str = g_string_new("{\"event\":");
+  json_string(str, event);
+  g_string_append(str, ",\"tool\":");
+  json_string(str, g_get_prgname());
+  if (prog.label) {
+    g_string_append(str, ",\"device\":");
+    json_string(str, prog.label);
+  }
+  g_string_append(str, ",\"item\":");
+  json_string(str, prog.item);
+  g_string_append_printf(str, ",\"bytes\":%d,\"total\":%lu"
+			 ",\"elapsed_ms\":%ld,\"rate\":%ld",
+			 bytes, (unsigned long) prog.total,
+			 (long) (elapsed / 1000), (long) rate);
+
+  if (status != IN_PROGRESS) {
+    g_string_append_printf(str, ",\"status\":%d}\n", status);
+  }
+  else if (prog.total > 0 && rate > 0) {
+    g_string_append_printf(str, ",\"eta_ms\":%ld}\n",
+			   ((guint32) bytes >= prog.total ? 0L
+			    : (long) ((gint64) (prog.total - bytes) * 1000 / rate)));
+  }
+  else {
+    g_string_append(str, ",\"eta_ms\":null}\n");
+  }
+
+  fputs(str->str, stderr);
+  fflush(stderr);
+  g_string_free(str, TRUE);
+}
+
+static void clear_bar()
+{
+  if (prog.bar_length > 0) {
+    fprintf(stderr, "\r%*s\r", prog.bar_length, "");
+    fflush(stderr);
+    prog.bar_length = 0;
+  }
+}
+
+static void print_bar(int bytes, gint64 rate)
+{
+  char bar[BAR_WIDTH + 1], *eta, *ratestr, *line;
+  int n, percent;
+  gint64 secs;
+
+  if (prog.total > 0) {
+    /* (bytes includes protocol overhead; don't claim to be done
+       before the transfer ends) */
+    percent = (guint32) bytes >= prog.total ? 99 :
+      (int) ((gint64) bytes * 100 / prog.total);
+    n = percent * BAR_WIDTH / 100;
+    memset(bar, '=', n);
+    memset(bar + n, ' ', BAR_WIDTH - n);
+    bar[BAR_WIDTH] = 0;
+  }
+  else {
+    percent = -1;
+  }
+
+  if (rate >= 1024)
+    ratestr = g_strdup_printf("%ld.%ld KiB/s", (long) (rate / 1024),
+			      (long) (rate % 1024 * 10 / 1024));
+  else
+    ratestr = g_strdup_printf("%ld B/s", (long) rate);
+
+  if (prog.total > 0 && rate > 0 && (guint32) bytes < prog.total) {
+    secs = (gint64) (prog.total - bytes) / rate;
+    eta = g_strdup_printf("  ETA %ld:%02ld", (long) (secs / 60),
+			  (long) (secs % 60));
+  }
+  else {
+    eta = g_strdup("");
+  }
+
+  if (percent >= 0)
+    line = g_strdup_printf("%s [%s] %3d%%  %s%s", prog.item, bar, percent,
+			   ratestr, eta);
+  else
+    line = g_strdup_printf("%s  %d bytes  %s", prog.item, bytes, ratestr);
+
+  /* (overwrite the last bar, blanking out whatever is left of it) */
+  n = strlen(line);
+  fprintf(stderr, "\r%s%*s", line,
+	  (prog.bar_length > n ? prog.bar_length - n : 0), "");
+  fflush(stderr);
+  prog.bar_length = MAX(n, prog.bar_length);
+
+  g_free(line);
+  g_free(ratestr);
+  g_free(eta);
+}
+
+/* Report the current state (called with the lock held.)  STATUS is
+   IN_PROGRESS, or else the item's final status. */
+static void report(int status)
+{
+  int bytes = 0, msec;
+  float rate;
+  gint64 elapsed, bps;
+
+  if (!prog.cable || ticables_progress_get(prog.cable, &bytes, &msec, &rate))
+    bytes = 0;
+
+  elapsed = g_get_monotonic_time() - prog.start;
+  bps = (elapsed > 0 ? (gint64) bytes * 1000000 / elapsed : 0);
+
+  if (prog.mode == TT_PROGRESS_JSON)
+    print_json(status == IN_PROGRESS ? "progress" : "done",
+	       bytes, elapsed, bps, status);
+  else if (status == IN_PROGRESS)
+    print_bar(bytes, bps);
+  else
+    clear_bar();
+}
+
+static gpointer progress_thread(G_GNUC_UNUSED gpointer data)
+{
+  gint64 interval;
+
+  interval = (prog.mode == TT_PROGRESS_JSON ? JSON_INTERVAL : BAR_INTERVAL);
+
+  g_mutex_lock(&prog.lock);
+  while (!prog.stop) {
+    if (!g_cond_wait_until(&prog.cond, &prog.lock,
+			   g_get_monotonic_time() + interval))
+      report(IN_PROGRESS);
+  }
+  g_mutex_unlock(&prog.lock);
+  return NULL;
+}
+
+/* Begin transferring ITEM (a name to display, in UTF-8), which is
+   TOTAL bytes long (0 if unknown.) */
+void tt_progress_begin(const char *item, guint32 total)
+{
+  if (prog.mode == TT_PROGRESS_NONE)
+    return;
+
+  tt_progress_end(-1);
+
+  if (prog.cable)
+    ticables_progress_reset(prog.cable);
+
+  prog.item = g_strdup(item);
+  prog.total = total;
+  prog.start = g_get_monotonic_time();
+  prog.stop = 0;
+  prog.thread = g_thread_try_new("progress", &progress_thread, NULL, NULL);
+}
+
+/* Finish the current item; STATUS is 0 if it was transferred, or
+   else the tool's error status.  (Does nothing if no item is in
+   progress.) */
+void tt_progress_end(int status)
+{
+  if (!prog.item)
+    return;
+
+  if (prog.thread) {
+    g_mutex_lock(&prog.lock);
+    prog.stop = 1;
+    g_cond_signal(&prog.cond);
+    g_mutex_unlock(&prog.lock);
+    g_thread_join(prog.thread);
+    prog.thread = NULL;
+  }
+
+  report(status);
+  g_free(prog.item);
+  prog.item = NULL;
+}
@@ -0,0 +1,332 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Calculator sessions.  Nothing in this file (or in glob.c and
+   cache.c) uses global state, so several sessions may be used at once
+   from different threads; each session, however, must be used by
+   only one thread at a time. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "titools.h"
+
+/* Get the product ID of the Nth USB device (N = 1, 2, ...), or 0 if
+   there is no such device. */
+static int usb_pid_at(int n)
+{
+  int *usbpids = NULL, nusbpids, pid = 0;
+
+  if (!ticables_get_usb_devices(&usbpids, &nusbpids)
+      && n >= 1 && n <= nusbpids)
+    pid = usbpids[n - 1];
+
+  if (usbpids)
+    free(usbpids);
+  return pid;
+}
+
+/* Name of the cache group describing the calculator attached to a
+   given cable and port.  For USB devices, the product ID is included,
+   so that plugging in a different kind of device is noticed. */
+char * tt_link_key(CableModel cable, int port)
+{
+  int usbpid = 0;
+
+  if (cable == CABLE_USB || cable == CABLE_SLV)
+    usbpid = usb_pid_at(port);
+
+  if (usbpid)
+    return g_strdup_printf("%s:%d:%04x", ticables_model_to_string(cable),
+			   port, usbpid);
+  else
+    return g_strdup_printf("%s:%d", ticables_model_to_string(cable), port);
+}
+
+/* Create a session for a calculator that is already connected.  The
+   session takes ownership of CABLE and CALC.  LINK_KEY, if not NULL,
+   names the group in the "links" cache file where information about
+   this calculator may be stored. */
+TTSession * tt_session_new(CalcModel model, CableHandle *cable,
+			   CalcHandle *calc, const char *link_key)
+{
+  TTSession *s;
+
+  s = g_slice_new0(TTSession);
+  s->model = model;
+  s->cable = cable;
+  s->calc = calc;
+  s->link_key = g_strdup(link_key);
+  return s;
+}
+
+/* Connect to a calculator using the given cable and port.  If MODEL
+   is CALC_NONE, probe for the calculator model.  TIMEOUT is in
+   milliseconds.  Returns NULL, and sets *ERR to a libticalcs error
+   code, if the calculator cannot be reached. */
+TTSession * tt_session_open(CableModel cable_model, int port,
+			    CalcModel model, int timeout, int *err)
+{
+  CableHandle *cable;
+  CalcHandle *calc;
+  char *key;
+  TTSession *s;
+  int e;
+
+  if (!model && (e = ticalcs_probe(cable_model, port, &model, 0))) {
+    *err = e;
+    return NULL;
+  }
+
+  if (!(calc = ticalcs_handle_new(model))) {
+    *err = ERR_INVALID_HANDLE;
+    return NULL;
+  }
+
+  if (!(cable = ticables_handle_new(cable_model, port))) {
+    ticalcs_handle_del(calc);
+    *err = ERR_INVALID_HANDLE;
+    return NULL;
+  }
+
+  ticables_options_set_timeout(cable, (timeout + 99) / 100);
+
+  if ((e = ticalcs_cable_attach(calc, cable))
+      || (e = ticalcs_calc_isready(calc))) {
+    ticalcs_handle_del(calc);
+    ticables_handle_del(cable);
+    *err = e;
+    return NULL;
+  }
+
+  key = tt_link_key(cable_model, port);
+  s = tt_session_new(model, cable, calc, key);
+  g_free(key);
+  *err = 0;
+  return s;
+}
+
+/* Close the link and free the session */
+void tt_session_free(TTSession *s)
+{
+  if (!s)
+    return;
+
+  if (s->calc)
+    ticalcs_handle_del(s->calc); /* detaches + closes cable if
+				    necessary */
+  if (s->cable)
+    ticables_handle_del(s->cable);
+
+  tt_dirlist_clear(s);
+  g_free(s->dirlist_file);
+  g_free(s->link_key);
+  g_slice_free(TTSession, s);
+}
+
+/* Bring the link back to a known state (after a transfer failed part
+   way through): reset the cable, and check that the calculator
+   answers.  Any listing this session had read is discarded, since the
+   calculator may have changed.  Returns 0, or an error code. */
+int tt_session_resync(TTSession *s)
+{
+  int e;
+
+  tt_dirlist_clear(s);
+
+  if ((e = ticables_cable_reset(s->cable)))
+    return e;
+
+  return ticalcs_calc_isready(s->calc);
+}
+
+/* Close the session's link, remembering the cable and port so that
+   tt_session_attach() can open it again.  Any listing this session
+   had read is discarded. */
+void tt_session_detach(TTSession *s)
+{
+  if (s->cable) {
+    s->cable_model = ticables_get_model(s->cable);
+    s->port = ticables_get_port(s->cable);
+  }
+
+  if (s->calc)
+    ticalcs_handle_del(s->calc);
+  if (s->cable)
+    ticables_handle_del(s->cable);
+  s->calc = NULL;
+  s->cable = NULL;
+
+  tt_dirlist_clear(s);
+}
+
+/* Open the link closed by tt_session_detach() again.  (The timeout is
+   reset to the default.)  Returns 0, or an error code. */
+int tt_session_attach(TTSession *s)
+{
+  int e;
+
+  if (!(s->calc = ticalcs_handle_new(s->model)))
+    return ERR_INVALID_HANDLE;
+
+  if (!(s->cable = ticables_handle_new(s->cable_model, s->port))) {
+    ticalcs_handle_del(s->calc);
+    s->calc = NULL;
+    return ERR_INVALID_HANDLE;
+  }
+
+  if ((e = ticalcs_cable_attach(s->calc, s->cable))) {
+    ticalcs_handle_del(s->calc);
+    ticables_handle_del(s->cable);
+    s->calc = NULL;
+    s->cable = NULL;
+    return e;
+  }
+
+  return 0;
+}
+
+void tt_print_error(int e, const char *msg, ...)
+{
+  va_list ap;
+  char *ms, *es = NULL;
+
+  va_start(ap, msg);
+  ms = g_strdup_vprintf(msg, ap);
+  va_end(ap);
+
+  if (e && (!ticalcs_error_get(e, &es)
+	    || !ticables_error_get(e, &es)
+	    || !tifiles_error_get(e, &es)))
+    g_printerr("%s: %s\n%s\n", g_get_prgname(), ms, es);
+  else
+    g_printerr("%s: %s\n", g_get_prgname(), ms);
+
+  g_free(ms);
+  g_free(es);
+}
+
+char * tt_format_varname(const TTSession *s, const VarEntry *ve)
+{
+  const TTDirEntry *de;
+  const char *type;
+  char *folder;
+  char *name;
+  char *str;
+
+  type = tifiles_vartype2string(s->model, ve->type);
+
+  if ((de = tt_find_dir_entry(s, ve))) {
+    if (de->utf8_folder[0])
+      return g_strdup_printf("%s %s/%s", type, de->utf8_folder,
+			     de->utf8_name);
+    else
+      return g_strdup_printf("%s %s", type, de->utf8_name);
+  }
+  else if (ve->folder[0]) {
+    folder = ticonv_varname_to_utf8(s->model, ve->folder, -1);
+    name = ticonv_varname_to_utf8(s->model, ve->name, ve->type);
+    str = g_strdup_printf("%s %s/%s", type, folder, name);
+    g_free(folder);
+    g_free(name);
+    return str;
+  }
+  else {
+    name = ticonv_varname_to_utf8(s->model, ve->name, ve->type);
+    str = g_strdup_printf("%s %s", type, name);
+    g_free(name);
+    return str;
+  }
+}
+
+/* Get version information from the calculator */
+int tt_get_version(TTSession *s, CalcInfos *infos)
+{
+  return ticalcs_calc_get_version(s->calc, infos);
+}
+
+/* Get the calculator's free RAM and Flash, in bytes.  Either is set
+   to G_MAXUINT64 if the calculator does not report it.  Returns -1 if
+   this calculator cannot tell us. */
+int tt_get_memfree(TTSession *s, guint64 *ram, guint64 *flash)
+{
+  CalcInfos info;
+  uint32_t r, f;
+
+  if (ticalcs_calc_features(s->calc) & FTS_MEMFREE) {
+    if (ticalcs_calc_get_memfree(s->calc, &r, &f))
+      return -1;
+    *ram = (r == (uint32_t) -1 ? G_MAXUINT64 : r);
+    *flash = (f == (uint32_t) -1 ? G_MAXUINT64 : f);
+    return 0;
+  }
+  else if (ticalcs_calc_features(s->calc) & OPS_VERSION) {
+    if (tt_get_version(s, &info)
+	|| !(info.mask & (INFOS_RAM_FREE | INFOS_FLASH_FREE)))
+      return -1;
+    *ram = (info.mask & INFOS_RAM_FREE) ? info.ram_free : G_MAXUINT64;
+    *flash = (info.mask & INFOS_FLASH_FREE) ? info.flash_free : G_MAXUINT64;
+    return 0;
+  }
+
+  return -1;
+}
+
+/* The connected calculator's ID, for use in file names.  Returns
+   NULL if it has none. */
+char * tt_calc_id(TTSession *s)
+{
+  CalcInfos info;
+  char *id;
+
+  memset(&info, 0, sizeof(info));
+  if (!(ticalcs_calc_features(s->calc) & OPS_VERSION)
+      || tt_get_version(s, &info)
+      || !(info.mask & INFOS_MAIN_CALC_ID) || !info.main_calc_id[0])
+    return NULL;
+
+  id = g_strdup(info.main_calc_id);
+  g_strcanon(id, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+	     "0123456789-_.", '_');
+  return id;
+}
+
+/* Name identifying the connected calculator, for use in file names:
+   its calculator ID if it has one, or else the link.  Returns NULL if
+   neither is known.  (Another calculator may later be connected to
+   the same link, so only use this where that does no harm.) */
+char * tt_device_id(TTSession *s)
+{
+  char *id;
+
+  if ((id = tt_calc_id(s)))
+    return id;
+  else if (!s->link_key)
+    return NULL;
+
+  id = g_strdup(s->link_key);
+  g_strcanon(id, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+	     "0123456789-_.", '_');
+  return id;
+}
@@ -31,9 +31,12 @@
 
 int main(int argc, char **argv)
 {
+  TTSession *s;
   int rampage,numpages;
+  int e, status = 0;
 
-  tt_init(argc, argv, NULL, 0, 0, 1);
+  s = tt_init(argc, argv, NULL, 0, 0, 1);
+  tt_enter_output_dir();
 
   uint16_t page = 0;
   uint8_t *buffer;
@@ -41,10 +44,14 @@ int main(int argc, char **argv)
   FILE *f;
   char *filename;
 
-  if (calc_handle->model == CALC_TI84P || calc_handle->model == CALC_TI83P)
+  if (s->calc->model == CALC_TI84P || s->calc->model == CALC_TI83P)
   {
     CalcInfos info;
-    ticalcs_calc_get_version(calc_handle, &info);
+    if ((e = tt_get_version(s, &info))) {
+      tt_print_error(e, "unable to get version info");
+      status = 1;
+      goto exit2;
+    }
     switch(info.hw_version) {
     case 1:
     case 3:
@@ -70,25 +77,31 @@ int main(int argc, char **argv)
 
     buffer = (uint8_t *)malloc(0x5000);
 
-    filename = g_strconcat(tifiles_model_to_string(calc_handle->model), ".", "rom", NULL);
+    filename = g_strconcat(tifiles_model_to_string(s->calc->model), ".", "rom", NULL);
     f = fopen(filename, "wb");
 
     if (f == NULL)
       goto exit;
+    tt_progress_begin("ROM", (numpages + 1) * 0x4000);
     for(page = 0; page <= numpages; page++ ) {
 
-      printf("Receiving page %X out of %X\n", page, numpages);
+      if (!tt_progress_enabled())
+        printf("Receiving page %X out of %X\n", page, numpages);
 
-      int failed = ti73_send_DUMP(calc_handle, page) + ti73_recv_ACK(calc_handle, NULL) +
-              ti73_recv_XDP(calc_handle, &length, buffer) + ti73_send_ACK(calc_handle);
+      int failed = ti73_send_DUMP(s->calc, page) + ti73_recv_ACK(s->calc, NULL) +
+              ti73_recv_XDP(s->calc, &length, buffer) + ti73_send_ACK(s->calc);
       if (failed) {
+        tt_progress_end(1);
         printf("Rom Dump Failed\n");
         goto exit;
       }
 
-      if (fwrite(buffer, length, 1, f) < 1)
+      if (fwrite(buffer, length, 1, f) < 1) {
+        tt_progress_end(2);
         goto exit;
       }
+    }
+    tt_progress_end(0);
       //fclose(f);
       //filename = g_strconcat(tifiles_model_to_string(calc_handle->model), ".", "ram", NULL);
       //f = fopen(filename, "wb");
@@ -110,5 +123,5 @@ exit:
   }
 exit2:
   tt_exit();
-  return 0;
+  return status;
 }
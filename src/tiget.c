@@ -22,15 +22,28 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
 #include "titools.h"
 
+#if defined(HAVE_FSYNC) && defined(HAVE_FCNTL_H)
+# define SYNC_FILES 1
+# include <unistd.h>
+# include <fcntl.h>
+#endif
+
 /* FIXME:
    - prompt before overwriting
    - some weirdness with tig internal filenames */
 
 static gboolean backup_mode = FALSE;
+static gboolean incremental = FALSE;
+static gboolean resume = FALSE;
 static char *output_name = NULL;
+static char *store_dir = NULL;
+static int compression = -1;
 static char **patterns = NULL;
 
 static const GOptionEntry app_options[] =
@@ -38,71 +51,357 @@ static const GOptionEntry app_options[] =
      "Full backup of all calculator contents", NULL },
    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_name,
      "Write output to group FILE", "FILE" },
+   { "incremental", 0, 0, G_OPTION_ARG_NONE, &incremental,
+     "Transfer only variables changed since the last backup", NULL },
+   { "store", 0, 0, G_OPTION_ARG_FILENAME, &store_dir,
+     "Add variables to the backup store DIR", "DIR" },
+   { "resume", 0, 0, G_OPTION_ARG_NONE, &resume,
+     "Skip variables received by an interrupted run", NULL },
+   { "compression", 'z', 0, G_OPTION_ARG_INT, &compression,
+     "Compression level for TIG output (1-9, or 0 to store)", "N" },
    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY,
      &patterns, NULL, "VAR-PATTERN ..." },
    { 0, 0, 0, 0, 0, 0, 0 }};
 
-static FileContent **vars;
-static int nvars;
-static FlashContent **apps;
-static int napps;
+static TTGroupWriter *writer;
+static TTManifest *manifest;	/* for --incremental */
+static TTArchive *previous;	/* archive of the last backup, or the
+				   output of an interrupted run */
+static TTJournal *journal;
+
+/* Received variables are written by a separate thread, so that the
+   link can go on to the next variable in the meantime.  At most
+   MAX_PENDING variables wait to be written at once, so a slow disk
+   holds up the link rather than filling memory.
+
+   Separate files are written under temporary names, and renamed into
+   place SYNC_BATCH at a time (or whenever there is nothing else to
+   do), after being synced to disk; so a file either has its old
+   contents or its new ones, and is in the journal only once it is
+   safely written. */
+
+#define MAX_PENDING 8
+#define SYNC_BATCH 16
+
+typedef struct _OutputJob {
+  FileContent *vcontent;	/* variable to write, or NULL */
+  FlashContent *fcontent;	/* application to write, or NULL */
+  int listed;			/* variable is in the directory listing */
+  VarEntry ve;			/* variable as listed (no data) */
+  char *member;			/* file name within a TIGroup */
+  char *hash;			/* hash of contents */
+  char *path;			/* separate file written */
+  char *partname;		/* temporary file name */
+} OutputJob;
+
+static struct {
+  GMutex lock;
+  GCond cond;
+  GThread *thread;		/* writer thread, or NULL */
+  GQueue jobs;			/* jobs waiting to be done */
+  int pending;			/* jobs waiting or being done */
+  int unsynced;			/* files waiting to be renamed */
+  int finish;			/* no more jobs are coming */
+  int status;			/* first failure */
+} out;
+
+static GPtrArray *unsynced;	/* OutputJob (writer thread only) */
+
+static void job_free(OutputJob *job)
+{
+  if (job->vcontent)
+    tifiles_content_delete_regular(job->vcontent);
+  if (job->fcontent)
+    tifiles_content_delete_flash(job->fcontent);
+  g_free(job->member);
+  g_free(job->hash);
+  g_free(job->path);
+  g_free(job->partname);
+  g_slice_free(OutputJob, job);
+}
 
-static int save_regular(FileContent *vcontent)
+/* Record a variable that has been written */
+static void job_done(OutputJob *job)
 {
-  char *name = NULL;
-  int e, status = 0;
+  if (!job->listed)
+    return;
+  if (manifest)
+    tt_manifest_add(manifest, &job->ve, job->member, job->hash);
+  tt_journal_add(journal, &job->ve, job->ve.size, job->hash,
+		 (writer ? job->member : job->path));
+}
 
-  if (output_name) {
-    nvars++;
-    vars = g_renew(FileContent *, vars, nvars + 1);
-    vars[nvars - 1] = vcontent;
-    vars[nvars] = NULL;
+#ifdef SYNC_FILES
+static void sync_file(const char *filename)
+{
+  int fd;
+
+  if ((fd = g_open(filename, O_RDONLY, 0)) >= 0) {
+    fsync(fd);
+    close(fd);
   }
-  else {
-    if ((e = tifiles_file_write_regular(NULL, vcontent, &name))) {
-      tt_print_error(e, "unable to write output file");
+}
+#endif
+
+/* Rename separate files into place, once they are safely on disk */
+static int sync_files()
+{
+  OutputJob *job;
+  guint i;
+  int status = 0;
+
+#ifdef SYNC_FILES
+  for (i = 0; i < unsynced->len; i++) {
+    job = g_ptr_array_index(unsynced, i);
+    sync_file(job->partname);
+  }
+#endif
+
+  for (i = 0; i < unsynced->len; i++) {
+    job = g_ptr_array_index(unsynced, i);
+    if (g_rename(job->partname, job->path)) {
+      g_printerr("%s: %s: %s\n", g_get_prgname(), job->path,
+		 g_strerror(errno));
+      g_unlink(job->partname);
       status = 3;
+      g_free(job->path);
+      job->path = NULL;
     }
-    tifiles_content_delete_regular(vcontent);
-    g_free(name);
   }
 
+#ifdef SYNC_FILES
+  /* (the renames themselves) */
+  if (unsynced->len > 0)
+    sync_file(".");
+#endif
+
+  for (i = 0; i < unsynced->len; i++) {
+    job = g_ptr_array_index(unsynced, i);
+    if (job->path)
+      job_done(job);
+    job_free(job);
+  }
+
+  g_ptr_array_set_size(unsynced, 0);
   return status;
 }
 
-static int save_flash(FlashContent *fcontent)
+/* Write a variable or application to a separate file.  The job is
+   finished by sync_files(). */
+static int write_separate(OutputJob *job)
 {
   char *name = NULL;
-  int e, status = 0;
+  int e;
 
-  if (output_name) {
-    napps++;
-    apps = g_renew(FlashContent *, apps, napps + 1);
-    apps[napps - 1] = fcontent;
-    apps[napps] = NULL;
-  }
-  else {
-    if ((e = tifiles_file_write_flash2(NULL, fcontent, &name))) {
+  /* (variables received without asking are written as they are;
+     there may be more than one in a group file) */
+  if (job->vcontent && job->vcontent->num_entries != 1) {
+    if ((e = tifiles_file_write_regular(NULL, job->vcontent, &name))) {
       tt_print_error(e, "unable to write output file");
-      status = 3;
+      job_free(job);
+      return 3;
     }
-    tifiles_content_delete_flash(fcontent);
     g_free(name);
+    job_free(job);
+    return 0;
+  }
+
+  if (job->vcontent)
+    job->path = tt_group_member_name(job->vcontent->model,
+				     job->vcontent->entries[0]);
+  else
+    job->path = tt_group_member_name(job->fcontent->model, &job->ve);
+  job->partname = g_strconcat(job->path, ".part", NULL);
+
+  if (job->vcontent)
+    e = tifiles_file_write_regular(job->partname, job->vcontent, NULL);
+  else
+    e = tifiles_file_write_flash(job->partname, job->fcontent);
+
+  if (e) {
+    tt_print_error(e, "unable to write output file");
+    g_unlink(job->partname);
+    job_free(job);
+    return 3;
+  }
+
+  /* (the contents are no longer needed) */
+  if (job->vcontent)
+    tifiles_content_delete_regular(job->vcontent);
+  if (job->fcontent)
+    tifiles_content_delete_flash(job->fcontent);
+  job->vcontent = NULL;
+  job->fcontent = NULL;
+
+  g_ptr_array_add(unsynced, job);
+  if (unsynced->len >= SYNC_BATCH)
+    return sync_files();
+  return 0;
+}
+
+/* Carry out a job, and free it */
+static int run_job(OutputJob *job)
+{
+  int status = 0;
+
+  if (!writer && (job->vcontent || job->fcontent))
+    return write_separate(job);
+
+  /* (a job with nothing to write has only to be recorded) */
+  if (job->vcontent && tt_group_writer_add_regular(writer, job->vcontent))
+    status = 2;
+  else if (job->fcontent && tt_group_writer_add_flash(writer, job->fcontent))
+    status = 2;
+  else
+    job_done(job);
+
+  job_free(job);
+  return status;
+}
+
+static gpointer output_thread(G_GNUC_UNUSED gpointer data)
+{
+  OutputJob *job;
+  int status;
+
+  g_mutex_lock(&out.lock);
+
+  for (;;) {
+    if (!(job = g_queue_pop_head(&out.jobs))) {
+      /* nothing else to do for now */
+      if (out.unsynced) {
+	g_mutex_unlock(&out.lock);
+	status = sync_files();
+	g_mutex_lock(&out.lock);
+	if (status && !out.status)
+	  out.status = status;
+	out.unsynced = 0;
+	g_cond_broadcast(&out.cond);
+      }
+      else if (out.finish)
+	break;
+      else
+	g_cond_wait(&out.cond, &out.lock);
+      continue;
+    }
+
+    /* (after a failure, the rest is discarded) */
+    status = out.status;
+    g_mutex_unlock(&out.lock);
+    if (status)
+      job_free(job);
+    else
+      status = run_job(job);
+    g_mutex_lock(&out.lock);
+
+    if (status && !out.status)
+      out.status = status;
+    out.unsynced = unsynced->len;
+    out.pending--;
+    g_cond_broadcast(&out.cond);
+  }
+
+  g_mutex_unlock(&out.lock);
+  return NULL;
+}
+
+static void output_start()
+{
+  g_mutex_init(&out.lock);
+  g_cond_init(&out.cond);
+  g_queue_init(&out.jobs);
+  unsynced = g_ptr_array_new();
+
+  /* (if no thread can be created, jobs are done as they are
+     submitted) */
+  out.thread = g_thread_try_new("output", &output_thread, NULL, NULL);
+}
+
+/* Hand a job to the writer thread.  Returns nonzero (an exit status)
+   if an earlier job has failed. */
+static int output_submit(OutputJob *job)
+{
+  int status;
+
+  if (!out.thread) {
+    if (!out.status)
+      out.status = run_job(job);
+    else
+      job_free(job);
+    return out.status;
+  }
+
+  g_mutex_lock(&out.lock);
+  while (out.pending >= MAX_PENDING && !out.status)
+    g_cond_wait(&out.cond, &out.lock);
+
+  if ((status = out.status)) {
+    g_mutex_unlock(&out.lock);
+    job_free(job);
+    return status;
+  }
+
+  g_queue_push_tail(&out.jobs, job);
+  out.pending++;
+  g_cond_broadcast(&out.cond);
+  g_mutex_unlock(&out.lock);
+  return 0;
+}
+
+/* Wait for all jobs so far to be finished.  Returns nonzero (an exit
+   status) if any of them failed. */
+static int output_wait()
+{
+  int status;
+
+  if (!out.thread) {
+    status = sync_files();
+    if (!out.status)
+      out.status = status;
+    return out.status;
   }
 
+  g_mutex_lock(&out.lock);
+  while (out.pending || out.unsynced)
+    g_cond_wait(&out.cond, &out.lock);
+  status = out.status;
+  g_mutex_unlock(&out.lock);
   return status;
 }
 
-static int get_vars_ns()
+/* Finish all jobs, and stop the writer thread */
+static int output_finish()
+{
+  int status;
+
+  status = output_wait();
+
+  if (out.thread) {
+    g_mutex_lock(&out.lock);
+    out.finish = 1;
+    g_cond_broadcast(&out.cond);
+    g_mutex_unlock(&out.lock);
+    g_thread_join(out.thread);
+  }
+
+  g_ptr_array_free(unsynced, TRUE);
+  g_mutex_clear(&out.lock);
+  g_cond_clear(&out.cond);
+  return status;
+}
+
+static int get_vars_ns(TTSession *s)
 {
   FileContent *vcontent;
   VarEntry *head_entry = NULL;
+  OutputJob *job;
   int e;
 
-  vcontent = tifiles_content_create_regular(calc_model);
-  if ((e = ticalcs_calc_recv_var_ns(calc_handle, MODE_BACKUP, vcontent,
-				    &head_entry))
-      || vcontent->num_entries == 0) {
+  vcontent = tifiles_content_create_regular(s->model);
+  tt_progress_begin("variables", 0);
+  e = ticalcs_calc_recv_var_ns(s->calc, MODE_BACKUP, vcontent, &head_entry);
+  tt_progress_end((e || vcontent->num_entries == 0) ? 1 : 0);
+  if (e || vcontent->num_entries == 0) {
     tt_print_error(e, "unable to retrieve variables");
     if (head_entry)
       tifiles_ve_delete(head_entry);
@@ -113,49 +412,143 @@ static int get_vars_ns()
   if (head_entry)
     tifiles_ve_delete(head_entry);
 
-  return save_regular(vcontent);
+  job = g_slice_new0(OutputJob);
+  job->vcontent = vcontent;
+  return output_submit(job);
+}
+
+/* Copy a variable from the last backup, if it has not changed since
+   then.  Returns 0 if it was copied, -1 if it must be transferred, or
+   an exit status. */
+static int copy_unchanged(TTSession *s, VarEntry *ve)
+{
+  char *member, *hash;
+  int e;
+
+  /* (only sizes from the directory listing can be compared) */
+  if (!previous || !tt_find_dir_entry(s, ve)
+      || !tt_manifest_unchanged(manifest, ve, &member, &hash))
+    return -1;
+
+  /* (the writer must not be in use by the other thread) */
+  if (!(e = output_wait())) {
+    if (!(e = tt_group_writer_copy(writer, previous, member)))
+      tt_manifest_add(manifest, ve, member, hash);
+    else if (e > 0)
+      e = 2;
+  }
+
+  g_free(member);
+  g_free(hash);
+  return e;
+}
+
+/* Skip a variable received by the interrupted run being resumed, if
+   it has not changed on the calculator since.  Returns 0 if it was
+   skipped (or copied from the interrupted run's output), -1 if it
+   must be transferred, or an exit status. */
+static int skip_journalled(TTSession *s, VarEntry *ve)
+{
+  const TTJournalEntry *je;
+  OutputJob *job;
+  int e;
+
+  if (!(je = tt_journal_find(journal, ve))
+      || !tt_find_dir_entry(s, ve) || je->size != ve->size)
+    return -1;
+
+  if (writer) {
+    if (!previous || (e = output_wait()))
+      return (previous ? e : -1);
+    if ((e = tt_group_writer_copy(writer, previous, je->path)) < 0)
+      return -1;
+    else if (e)
+      return 2;
+  }
+  else if (!g_file_test(je->path, G_FILE_TEST_IS_REGULAR)) {
+    return -1;
+  }
+
+  /* (recorded again, in case this run is interrupted too) */
+  job = g_slice_new0(OutputJob);
+  job->listed = 1;
+  job->ve = *ve;
+  job->ve.data = NULL;
+  job->member = g_strdup(je->path);
+  job->path = g_strdup(je->path);
+  job->hash = g_strdup(je->hash);
+  return output_submit(job);
 }
 
-static int get_var(VarEntry *ve)
+static int get_var(TTSession *s, VarEntry *ve,
+		   G_GNUC_UNUSED gpointer data)
 {
   FileContent *vcontent;
   FlashContent *fcontent;
-  int e;
+  OutputJob *job;
+  int e, status;
   char *name;
 
-  if (ve->type == tifiles_flash_type(calc_model)) {
-    fcontent = tifiles_content_create_flash(calc_model);
-    if ((e = ticalcs_calc_recv_app(calc_handle, fcontent, ve))) {
-      name = tt_format_varname(ve);
+  if (manifest && (status = copy_unchanged(s, ve)) >= 0)
+    return status;
+  if (journal && (status = skip_journalled(s, ve)) >= 0)
+    return status;
+
+  job = g_slice_new0(OutputJob);
+  job->listed = (tt_find_dir_entry(s, ve) != NULL);
+  job->ve = *ve;
+  job->ve.data = NULL;
+
+  name = tt_format_varname(s, ve);
+  tt_progress_begin(name, ve->size);
+
+  if (ve->type == tifiles_flash_type(s->model)) {
+    fcontent = tifiles_content_create_flash(s->model);
+    e = ticalcs_calc_recv_app(s->calc, fcontent, ve);
+    tt_progress_end(e ? 1 : 0);
+    if (e) {
       tt_print_error(e, "unable to retrieve %s", name);
       g_free(name);
       tifiles_content_delete_flash(fcontent);
+      job_free(job);
       return 1;
     }
 
-    return save_flash(fcontent);
+    job->fcontent = fcontent;
+    if (manifest || journal) {
+      job->member = tt_group_member_name(s->model, ve);
+      job->hash = tt_flash_hash(fcontent);
+    }
   }
   else {
-    vcontent = tifiles_content_create_regular(calc_model);
-    if ((e = ticalcs_calc_recv_var(calc_handle, MODE_BACKUP, vcontent, ve))
-	|| vcontent->num_entries == 0) {
-      name = tt_format_varname(ve);
+    vcontent = tifiles_content_create_regular(s->model);
+    e = ticalcs_calc_recv_var(s->calc, MODE_BACKUP, vcontent, ve);
+    tt_progress_end((e || vcontent->num_entries == 0) ? 1 : 0);
+    if (e || vcontent->num_entries == 0) {
       tt_print_error(e, "unable to retrieve %s", name);
       g_free(name);
       tifiles_content_delete_regular(vcontent);
+      job_free(job);
       return 1;
     }
 
-    return save_regular(vcontent);
+    job->vcontent = vcontent;
+    if (manifest || journal) {
+      job->member = tt_group_member_name(s->model, vcontent->entries[0]);
+      job->hash = tt_var_hash(vcontent->entries[0]);
+    }
   }
+
+  g_free(name);
+  return output_submit(job);
 }
 
-static int get_backup()
+static int get_backup(TTSession *s)
 {
   BackupContent *bcontent;
   int e, status = 0;
 
-  if (!(ticalcs_calc_features(calc_handle) & FTS_BACKUP)) {
+  if (!(ticalcs_calc_features(s->calc) & FTS_BACKUP)) {
     g_printerr("%s: calculator does not support backup\n",
 	       g_get_prgname());
     return 10;
@@ -167,12 +560,14 @@ static int get_backup()
     return 15;
   }
 
-  bcontent = tifiles_content_create_backup(calc_model);
+  bcontent = tifiles_content_create_backup(s->model);
 
+  tt_progress_begin("backup", 0);
   do
-    e = ticalcs_calc_recv_backup(calc_handle, bcontent);
-  while (!(ticalcs_calc_features(calc_handle) & FTS_SILENT)
+    e = ticalcs_calc_recv_backup(s->calc, bcontent);
+  while (!(ticalcs_calc_features(s->calc) & FTS_SILENT)
 	 && e == ERROR_READ_TIMEOUT);
+  tt_progress_end(e ? 1 : 0);
 
   if (e) {
     tt_print_error(e, "unable to retrieve backup");
@@ -187,103 +582,133 @@ static int get_backup()
   return status;
 }
 
-static int output_grouped()
+static void print_usage_error(const char *msg)
 {
-  FileContent *grouped = NULL;
-  int e, status = 0;
+  g_printerr("%s: %s\n", g_get_prgname(), msg);
+  tt_exit();
+  exit(15);
+}
 
-  if (napps > 0) {
-    g_printerr("%s: cannot write vars and apps to a single group file\n",
-	       g_get_prgname());
-    return 3;
+int main(int argc, char **argv)
+{
+  TTSession *s;
+  const char *p;
+  char *archive, *id, *snapshot = NULL, *target = NULL, *cwd;
+  int status, e, closed = 1;
+
+  s = tt_init(argc, argv, app_options, 0, 0, 0);
+  tt_enter_output_dir();
+
+  if (compression < -1 || compression > 9)
+    print_usage_error("compression level must be between 0 and 9");
+
+  if (incremental) {
+    if (!output_name || !(p = strrchr(output_name, '.'))
+	|| g_ascii_strcasecmp(p, ".tig"))
+      print_usage_error("--incremental requires a .tig output file");
+    if (backup_mode || !patterns || !patterns[0])
+      print_usage_error("--incremental requires variable patterns");
+
+    manifest = tt_manifest_load(s);
+    if ((archive = tt_manifest_get_archive(manifest))) {
+      previous = tt_archive_open(archive);
+      g_free(archive);
+    }
   }
 
-  if ((e = tifiles_group_contents(vars, &grouped))) {
-    tt_print_error(e, "unable to create group file");
-    status = 3;
-  }
-  else if ((e = tifiles_file_write_regular(output_name, grouped, NULL))) {
-    tt_print_error(e, "unable to write output file");
-    status = 2;
+  if (resume) {
+    if (backup_mode || !patterns || !patterns[0])
+      print_usage_error("--resume requires variable patterns");
+    if (incremental || store_dir)
+      print_usage_error("--resume cannot be used with --incremental"
+			" or --store");
+    if (output_name && (!(p = strrchr(output_name, '.'))
+			|| g_ascii_strcasecmp(p, ".tig")))
+      print_usage_error("--resume requires separate files or a .tig"
+			" output file");
   }
 
-  if (grouped)
-    tifiles_content_delete_regular(grouped);
-  return status;
-}
+  /* every transfer of selected variables is journalled, so that it
+     can be resumed if it fails */
+  if (patterns && patterns[0] && !backup_mode && !incremental && !store_dir
+      && (!output_name || ((p = strrchr(output_name, '.'))
+			   && !g_ascii_strcasecmp(p, ".tig")))) {
+    cwd = g_get_current_dir();
+    if (output_name && g_path_is_absolute(output_name))
+      target = g_strdup(output_name);
+    else
+      target = g_build_filename(cwd, output_name, NULL);
+    g_free(cwd);
 
-static int output_flash()
-{
-  int e;
+    journal = tt_journal_open(s, "tiget", target, resume);
+    if (journal && resume && output_name)
+      previous = tt_archive_open(output_name);
+    g_free(target);
+  }
 
-  if (napps > 1) {
-    g_printerr("%s: cannot write multiple apps to a single file\n",
-	       g_get_prgname());
-    return 3;
+  if (store_dir) {
+    if (output_name || backup_mode || incremental)
+      print_usage_error("--store cannot be used with -o, -b or --incremental");
+
+    if (!(id = tt_device_id(s)))
+      id = g_strdup("unknown");
+    if (!(writer = tt_group_writer_new_store(s->model, store_dir, id))) {
+      g_free(id);
+      tt_exit();
+      return 3;
+    }
+    g_free(id);
+    snapshot = g_strdup(tt_group_writer_filename(writer));
   }
-  else if ((e = tifiles_file_write_flash(output_name, apps[0]))) {
-    tt_print_error(e, "unable to write output file");
+
+  /* variables are added to the output file as they are received */
+  if (output_name && !backup_mode
+      && !(writer = tt_group_writer_new(s->model, output_name))) {
+    tt_exit();
     return 2;
   }
 
-  return 0;
-}
-
-static int output_tig()
-{
-  TigContent *tig = NULL;
-  int e, status = 0;
+  if (writer && compression >= 0)
+    tt_group_writer_set_compression(writer, compression);
 
-  if ((e = tifiles_tigroup_contents(vars, apps, &tig))) {
-    tt_print_error(e, "unable to create group file");
-    status = 3;
-  }
-  else if ((e = tifiles_file_write_tigroup(output_name, tig))) {
-    tt_print_error(e, "unable to write output file");
-    status = 2;
+  if (backup_mode) {
+    status = get_backup(s);
   }
+  else {
+    output_start();
+    if (patterns && patterns[0])
+      status = tt_globs_foreach(s, patterns, &get_var, NULL);
+    else
+      status = get_vars_ns(s);
 
-  if (tig)
-    tifiles_content_delete_tigroup(tig);
-  return status;
-}
-
-int main(int argc, char **argv)
-{
-  int i, status;
-  const char *p;
+    /* (whatever was received before a failure is still written) */
+    if ((e = output_finish()) && !status)
+      status = e;
+  }
 
-  tt_init(argc, argv, app_options, 0, 0, 0);
+  /* (the old archive may be the one about to be replaced) */
+  tt_archive_close(previous);
 
-  if (backup_mode)
-    status = get_backup();
-  else if (patterns && patterns[0])
-    status = tt_globs_foreach(patterns, &get_var);
-  else
-    status = get_vars_ns();
-
-  if (output_name && !status && (nvars > 0 || napps > 0)) {
-    if ((p = strrchr(output_name, '.'))
-	&& !g_ascii_strcasecmp(p, ".tig"))
-      status = output_tig();
-    else if (nvars > 0)
-      status = output_grouped();
-    else
-      status = output_flash();
+  /* (if something failed, the file still holds everything received
+     before the failure, and the manifest says what that was) */
+  if (writer && tt_group_writer_close(writer)) {
+    closed = 0;
+    if (!status)
+      status = 2;
   }
-
-  if (vars) {
-    for (i = 0; i < nvars; i++)
-      tifiles_content_delete_regular(vars[i]);
-    g_free(vars);
+  else if (manifest) {
+    tt_manifest_save(manifest, output_name);
   }
-
-  if (apps) {
-    for (i = 0; i < napps; i++)
-      tifiles_content_delete_flash(apps[i]);
-    g_free(apps);
+  else if (snapshot && g_file_test(snapshot, G_FILE_TEST_EXISTS)) {
+    printf("%s\n", snapshot);
   }
 
+  /* (the journal is only worth keeping if it describes what has been
+     written) */
+  tt_journal_close(journal, (status && closed));
+
+  g_free(snapshot);
+  tt_manifest_free(manifest);
   tt_exit();
   return status;
 }
@@ -27,16 +27,17 @@
 
 int main(int argc, char **argv)
 {
+  TTSession *s;
   CalcInfos info;
   uint32_t ram, flash;
   int e;
 
-  tt_init(argc, argv, NULL, 0, 0, 1);
+  s = tt_init(argc, argv, NULL, 0, 0, 1);
 
-  g_print("Model: %s\n", ticalcs_model_to_string(calc_model));
+  g_print("Model: %s\n", ticalcs_model_to_string(s->model));
 
-  if (ticalcs_calc_features(calc_handle) & OPS_VERSION) {
-    if ((e = ticalcs_calc_get_version(calc_handle, &info))) {
+  if (ticalcs_calc_features(s->calc) & OPS_VERSION) {
+    if ((e = tt_get_version(s, &info))) {
       tt_print_error(e, "unable to get version info");
       tt_exit();
       return 1;
@@ -86,8 +87,8 @@ int main(int argc, char **argv)
     if (info.mask & INFOS_CLOCK_SPEED)
       g_print("Clock speed:       %d\n", info.clock_speed);
   }
-  else if (ticalcs_calc_features(calc_handle) & FTS_MEMFREE) {
-    if ((e = ticalcs_calc_get_memfree(calc_handle, &ram, &flash))) {
+  else if (ticalcs_calc_features(s->calc) & FTS_MEMFREE) {
+    if ((e = ticalcs_calc_get_memfree(s->calc, &ram, &flash))) {
       tt_print_error(e, "unable to get free memory");
       tt_exit();
       return 1;
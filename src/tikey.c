@@ -33,44 +33,31 @@ static const GOptionEntry app_options[] =
      &input_strings, NULL, "TEXT ..." },
    { 0, 0, 0, 0, 0, 0, 0 }};
 
-static uint16_t ascii_to_key(CalcModel model, char c)
+/* Get the keypress for a character.  ASCII characters are looked up
+   directly; others are first translated to the calculator's
+   character set, so that symbols such as Greek letters can be
+   typed. */
+static uint16_t char_to_key(CalcModel model, const char *p)
 {
-  const CalcKey *ck;
+  gunichar c;
 
-  if (c < 0 || c > '~')
-    return 0;
-
-  if (model == CALC_TI73)
-    ck = ticalcs_keys_73(c);
-  else if (model == CALC_TI82 || model == CALC_TI83)
-    ck = ticalcs_keys_83(c);
-  else if (model == CALC_TI83P || model == CALC_TI84P
-	   || model == CALC_TI84P_USB)
-    ck = ticalcs_keys_83p(c);
-  else if (model == CALC_TI86)
-    ck = ticalcs_keys_86(c);
-  else if (model == CALC_TI89 || model == CALC_TI89T_USB
-	   || model == CALC_TI89T)
-    ck = ticalcs_keys_89(c);
-  else if (model == CALC_TI92 || model == CALC_TI92P
-	   || model == CALC_V200)
-    ck = ticalcs_keys_89(c);
-  else
-    return 0;
+  if (!(*p & 0x80))
+    return (*p <= '~' ? tt_ti_to_key(model, *p) : 0);
 
-  if (!ck)
+  c = g_utf8_get_char_validated(p, -1);
+  if (c == (gunichar) -1 || c == (gunichar) -2)
     return 0;
-
-  return ck->normal.value;
+  return tt_ti_to_key(model, tt_unichar_to_ti(model, c));
 }
 
 int main(int argc, char **argv)
 {
+  TTSession *session;
   int i, n, k, e;
   uint16_t *kvalues;
   char *p, *q, *s;
 
-  tt_init(argc, argv, app_options, 1, OPS_KEYS, 1);
+  session = tt_init(argc, argv, app_options, 1, OPS_KEYS, 1);
 
   for (i = n = 0; input_strings && input_strings[i]; i++)
     n += strlen(input_strings[i]) + 1;
@@ -83,7 +70,7 @@ int main(int argc, char **argv)
       if (*p == '\\' && p[1]) {
 	if (p[1] == 'n' || p[1] == 'N'
 	    || p[1] == 'r' || p[1] == 'R') {
-	  k = ascii_to_key(calc_model, '\r');
+	  k = char_to_key(session->model, "\r");
 	  q = p + 2;
 	}
 	else if (p[1] == 'x' || p[1] == 'X') {
@@ -93,12 +80,12 @@ int main(int argc, char **argv)
 	  k = strtol(p + 1, &q, 8);
 	}
 	else {
-	  k = ascii_to_key(calc_model, p[1]);
+	  k = char_to_key(session->model, p + 1);
 	  q = g_utf8_next_char(p + 1);
 	}
       }
       else {
-	k = ascii_to_key(calc_model, *p);
+	k = char_to_key(session->model, p);
 	q = g_utf8_next_char(p);
       }
 
@@ -117,7 +104,7 @@ int main(int argc, char **argv)
   }
 
   for (i = 0; i < n; i++) {
-    if ((e = ticalcs_calc_send_key(calc_handle, kvalues[i]))) {
+    if ((e = ticalcs_calc_send_key(session->calc, kvalues[i]))) {
       tt_print_error(e, "unable to send key");
       g_free(kvalues);
       tt_exit();
@@ -125,6 +112,8 @@ int main(int argc, char **argv)
     }
   }
 
+  /* (the keys might have changed anything) */
+  tt_dirlist_changed(session);
   g_free(kvalues);
   tt_exit();
   return 0;
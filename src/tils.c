@@ -32,10 +32,12 @@ static const GOptionEntry app_options[] =
      &patterns, NULL, "[VAR-PATTERN ...]" },
    { 0, 0, 0, 0, 0, 0, 0 }};
 
-static int print_var(VarEntry *ve)
+static int print_var(TTSession *s, VarEntry *ve,
+		     G_GNUC_UNUSED gpointer data)
 {
+  const TTDirEntry *de;
   const char *as;
-  char *s;
+  char *str;
 
   if (ve->attr == ATTRB_NONE)
     as = "---";
@@ -49,31 +51,39 @@ static int print_var(VarEntry *ve)
     as = "<?>";
 
   g_print("%7d\t%s\t%s\t", ve->size, as,
-	  tifiles_vartype2string(calc_model, ve->type));
+	  tifiles_vartype2string(s->model, ve->type));
+
+  if ((de = tt_find_dir_entry(s, ve))) {
+    if (de->utf8_folder[0])
+      g_print("%s/", de->utf8_folder);
+    g_print("%s\n", de->utf8_name);
+    return 0;
+  }
 
   if (ve->folder[0]) {
-    s = ticonv_varname_to_utf8(calc_model, ve->folder, -1);
-    g_print("%s/", s);
-    g_free(s);
+    str = ticonv_varname_to_utf8(s->model, ve->folder, -1);
+    g_print("%s/", str);
+    g_free(str);
   }
 
-  s = ticonv_varname_to_utf8(calc_model, ve->name, ve->type);
-  g_print("%s\n", s);
-  g_free(s);
+  str = ticonv_varname_to_utf8(s->model, ve->name, ve->type);
+  g_print("%s\n", str);
+  g_free(str);
 
   return 0;
 }
 
 int main(int argc, char **argv)
 {
+  TTSession *s;
   int status;
 
-  tt_init(argc, argv, app_options, 0, OPS_DIRLIST, 1);
+  s = tt_init(argc, argv, app_options, 0, OPS_DIRLIST, 1);
 
   if (patterns && patterns[0])
-    status = tt_globs_foreach(patterns, &print_var);
+    status = tt_globs_foreach(s, patterns, &print_var, NULL);
   else
-    status = tt_vars_foreach(&print_var);
+    status = tt_vars_foreach(s, &print_var, NULL);
 
   tt_exit();
   return status;
@@ -0,0 +1,312 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* tipack: list packs (see groupfile.c), and convert between packs,
+   TIGroup files, and group files.  This works on files only, and
+   never talks to a calculator. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include "titools.h"
+
+static gboolean list = FALSE;
+static gboolean showversion = FALSE;
+static char **files = NULL;
+
+static const GOptionEntry options[] =
+  {{ "list", 'l', 0, G_OPTION_ARG_NONE, &list,
+     "List the contents of a pack", NULL },
+   { "version", 0, 0, G_OPTION_ARG_NONE, &showversion,
+     "Show version information", NULL },
+   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files,
+     NULL, "INPUT OUTPUT" },
+   { 0, 0, 0, 0, 0, 0, 0 }};
+
+/* Print one entry of a pack */
+static void list_entry(const TTPack *pack, const TTPackEntry *pe)
+{
+  CalcModel model = tt_pack_model(pack);
+  char *folder, *name;
+  int i;
+
+  name = ticonv_varname_to_utf8(model, pe->name, pe->type);
+  if (pe->folder[0]) {
+    folder = ticonv_varname_to_utf8(model, pe->folder, -1);
+    g_print("%s/%s", folder, name);
+    g_free(folder);
+  }
+  else {
+    g_print("%s", name);
+  }
+  g_free(name);
+
+  g_print("\t%s\t%lu\t", tifiles_vartype2string(model, pe->type),
+	  (unsigned long) pe->length);
+  for (i = 0; i < 32; i++)
+    g_print("%02x", pe->hash[i]);
+  g_print("\n");
+}
+
+/* List the entries of a pack, or only those named in VARS (NAME or
+   FOLDER/NAME, in UTF-8) */
+static int list_pack(const char *fname, char **vars)
+{
+  TTPack *pack;
+  TTPackEntry pe;
+  char *folder, *name;
+  const char *p;
+  int i, j, n, status = 0;
+
+  if (!(pack = tt_pack_open(fname))) {
+    g_printerr("%s: %s: not a pack\n", g_get_prgname(), fname);
+    return 3;
+  }
+
+  n = tt_pack_count(pack);
+
+  if (!vars || !vars[0]) {
+    for (i = 0; i < n; i++) {
+      if (tt_pack_entry(pack, i, &pe)) {
+	g_printerr("%s: %s: file is damaged\n", g_get_prgname(), fname);
+	status = 3;
+	break;
+      }
+      list_entry(pack, &pe);
+    }
+    tt_pack_close(pack);
+    return status;
+  }
+
+  for (j = 0; vars[j]; j++) {
+    folder = NULL;
+    if ((p = strchr(vars[j], '/'))) {
+      name = g_strndup(vars[j], p - vars[j]);
+      folder = tt_utf8_to_ti(tt_pack_model(pack), name);
+      g_free(name);
+      name = tt_utf8_to_ti(tt_pack_model(pack), p + 1);
+    }
+    else {
+      name = tt_utf8_to_ti(tt_pack_model(pack), vars[j]);
+    }
+
+    if ((i = tt_pack_find(pack, folder, name)) < 0) {
+      g_printerr("%s: %s: %s not found\n", g_get_prgname(), fname, vars[j]);
+      status = 3;
+    }
+
+    for (; i >= 0 && i < n; i++) {
+      if (tt_pack_entry(pack, i, &pe)) {
+	g_printerr("%s: %s: file is damaged\n", g_get_prgname(), fname);
+	status = 3;
+	break;
+      }
+      if ((folder && strcmp(pe.folder, folder)) || strcmp(pe.name, name))
+	break;
+      list_entry(pack, &pe);
+    }
+
+    g_free(folder);
+    g_free(name);
+  }
+
+  tt_pack_close(pack);
+  return status;
+}
+
+/* Copy each entry of a pack to W */
+static int convert_pack(TTPack *pack, const char *fname, TTGroupWriter *w)
+{
+  TTPackEntry pe;
+  FileContent *content;
+  FlashContent *flash;
+  int i, n;
+
+  n = tt_pack_count(pack);
+  for (i = 0; i < n; i++) {
+    if (tt_pack_entry(pack, i, &pe)) {
+      g_printerr("%s: %s: file is damaged\n", g_get_prgname(), fname);
+      return 3;
+    }
+
+    if (pe.kind == TT_PACK_VAR) {
+      content = tt_pack_content(pack, &pe);
+      if (tt_group_writer_add_regular(w, content)) {
+	tt_pack_content_free(content);
+	return 2;
+      }
+      tt_pack_content_free(content);
+    }
+    else if ((flash = tt_pack_flash_content(pack, &pe))) {
+      if (tt_group_writer_add_flash(w, flash)) {
+	tifiles_content_delete_flash(flash);
+	return 2;
+      }
+      tifiles_content_delete_flash(flash);
+    }
+    else {
+      return 3;
+    }
+  }
+
+  return 0;
+}
+
+/* Copy each entry of a TIGroup file to W */
+static int convert_tig(TigContent *tig, TTGroupWriter *w)
+{
+  TigEntry *te;
+  int i;
+
+  for (i = 0; i < tig->n_vars; i++) {
+    te = tig->var_entries[i];
+    if (tt_group_writer_add_regular(w, te->content.regular))
+      return 2;
+  }
+
+  for (i = 0; i < tig->n_apps; i++) {
+    te = tig->app_entries[i];
+    if (tt_group_writer_add_flash(w, te->content.flash))
+      return 2;
+  }
+
+  return 0;
+}
+
+/* Convert INPUT to OUTPUT, whose format is chosen by its name (as for
+   'tiget -o') */
+static int convert(const char *input, const char *output)
+{
+  TTGroupWriter *w = NULL;
+  TTPack *pack;
+  TigContent *tig;
+  FileContent *regular;
+  FlashContent *flash;
+  int e, status;
+
+  if ((pack = tt_pack_open(input))) {
+    if (!(w = tt_group_writer_new(tt_pack_model(pack), output)))
+      status = 2;
+    else
+      status = convert_pack(pack, input, w);
+    tt_pack_close(pack);
+  }
+  else if (tifiles_file_is_tigroup(input)) {
+    tig = tifiles_content_create_tigroup(CALC_NONE, 0);
+    if ((e = tifiles_file_read_tigroup(input, tig))) {
+      tt_print_error(e, "unable to read file");
+      status = 3;
+    }
+    else if (!(w = tt_group_writer_new(tig->model, output)))
+      status = 2;
+    else
+      status = convert_tig(tig, w);
+    tifiles_content_delete_tigroup(tig);
+  }
+  else if (tifiles_file_is_regular(input)) {
+    regular = tifiles_content_create_regular(CALC_NONE);
+    if ((e = tifiles_file_read_regular(input, regular))) {
+      tt_print_error(e, "unable to read file");
+      status = 3;
+    }
+    else if (!(w = tt_group_writer_new(regular->model, output)))
+      status = 2;
+    else
+      status = (tt_group_writer_add_regular(w, regular) ? 2 : 0);
+    tifiles_content_delete_regular(regular);
+  }
+  else if (tifiles_file_is_app(input)) {
+    flash = tifiles_content_create_flash(CALC_NONE);
+    if ((e = tifiles_file_read_flash(input, flash))) {
+      tt_print_error(e, "unable to read file");
+      status = 3;
+    }
+    else if (!(w = tt_group_writer_new(flash->model, output)))
+      status = 2;
+    else
+      status = (tt_group_writer_add_flash(w, flash) ? 2 : 0);
+    tifiles_content_delete_flash(flash);
+  }
+  else {
+    g_printerr("%s: %s: unknown file type\n", g_get_prgname(), input);
+    return 3;
+  }
+
+  if (w && tt_group_writer_close(w) && !status)
+    status = 2;
+
+  return status;
+}
+
+int main(int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  char *usage;
+  int n, status;
+
+  setlocale(LC_ALL, "");
+
+  ctx = g_option_context_new("");
+  g_option_context_set_summary(ctx, "List, or convert between, packs,"
+			       " TIGroup files, and group files.");
+  g_option_context_add_main_entries(ctx, options, NULL);
+
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    files = NULL;
+  }
+  else if (showversion) {
+    g_print("%s (%s)\n"
+	    "Copyright (C) 2010 Benjamin Moody\n"
+	    "This program is free software. "
+	    " There is NO WARRANTY of any kind.\n"
+	    "Report bugs to %s.\n",
+	    g_get_prgname(), PACKAGE_STRING, PACKAGE_BUGREPORT);
+    g_option_context_free(ctx);
+    return 0;
+  }
+
+  n = (files ? g_strv_length(files) : 0);
+  if (argc != 1 || (list ? n < 1 : n != 2)) {
+    usage = g_option_context_get_help(ctx, TRUE, NULL);
+    g_printerr("%s", usage);
+    g_free(usage);
+    g_option_context_free(ctx);
+    return EXIT_INVALID_OPTIONS;
+  }
+  g_option_context_free(ctx);
+
+  tifiles_library_init();
+
+  if (list)
+    status = list_pack(files[0], files + 1);
+  else
+    status = convert(files[0], files[1]);
+
+  tifiles_library_exit();
+  g_strfreev(files);
+  return status;
+}
@@ -33,8 +33,24 @@ static gboolean force_unarchive = FALSE;
 static gboolean no_check_overwrite = FALSE;
 static gboolean non_silent = FALSE;
 static gboolean no_eot = FALSE;
+static gboolean resume = FALSE;
+static gboolean no_check = FALSE;
+static gboolean keep_order = FALSE;
+static gboolean skip_unchanged = FALSE;
+static gboolean broadcast = FALSE;
+static int retries = 0;
 static char **input_files = NULL;
 
+static gboolean set_broadcast(G_GNUC_UNUSED const gchar *name,
+			      G_GNUC_UNUSED const gchar *value,
+			      G_GNUC_UNUSED gpointer data,
+			      G_GNUC_UNUSED GError **err)
+{
+  broadcast = TRUE;
+  tt_use_all_devices();
+  return TRUE;
+}
+
 static const GOptionEntry app_options[] =
   {{ "archive", 'a', 0, G_OPTION_ARG_NONE, &force_archive,
      "Send all files to archive (Flash)", NULL },
@@ -46,37 +62,107 @@ static const GOptionEntry app_options[] =
       "Send files in calc-to-calc mode", NULL }, */
    { "continue", 'C', 0, G_OPTION_ARG_NONE, &no_eot,
      "Leave LINK RECEIVE mode active (TI-82/85 only)", NULL },
+   { "resume", 0, 0, G_OPTION_ARG_NONE, &resume,
+     "Skip variables sent by an interrupted run", NULL },
+   { "no-check", 0, 0, G_OPTION_ARG_NONE, &no_check,
+     "Don't check for enough free memory before sending", NULL },
+   { "keep-order", 0, 0, G_OPTION_ARG_NONE, &keep_order,
+     "Send files in the order given", NULL },
+   { "skip-unchanged", 0, 0, G_OPTION_ARG_NONE, &skip_unchanged,
+     "Don't send variables the calculator already has", NULL },
+   { "broadcast", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+     &set_broadcast, "Send to every connected calculator at once", NULL },
+   { "retry", 0, 0, G_OPTION_ARG_INT, &retries,
+     "If a transfer fails, try again up to N times", "N" },
    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &input_files,
      NULL, "FILE ..." },
    { 0, 0, 0, 0, 0, 0, 0 }};
 
-static GNode *vars_list = NULL, *apps_list = NULL;
+static TTJournal *journal;
+static TTJournal *record;		/* what was last sent (see journal.c) */
+static const char *current_file;	/* file being sent, for the journal */
+
+/* Entry naming a Flash application */
+static void flash_ve(const FlashContent *content, VarEntry *ve)
+{
+  memset(ve, 0, sizeof(VarEntry));
+  ve->type = content->data_type;
+  strncpy(ve->name, content->name, sizeof(ve->name) - 1);
+}
+
+/* Check whether a variable was sent by the interrupted run being
+   resumed, and is still on the calculator.  (The size of an
+   application as listed is not known when it is sent, so only its
+   presence is checked.)  Returns 1 if so, 0 if not, or 2 on error. */
+static int journalled(TTSession *s, VarEntry *ve, const char *hash)
+{
+  const TTJournalEntry *je;
+  VarEntry *oldve;
+  int e;
+
+  if (!(je = tt_journal_find(journal, ve)) || strcmp(je->hash, hash))
+    return 0;
+
+  if ((e = tt_dirlist_lookup(s, ve, &oldve))) {
+    tt_print_error(e, "unable to read directory listing");
+    return 2;
+  }
+
+  if (!oldve || (je->size && je->size != oldve->size))
+    return 0;
+
+  tt_journal_add(journal, ve, je->size, je->hash, je->path);
+  return 1;
+}
+
+/* Check whether the calculator already has a variable with the given
+   contents: it must be listed with the same size and attributes as
+   the copy we would send, and the last copy we sent must have had the
+   same contents.  (As with journalled(), only the presence of an
+   application is checked.)  Returns 1 if so, 0 if not, or 2 on
+   error. */
+static int unchanged(TTSession *s, VarEntry *ve, const char *hash, int app)
+{
+  const TTJournalEntry *je;
+  VarEntry *oldve;
+  int e;
+
+  if ((e = tt_dirlist_lookup(s, ve, &oldve))) {
+    tt_print_error(e, "unable to read directory listing");
+    return 2;
+  }
 
-static int confirm_overwrite(VarEntry *ve, gboolean check_apps)
+  if (!oldve || !(je = tt_journal_find(record, ve))
+      || strcmp(je->hash, hash))
+    return 0;
+
+  if (!app && (oldve->size != ve->size || je->size != ve->size
+	       || ((oldve->attr == ATTRB_ARCHIVED)
+		   != (ve->attr == ATTRB_ARCHIVED))))
+    return 0;
+
+  return 1;
+}
+
+static int confirm_overwrite(TTSession *s, VarEntry *ve)
 {
   char *name;
   char buf[100];
-  GNode *list;
   VarEntry *oldve;
   int e;
 
   if (no_check_overwrite)
     return 0;
 
-  if (!vars_list) {
-    if ((e = ticalcs_calc_get_dirlist(calc_handle,
-				      &vars_list, &apps_list))) {
-      tt_print_error(e, "unable to read directory listing");
-      return 2;
-    }
+  if ((e = tt_dirlist_lookup(s, ve, &oldve))) {
+    tt_print_error(e, "unable to read directory listing");
+    return 2;
   }
 
-  list = (check_apps ? apps_list : vars_list);
-  oldve = ticalcs_dirlist_ve_exist(list, ve);
   if (!oldve)
     return 0;
 
-  name = tt_format_varname(oldve);
+  name = tt_format_varname(s, oldve);
   g_printerr("%s exists; overwrite? ", name);
   g_free(name);
 
@@ -101,75 +187,197 @@ static void confirm_link_menu()
   }
 }
 
-static int send_regular(FileContent *content, int final)
+/* Total size of the data in a Flash file */
+static guint32 flash_size(const FlashContent *content)
+{
+  const FlashContent *p;
+  guint32 size = 0;
+  int i;
+
+  for (p = content; p; p = p->next) {
+    size += p->data_length;
+    for (i = 0; i < p->num_pages; i++)
+      size += p->pages[i]->size;
+  }
+  return size;
+}
+
+/* Name of the variables being sent, for progress reports */
+static char * regular_item(TTSession *s, FileContent *content,
+			   guint32 *total)
 {
-  int i, e;
+  VarEntry *ve = NULL;
+  int i, n = 0;
+
+  *total = 0;
+  for (i = 0; i < content->num_entries; i++) {
+    if (content->entries[i]->action != ACT_SKIP) {
+      ve = content->entries[i];
+      *total += ve->size;
+      n++;
+    }
+  }
+
+  if (n == 1)
+    return tt_format_varname(s, ve);
+  else
+    return g_strdup_printf("%d variables", n);
+}
+
+static int send_regular(TTSession *s, FileContent *content, int final)
+{
+  char **hashes, *item;
+  guint32 total;
+  int i, e, n_done = 0;
 
   confirm_link_menu();
 
+  hashes = g_new0(char *, content->num_entries + 1);
+
   for (i = 0; i < content->num_entries; i++) {
-    if (force_archive)
-      content->entries[i]->attr = ATTRB_ARCHIVED;
-    if (force_unarchive && content->entries[i]->attr == ATTRB_ARCHIVED)
-      content->entries[i]->attr = 0;
+    /* (superseded by a later file; see plan_add_regular) */
+    if (content->entries[i]->action == ACT_SKIP) {
+      n_done++;
+      continue;
+    }
+
+    if (journal || record)
+      hashes[i] = tt_var_hash(content->entries[i]);
+
+    if (journal) {
+      e = journalled(s, content->entries[i], hashes[i]);
+      if (e == 2) {
+	g_strfreev(hashes);
+	return 2;
+      }
+      else if (e) {
+	content->entries[i]->action = ACT_SKIP;
+	n_done++;
+	continue;
+      }
+    }
 
-    e = confirm_overwrite(content->entries[i], 0);
-    if (e == 2)
+    e = confirm_overwrite(s, content->entries[i]);
+    if (e == 2) {
+      g_strfreev(hashes);
       return 2;
+    }
     else if (e)
       content->entries[i]->action = ACT_SKIP;
   }
 
+  /* nothing left to send */
+  if (n_done == content->num_entries) {
+    g_strfreev(hashes);
+    return 0;
+  }
+
+  /* (if the transfer fails, the calculator's copies are unknown) */
+  for (i = 0; i < content->num_entries; i++) {
+    if (content->entries[i]->action != ACT_SKIP)
+      tt_journal_add(record, content->entries[i], 0, "-", current_file);
+  }
+
+  item = regular_item(s, content, &total);
+  tt_progress_begin(item, total);
+  g_free(item);
+
   if (non_silent)
-    e = ticalcs_calc_send_var_ns(calc_handle,
+    e = ticalcs_calc_send_var_ns(s->calc,
 				    (final ? MODE_SEND_LAST_VAR : 0),
 				    content);
   else
-    e = ticalcs_calc_send_var(calc_handle, MODE_SEND_ONE_VAR, content);
+    e = ticalcs_calc_send_var(s->calc, MODE_SEND_ONE_VAR, content);
+
+  tt_progress_end(e ? 1 : 0);
 
   if (e == ERROR_ABORT) {
     g_printerr("%s: transfer cancelled\n", g_get_prgname());
+    g_strfreev(hashes);
     return -1;
   }
   else if (e) {
     tt_print_error(e, "unable to send file");
+    g_strfreev(hashes);
     return 1;
   }
 
+  /* later files may contain the same variables */
+  for (i = 0; i < content->num_entries; i++) {
+    if (content->entries[i]->action != ACT_SKIP) {
+      tt_dirlist_add(s, content->entries[i]);
+      tt_journal_add(journal, content->entries[i],
+		     content->entries[i]->size, hashes[i], current_file);
+      tt_journal_add(record, content->entries[i],
+		     content->entries[i]->size, hashes[i], current_file);
+    }
+  }
+
+  g_strfreev(hashes);
   return 0;
 }
 
-static int send_app(FlashContent *content)
+static int send_app(TTSession *s, FlashContent *content)
 {
   VarEntry tmpve;
+  char *hash = NULL, *item;
   int e;
 
   link_menu_ok = 0;
 
-  tmpve.type = content->data_type;
-  strncpy(tmpve.name, content->name, sizeof(tmpve.name));
+  flash_ve(content, &tmpve);
 
-  e = confirm_overwrite(&tmpve, 1);
-  if (e == 2)
-    return 2;
-  else if (e)
-    return 0;
+  if (journal || record)
+    hash = tt_flash_hash(content);
+
+  if (journal) {
+    if ((e = journalled(s, &tmpve, hash))) {
+      g_free(hash);
+      return (e == 2 ? 2 : 0);
+    }
+  }
+
+  e = confirm_overwrite(s, &tmpve);
+  if (e) {
+    g_free(hash);
+    return (e == 2 ? 2 : 0);
+  }
   
-  if ((e = ticalcs_calc_send_app(calc_handle, content))) {
+  tt_journal_add(record, &tmpve, 0, "-", current_file);
+
+  item = tt_format_varname(s, &tmpve);
+  tt_progress_begin(item, flash_size(content));
+  g_free(item);
+  e = ticalcs_calc_send_app(s->calc, content);
+  tt_progress_end(e ? 1 : 0);
+
+  if (e) {
     tt_print_error(e, "unable to send application");
+    g_free(hash);
     return 1;
   }
 
+  tt_dirlist_add(s, &tmpve);
+  tt_journal_add(journal, &tmpve, 0, hash, current_file);
+  tt_journal_add(record, &tmpve, 0, hash, current_file);
+  g_free(hash);
   return 0;
 }
 
-static int send_os(FlashContent *content)
+static int send_os(TTSession *s, FlashContent *content)
 {
   int e;
 
   link_menu_ok = 0;
 
-  if ((e = ticalcs_calc_send_os(calc_handle, content))) {
+  /* (an OS clears the calculator's memory) */
+  tt_record_clear(record);
+
+  tt_progress_begin("OS", flash_size(content));
+  e = ticalcs_calc_send_os(s->calc, content);
+  tt_progress_end(e ? 1 : 0);
+
+  if (e) {
     tt_print_error(e, "unable to send OS");
     return 1;
   }
@@ -177,13 +385,17 @@ static int send_os(FlashContent *content)
   return 0;
 }
 
-static int send_cert(FlashContent *content)
+static int send_cert(TTSession *s, FlashContent *content)
 {
   int e;
 
   link_menu_ok = 0;
 
-  if ((e = ticalcs_calc_send_os(calc_handle, content))) {
+  tt_progress_begin("certificate", flash_size(content));
+  e = ticalcs_calc_send_os(s->calc, content);
+  tt_progress_end(e ? 1 : 0);
+
+  if (e) {
     tt_print_error(e, "unable to send certificate");
     return 1;
   }
@@ -191,28 +403,20 @@ static int send_cert(FlashContent *content)
   return 0;
 }
 
-static int send_flash(FlashContent *content)
-{
-  if (content->data_type == 0x23)
-    return send_os(content);
-  else if (content->data_type == 0x24)
-    return send_app(content);
-  else if (content->data_type == 0x25)
-    return send_cert(content);
-  else {
-    g_printerr("unknown Flash data type %x\n", content->data_type);
-    return 3;
-  }
-}
-
-static int send_backup(BackupContent *content)
+static int send_backup(TTSession *s, BackupContent *content)
 {
   int e;
 
   confirm_link_menu();
   link_menu_ok = 0;
 
-  if ((e = ticalcs_calc_send_backup(calc_handle, content))) {
+  tt_record_clear(record);
+
+  tt_progress_begin("backup", 0);
+  e = ticalcs_calc_send_backup(s->calc, content);
+  tt_progress_end(e ? 1 : 0);
+
+  if (e) {
     tt_print_error(e, "unable to send backup");
     return 1;
   }
@@ -220,21 +424,171 @@ static int send_backup(BackupContent *content)
   return 0;
 }
 
-static int send_tig_entry(TigEntry *entry, int final)
+/* All of the input files are read, and the transfers they contain
+   planned, before anything is sent; so an unreadable file, or more
+   than will fit in the calculator's free memory, is found before the
+   link is used.  Transfers are then sent by rank: an OS first (as
+   installing one may clear the rest), then backups, applications,
+   and archived variables, and variables in RAM last, largest first.
+   When a variable is in more than one file, only the last copy is
+   sent, as it would have replaced the others. */
+
+enum { PLAN_OS, PLAN_CERT, PLAN_BACKUP, PLAN_APP, PLAN_ARCHIVE, PLAN_RAM };
+
+/* memory used by each variable, beyond its data (an estimate) */
+#define RAM_OVERHEAD 16
+#define ARCHIVE_OVERHEAD 32
+
+typedef struct _PlanItem {
+  int rank;			/* PLAN_* */
+  int order;			/* position among the inputs */
+  char *file;			/* file it came from, for the journal */
+  FileContent *regular;
+  FlashContent *flash;
+  BackupContent *backup;
+  int owned;			/* contents are freed with the item */
+  int from_pack;		/* (regular made by tt_pack_content) */
+  int done;			/* sent (or skipped) successfully */
+  guint64 ram, archive;		/* memory needed */
+} PlanItem;
+
+typedef struct _Plan {
+  GPtrArray *items;		/* PlanItem */
+  GPtrArray *tigs;		/* TigContent, holding some items' contents */
+  GPtrArray *packs;		/* TTPack, likewise */
+  GHashTable *vars;		/* key -> VarEntry, last copy of each */
+} Plan;
+
+static void item_free(gpointer data)
+{
+  PlanItem *item = data;
+
+  if (item->owned) {
+    if (item->regular && item->from_pack)
+      tt_pack_content_free(item->regular);
+    else if (item->regular)
+      tifiles_content_delete_regular(item->regular);
+    if (item->flash)
+      tifiles_content_delete_flash(item->flash);
+    if (item->backup)
+      tifiles_content_delete_backup(item->backup);
+  }
+  g_free(item->file);
+  g_slice_free(PlanItem, item);
+}
+
+static void tig_free(gpointer data)
+{
+  tifiles_content_delete_tigroup(data);
+}
+
+static void pack_free(gpointer data)
+{
+  tt_pack_close(data);
+}
+
+static Plan * plan_new()
+{
+  Plan *plan;
+
+  plan = g_slice_new(Plan);
+  plan->items = g_ptr_array_new_with_free_func(&item_free);
+  plan->tigs = g_ptr_array_new_with_free_func(&tig_free);
+  plan->packs = g_ptr_array_new_with_free_func(&pack_free);
+  plan->vars = g_hash_table_new_full(&g_str_hash, &g_str_equal,
+				     &g_free, NULL);
+  return plan;
+}
+
+static void plan_free(Plan *plan)
+{
+  /* (items may point into the TIGroups and packs) */
+  g_ptr_array_free(plan->items, TRUE);
+  g_ptr_array_free(plan->tigs, TRUE);
+  g_ptr_array_free(plan->packs, TRUE);
+  g_hash_table_destroy(plan->vars);
+  g_slice_free(Plan, plan);
+}
+
+static PlanItem * plan_add(Plan *plan, int rank, const char *fname,
+			   int owned)
+{
+  PlanItem *item;
+
+  item = g_slice_new0(PlanItem);
+  item->rank = rank;
+  item->order = plan->items->len;
+  item->file = g_strdup(fname);
+  item->owned = owned;
+  g_ptr_array_add(plan->items, item);
+  return item;
+}
+
+static void plan_add_regular(Plan *plan, FileContent *content,
+			     const char *fname, int owned, int from_pack)
+{
+  PlanItem *item;
+  VarEntry *ve, *oldve;
+  char *key;
+  int i;
+
+  item = plan_add(plan, PLAN_RAM, fname, owned);
+  item->regular = content;
+  item->from_pack = from_pack;
+
+  for (i = 0; i < content->num_entries; i++) {
+    ve = content->entries[i];
+    if (force_archive)
+      ve->attr = ATTRB_ARCHIVED;
+    if (force_unarchive && ve->attr == ATTRB_ARCHIVED)
+      ve->attr = 0;
+
+    /* (an earlier copy would only be replaced by this one) */
+    key = tt_var_key(ve);
+    if ((oldve = g_hash_table_lookup(plan->vars, key)))
+      oldve->action = ACT_SKIP;
+    g_hash_table_replace(plan->vars, key, ve);
+  }
+}
+
+static int plan_add_flash(Plan *plan, FlashContent *content,
+			  const char *fname, int owned)
+{
+  PlanItem *item;
+  int rank;
+
+  if (content->data_type == 0x23)
+    rank = PLAN_OS;
+  else if (content->data_type == 0x24)
+    rank = PLAN_APP;
+  else if (content->data_type == 0x25)
+    rank = PLAN_CERT;
+  else {
+    g_printerr("unknown Flash data type %x\n", content->data_type);
+    if (owned)
+      tifiles_content_delete_flash(content);
+    return 3;
+  }
+
+  item = plan_add(plan, rank, fname, owned);
+  item->flash = content;
+  if (rank == PLAN_APP)
+    item->archive = flash_size(content);
+  return 0;
+}
+
+static int plan_tig_entry(Plan *plan, TigEntry *entry, const char *fname)
 {
   switch (entry->type) {
   case TIFILE_SINGLE:
   case TIFILE_GROUP:
-    return send_regular(entry->content.regular, final);
+    plan_add_regular(plan, entry->content.regular, fname, 0, 0);
+    return 0;
 
   case TIFILE_FLASH:
-    return send_flash(entry->content.flash);
-
   case TIFILE_OS:
-    return send_os(entry->content.flash);
-
   case TIFILE_APP:
-    return send_app(entry->content.flash);
+    return plan_add_flash(plan, entry->content.flash, fname, 0);
 
   default:
     g_printerr("unknown tig data type\n");
@@ -242,58 +596,149 @@ static int send_tig_entry(TigEntry *entry, int final)
   }
 }
 
-static int send_file(const char *fname, int final)
+/* Plan to send an entry of a pack.  Variables are sent straight from
+   the mapped file. */
+static int plan_pack_entry(Plan *plan, TTPack *pack, const TTPackEntry *pe,
+			   const char *fname)
+{
+  FlashContent *flash;
+
+  if (pe->kind == TT_PACK_VAR) {
+    plan_add_regular(plan, tt_pack_content(pack, pe), fname, 1, 1);
+    return 0;
+  }
+  else if ((flash = tt_pack_flash_content(pack, pe)))
+    return plan_add_flash(plan, flash, fname, 1);
+  else
+    return 3;
+}
+
+/* Plan to send the variables in a pack, or only those named SELECT
+   (NAME or FOLDER/NAME, in UTF-8) */
+static int plan_pack(Plan *plan, TTPack *pack, const char *fname,
+		     const char *select)
+{
+  TTPackEntry pe;
+  char *folder = NULL, *name;
+  const char *p;
+  int i, n, status = 0;
+
+  g_ptr_array_add(plan->packs, pack);
+  n = tt_pack_count(pack);
+
+  if (!select) {
+    for (i = 0; !status && i < n; i++) {
+      if (tt_pack_entry(pack, i, &pe)) {
+	g_printerr("%s: %s: file is damaged\n", g_get_prgname(), fname);
+	return 3;
+      }
+      status = plan_pack_entry(plan, pack, &pe, fname);
+    }
+    return status;
+  }
+
+  if ((p = strchr(select, '/'))) {
+    name = g_strndup(select, p - select);
+    folder = tt_utf8_to_ti(tt_pack_model(pack), name);
+    g_free(name);
+    name = tt_utf8_to_ti(tt_pack_model(pack), p + 1);
+  }
+  else {
+    name = tt_utf8_to_ti(tt_pack_model(pack), select);
+  }
+
+  if ((i = tt_pack_find(pack, folder, name)) < 0) {
+    g_printerr("%s: %s: %s not found\n", g_get_prgname(), fname, select);
+    status = 3;
+  }
+
+  /* (the variable may be there with more than one type) */
+  for (; !status && i < n; i++) {
+    if (tt_pack_entry(pack, i, &pe)) {
+      g_printerr("%s: %s: file is damaged\n", g_get_prgname(), fname);
+      status = 3;
+      break;
+    }
+    if ((folder && strcmp(pe.folder, folder)) || strcmp(pe.name, name))
+      break;
+    status = plan_pack_entry(plan, pack, &pe, fname);
+  }
+
+  g_free(folder);
+  g_free(name);
+  return status;
+}
+
+/* Read a file, and add the transfers it contains to the plan */
+static int plan_file(TTSession *s, Plan *plan, const char *fname)
 {
   FileContent *regular;
   FlashContent *flash;
   BackupContent *backup;
   TigContent *tig;
+  TTPack *pack;
+  PlanItem *item;
+  char **files, *packname;
+  const char *p;
   int i, e, status = 0;
 
+  if ((files = tt_snapshot_read(fname))) {
+    for (i = 0; !status && files[i]; i++)
+      status = plan_file(s, plan, files[i]);
+    g_strfreev(files);
+    return status;
+  }
+
+  if ((pack = tt_pack_open(fname)))
+    return plan_pack(plan, pack, fname, NULL);
+
+  /* PACK:VAR names a single variable in a pack */
+  if ((p = strrchr(fname, ':')) && !g_file_test(fname, G_FILE_TEST_EXISTS)) {
+    packname = g_strndup(fname, p - fname);
+    if ((pack = tt_pack_open(packname))) {
+      status = plan_pack(plan, pack, packname, p + 1);
+      g_free(packname);
+      return status;
+    }
+    g_free(packname);
+  }
+
   if (tifiles_file_is_tigroup(fname)) {
-    tig = tifiles_content_create_tigroup(calc_model, 0);
-    if (!(e = tifiles_file_read_tigroup(fname, tig))) {
-      for (i = 0; !status && i < tig->n_vars; i++) {
-	status = send_tig_entry(tig->var_entries[i],
-				(final && i == tig->n_vars - 1
-				 && tig->n_apps == 0));
-      }
-      for (i = 0; !status && i < tig->n_apps; i++) {
-	status = send_tig_entry(tig->app_entries[i],
-				(final && i == tig->n_apps - 1));
-      }
+    tig = tifiles_content_create_tigroup(s->model, 0);
+    if ((e = tifiles_file_read_tigroup(fname, tig))) {
+      tifiles_content_delete_tigroup(tig);
+    }
+    else {
+      g_ptr_array_add(plan->tigs, tig);
+      for (i = 0; !status && i < tig->n_vars; i++)
+	status = plan_tig_entry(plan, tig->var_entries[i], fname);
+      for (i = 0; !status && i < tig->n_apps; i++)
+	status = plan_tig_entry(plan, tig->app_entries[i], fname);
     }
-    tifiles_content_delete_tigroup(tig);
   }
   else if (tifiles_file_is_regular(fname)) {
-    regular = tifiles_content_create_regular(calc_model);
-    if (!(e = tifiles_file_read_regular(fname, regular)))
-      status = send_regular(regular, final);
-    tifiles_content_delete_regular(regular);
+    regular = tifiles_content_create_regular(s->model);
+    if ((e = tifiles_file_read_regular(fname, regular)))
+      tifiles_content_delete_regular(regular);
+    else
+      plan_add_regular(plan, regular, fname, 1, 0);
   }
   else if (tifiles_file_is_backup(fname)) {
-    backup = tifiles_content_create_backup(calc_model);
-    if (!(e = tifiles_file_read_backup(fname, backup)))
-      status = send_backup(backup);
-    tifiles_content_delete_backup(backup);
-  }
-  else if (tifiles_file_is_os(fname)) {
-    flash = tifiles_content_create_flash(calc_model);
-    if (!(e = tifiles_file_read_flash(fname, flash)))
-      e = send_os(flash);
-    tifiles_content_delete_flash(flash);
-  }
-  else if (tifiles_file_is_app(fname)) {
-    flash = tifiles_content_create_flash(calc_model);
-    if (!(e = tifiles_file_read_flash(fname, flash)))
-      e = send_app(flash);
-    tifiles_content_delete_flash(flash);
+    backup = tifiles_content_create_backup(s->model);
+    if ((e = tifiles_file_read_backup(fname, backup))) {
+      tifiles_content_delete_backup(backup);
+    }
+    else {
+      item = plan_add(plan, PLAN_BACKUP, fname, 1);
+      item->backup = backup;
+    }
   }
   else if (tifiles_file_is_flash(fname)) {
-    flash = tifiles_content_create_flash(calc_model);
-    if (!(e = tifiles_file_read_flash(fname, flash)))
-      e = send_flash(flash);
-    tifiles_content_delete_flash(flash);
+    flash = tifiles_content_create_flash(s->model);
+    if ((e = tifiles_file_read_flash(fname, flash)))
+      tifiles_content_delete_flash(flash);
+    else
+      status = plan_add_flash(plan, flash, fname, 1);
   }
   else {
     g_printerr("%s: %s: unknown file type\n", g_get_prgname(), fname);
@@ -308,29 +753,350 @@ static int send_file(const char *fname, int final)
   return status;
 }
 
-int main(int argc, char **argv)
+/* Work out how much memory each variable transfer needs, and where */
+static void plan_sizes(Plan *plan)
+{
+  PlanItem *item;
+  VarEntry *ve;
+  guint i;
+  int j;
+
+  for (i = 0; i < plan->items->len; i++) {
+    item = g_ptr_array_index(plan->items, i);
+    if (!item->regular)
+      continue;
+
+    for (j = 0; j < item->regular->num_entries; j++) {
+      ve = item->regular->entries[j];
+      if (ve->action == ACT_SKIP)
+	continue;
+      if (ve->attr == ATTRB_ARCHIVED)
+	item->archive += ve->size + ARCHIVE_OVERHEAD;
+      else
+	item->ram += ve->size + RAM_OVERHEAD;
+    }
+
+    if (item->archive)
+      item->rank = PLAN_ARCHIVE;
+  }
+}
+
+/* Leave out of the plan the variables and applications that the
+   calculator already has (--skip-unchanged.)  Returns 0, or 2 on
+   error. */
+static int plan_skip_unchanged(TTSession *s, Plan *plan)
+{
+  PlanItem *item;
+  VarEntry tmpve, *ve;
+  char *hash;
+  guint i;
+  int j, e;
+
+  /* (after an OS or backup is sent, nothing else will be left) */
+  for (i = 0; i < plan->items->len; i++) {
+    item = g_ptr_array_index(plan->items, i);
+    if (item->rank == PLAN_OS || item->rank == PLAN_BACKUP)
+      return 0;
+  }
+
+  for (i = plan->items->len; i > 0; i--) {
+    item = g_ptr_array_index(plan->items, i - 1);
+
+    if (item->rank == PLAN_APP) {
+      flash_ve(item->flash, &tmpve);
+      hash = tt_flash_hash(item->flash);
+      e = unchanged(s, &tmpve, hash, 1);
+      g_free(hash);
+      if (e == 2)
+	return 2;
+      else if (e)
+	g_ptr_array_remove_index(plan->items, i - 1);
+    }
+    else if (item->regular) {
+      for (j = 0; j < item->regular->num_entries; j++) {
+	ve = item->regular->entries[j];
+	if (ve->action == ACT_SKIP)
+	  continue;
+
+	hash = tt_var_hash(ve);
+	e = unchanged(s, ve, hash, 0);
+	g_free(hash);
+	if (e == 2)
+	  return 2;
+	else if (e)
+	  ve->action = ACT_SKIP;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Add the space used by variables and applications that will be
+   replaced to *RAM and *ARCHIVE.  Returns 0, or 2 on error. */
+static int plan_replaced(TTSession *s, Plan *plan, guint64 *ram,
+			 guint64 *archive)
+{
+  PlanItem *item;
+  VarEntry tmpve, *ve, *oldve;
+  guint i;
+  int j, n, e;
+
+  for (i = 0; i < plan->items->len; i++) {
+    item = g_ptr_array_index(plan->items, i);
+
+    if (item->rank == PLAN_APP) {
+      flash_ve(item->flash, &tmpve);
+      n = 1;
+    }
+    else if (item->regular) {
+      n = item->regular->num_entries;
+    }
+    else {
+      continue;
+    }
+
+    for (j = 0; j < n; j++) {
+      ve = (item->regular ? item->regular->entries[j] : &tmpve);
+      if (ve->action == ACT_SKIP)
+	continue;
+
+      if ((e = tt_dirlist_lookup(s, ve, &oldve))) {
+	tt_print_error(e, "unable to read directory listing");
+	return 2;
+      }
+
+      if (!oldve)
+	continue;
+      else if (item->rank == PLAN_APP)
+	*archive += oldve->size;
+      else if (oldve->attr == ATTRB_ARCHIVED)
+	*archive += oldve->size + ARCHIVE_OVERHEAD;
+      else
+	*ram += oldve->size + RAM_OVERHEAD;
+    }
+  }
+
+  return 0;
+}
+
+/* Check that the planned transfers will fit in the calculator's free
+   memory (if it can tell us how much there is.)  Returns 0 if so, or
+   an exit status. */
+static int plan_check(TTSession *s, Plan *plan)
+{
+  guint64 ram = 0, archive = 0, ram_free, flash_free;
+  PlanItem *item;
+  guint i;
+  int e, status = 0;
+
+  for (i = 0; i < plan->items->len; i++) {
+    item = g_ptr_array_index(plan->items, i);
+    ram += item->ram;
+    archive += item->archive;
+  }
+
+  if ((!ram && !archive) || tt_get_memfree(s, &ram_free, &flash_free))
+    return 0;
+
+  if ((ram_free == G_MAXUINT64 || ram <= ram_free)
+      && (flash_free == G_MAXUINT64 || archive <= flash_free))
+    return 0;
+
+  /* (variables that are replaced give up their space) */
+  if (ticalcs_calc_features(s->calc) & OPS_DIRLIST) {
+    if ((e = plan_replaced(s, plan, &ram_free, &flash_free)))
+      return e;
+  }
+
+  if (ram_free != G_MAXUINT64 && ram > ram_free) {
+    g_printerr("%s: not enough free RAM (%" G_GUINT64_FORMAT
+	       " bytes needed, %" G_GUINT64_FORMAT " available)\n",
+	       g_get_prgname(), ram, ram_free);
+    status = 4;
+  }
+
+  if (flash_free != G_MAXUINT64 && archive > flash_free) {
+    g_printerr("%s: not enough free archive memory (%" G_GUINT64_FORMAT
+	       " bytes needed, %" G_GUINT64_FORMAT " available)\n",
+	       g_get_prgname(), archive, flash_free);
+    status = 4;
+  }
+
+  if (status)
+    g_printerr("%s: nothing sent (use --no-check to try anyway)\n",
+	       g_get_prgname());
+  return status;
+}
+
+static int plan_compare(gconstpointer a, gconstpointer b)
+{
+  const PlanItem *x = *(PlanItem * const *) a;
+  const PlanItem *y = *(PlanItem * const *) b;
+
+  if (x->rank != y->rank)
+    return (x->rank - y->rank);
+  if (x->rank == PLAN_RAM && x->ram != y->ram)
+    return (x->ram > y->ram ? -1 : 1);
+  return (x->order - y->order);
+}
+
+/* Send everything in the plan that has not already been sent.  If
+   FINAL is nonzero, the last variable ends the transfer (for
+   calculators in LINK RECEIVE mode.) */
+static int plan_send(TTSession *s, Plan *plan, int final)
+{
+  PlanItem *item;
+  guint i, last = 0;
+  int status = 0;
+
+  for (i = 0; i < plan->items->len; i++) {
+    item = g_ptr_array_index(plan->items, i);
+    if (item->regular && (item->ram || item->archive))
+      last = i;
+  }
+
+  for (i = 0; !status && i < plan->items->len; i++) {
+    item = g_ptr_array_index(plan->items, i);
+    if (item->done)
+      continue;
+
+    current_file = item->file;
+
+    switch (item->rank) {
+    case PLAN_OS:
+      status = send_os(s, item->flash);
+      break;
+
+    case PLAN_CERT:
+      status = send_cert(s, item->flash);
+      break;
+
+    case PLAN_BACKUP:
+      status = send_backup(s, item->backup);
+      break;
+
+    case PLAN_APP:
+      status = send_app(s, item->flash);
+      break;
+
+    default:
+      status = send_regular(s, item->regular, (final && i == last));
+    }
+
+    item->done = !status;
+  }
+
+  return status;
+}
+
+static Plan *plan;
+
+/* Read all of the input files.  With --all-devices or --broadcast,
+   this is done once, before tt_init() starts a process for each
+   device, and the processes share the contents. */
+static int read_files(TTSession *s)
 {
   int i, status = 0;
 
-  tt_init(argc, argv, app_options, 1, 0, 0);
+  plan = plan_new();
+  for (i = 0; !status && input_files && input_files[i]; i++)
+    status = plan_file(s, plan, input_files[i]);
+
+  return status;
+}
+
+/* Set up for sending to several devices: the devices' processes can't
+   all ask questions at once, so existing variables are overwritten
+   (as with -f), and the files are read once for all of them */
+static int setup_devices(TTSession *s)
+{
+  no_check_overwrite = TRUE;
+  return read_files(s);
+}
+
+int main(int argc, char **argv)
+{
+  TTSession *s;
+  int i, e, status = 0;
 
-  if (!(ticalcs_calc_features(calc_handle) & FTS_SILENT)) {
+  tt_set_device_setup(&setup_devices);
+  s = tt_init(argc, argv, app_options, 1, 0, 0);
+
+  if (retries < 0) {
+    g_printerr("%s: invalid retry count %d\n", g_get_prgname(), retries);
+    tt_exit();
+    return EXIT_INVALID_OPTIONS;
+  }
+
+  /* (--broadcast implies -f, even if only one device was found) */
+  if (broadcast)
+    no_check_overwrite = TRUE;
+
+  if (!(ticalcs_calc_features(s->calc) & FTS_SILENT)) {
     non_silent = TRUE;
     no_check_overwrite = TRUE;
   }
 
-  if (!(ticalcs_calc_features(calc_handle) & OPS_DIRLIST)) {
+  if (!(ticalcs_calc_features(s->calc) & OPS_DIRLIST)) {
     no_check_overwrite = TRUE;
   }
 
-  for (i = 0; !status && input_files && input_files[i]; i++)
-    status = send_file(input_files[i], (!input_files[i + 1] && !no_eot));
+  /* every transfer is journalled (if the listing can be checked), so
+     that it can be resumed if it fails */
+  if (ticalcs_calc_features(s->calc) & OPS_DIRLIST) {
+    journal = tt_journal_open(s, "tiput", NULL, resume);
+    record = tt_record_open(s, "tiput");
+  }
+  else if (resume || skip_unchanged) {
+    g_printerr("%s: --%s is not supported for this calculator\n",
+	       g_get_prgname(), (resume ? "resume" : "skip-unchanged"));
+    tt_exit();
+    return 10;
+  }
+
+  if (skip_unchanged && !record)
+    g_printerr("%s: warning: cannot identify calculator;"
+	       " sending everything\n", g_get_prgname());
+
+  if (!plan)
+    status = read_files(s);
+
+  if (!status && skip_unchanged)
+    status = plan_skip_unchanged(s, plan);
+
+  if (!status) {
+    plan_sizes(plan);
+    if (!no_check)
+      status = plan_check(s, plan);
+    if (!keep_order)
+      g_ptr_array_sort(plan->items, &plan_compare);
+  }
+
+  if (!status)
+    status = plan_send(s, plan, !no_eot);
+
+  /* try again, starting with the transfer that failed, once the link
+     is back in step with the calculator */
+  for (i = 1; status == 1 && i <= retries; i++) {
+    g_printerr("%s: retrying (%d of %d)\n", g_get_prgname(), i, retries);
+    tt_dirlist_changed(s);
+    if ((e = tt_session_resync(s))) {
+      tt_print_error(e, "unable to reset link");
+      break;
+    }
+    status = plan_send(s, plan, !no_eot);
+  }
+
+  plan_free(plan);
+  plan = NULL;
+  tt_journal_close(journal, status);
+  tt_journal_close(record, 1);
 
   if (status == -1) /* abort */
     status = 0;
 
-  ticalcs_dirlist_destroy(&vars_list);
-  ticalcs_dirlist_destroy(&apps_list);
+  tt_dirlist_changed(s);
   tt_exit();
   return status;
 }
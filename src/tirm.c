@@ -32,13 +32,14 @@ static const GOptionEntry app_options[] =
      &patterns, NULL, "VAR-PATTERN ..." },
    { 0, 0, 0, 0, 0, 0, 0 }};
 
-static int delete_var(VarEntry *ve)
+static int delete_var(TTSession *s, VarEntry *ve,
+		      G_GNUC_UNUSED gpointer data)
 {
   int e;
   char *name;
 
-  if ((e = ticalcs_calc_del_var(calc_handle, ve))) {
-    name = tt_format_varname(ve);
+  if ((e = ticalcs_calc_del_var(s->calc, ve))) {
+    name = tt_format_varname(s, ve);
     tt_print_error(e, "unable to delete %s", name);
     g_free(name);
     return 1;
@@ -49,12 +50,15 @@ static int delete_var(VarEntry *ve)
 
 int main(int argc, char **argv)
 {
+  TTSession *s;
   int status = 0;
 
-  tt_init(argc, argv, app_options, 1, OPS_DELVAR, 1);
+  s = tt_init(argc, argv, app_options, 1, OPS_DELVAR, 1);
 
-  if (patterns && patterns[0])
-    status = tt_globs_foreach(patterns, &delete_var);
+  if (patterns && patterns[0]) {
+    status = tt_globs_foreach(s, patterns, &delete_var, NULL);
+    tt_dirlist_changed(s);
+  }
 
   tt_exit();
   return status;
@@ -38,19 +38,21 @@ static const GOptionEntry app_options[] =
 
 int main(int argc, char **argv)
 {
+  TTSession *s;
   CalcScreenCoord sc;
   uint8_t *bitmap = NULL;
   int width, height, bpr, i, e;
   FILE *f;
 
-  tt_init(argc, argv, app_options, 0, OPS_SCREEN, 1);
+  s = tt_init(argc, argv, app_options, 0, OPS_SCREEN, 1);
+  tt_enter_output_dir();
 
   if (full_screen)
     sc.format = SCREEN_FULL;
   else
     sc.format = SCREEN_CLIPPED;
 
-  if ((e = ticalcs_calc_recv_screen(calc_handle, &sc, &bitmap))) {
+  if ((e = ticalcs_calc_recv_screen(s->calc, &sc, &bitmap))) {
     tt_print_error(e, "unable to read calculator screen");
     g_free(bitmap);
     tt_exit();
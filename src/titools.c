@@ -0,0 +1,183 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* 'titools batch' runs a script of commands over a single link.
+
+   Each line of the script is a command, such as "ls", "get 'A*' -o
+   vars", or "put prog.8xp", quoted as in the shell.  Blank lines and
+   lines beginning with '#' are ignored.  The commands are run one at
+   a time, in the same way as titoolsd runs them (see multicall.c);
+   the directory listing is shared between them through a temporary
+   file, so that it is only read again after something has changed
+   it. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+#include "titools.h"
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+static int keep_going = 0;
+static char **script_names = NULL;
+
+static const GOptionEntry app_options[] =
+  {{ "keep-going", 'k', 0, G_OPTION_ARG_NONE, &keep_going,
+     "Continue after a command fails", 0 },
+   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &script_names,
+     0, "SCRIPT" },
+   { 0, 0, 0, 0, 0, 0, 0 }};
+
+/* Run one line of the script.  Returns the command's exit status. */
+static int run_line(TTSession *s, const char *script, int lineno,
+		    const char *line)
+{
+  const TTTool *tool;
+  GError *err = NULL;
+  char **argv;
+  int argc, status;
+
+  while (g_ascii_isspace(*line))
+    line++;
+  if (!line[0] || line[0] == '#')
+    return 0;
+
+  if (!g_shell_parse_argv(line, &argc, &argv, &err)) {
+    g_printerr("%s: %s:%d: %s\n", g_get_prgname(),
+	       script, lineno, err->message);
+    g_error_free(err);
+    return EXIT_INVALID_OPTIONS;
+  }
+
+  if (!(tool = tt_find_tool(argv[0]))) {
+    g_printerr("%s: %s:%d: unknown command '%s'\n", g_get_prgname(),
+	       script, lineno, argv[0]);
+    g_strfreev(argv);
+    return EXIT_INVALID_OPTIONS;
+  }
+
+  g_free(argv[0]);
+  argv[0] = g_strdup(tool->name);
+
+  status = tt_run_tool(s, tool, argc, argv, NULL, NULL);
+
+  if (status) {
+    g_printerr("%s: %s:%d: %s failed (exit status %d)\n",
+	       g_get_prgname(), script, lineno, tool->name, status);
+
+    /* a command that failed part way through may have changed the
+       calculator without saying so */
+    g_unlink(s->dirlist_file);
+  }
+
+  g_strfreev(argv);
+  return status;
+}
+
+/* Run a script.  Returns the exit status of the first command that
+   failed, or 0 if all succeeded. */
+static int run_script(TTSession *s, const char *script)
+{
+  FILE *f;
+  char buf[4096];
+  int lineno = 0, status, result = 0;
+
+  if (!strcmp(script, "-"))
+    f = stdin;
+  else if (!(f = g_fopen(script, "r"))) {
+    g_printerr("%s: %s: %s\n", g_get_prgname(), script, g_strerror(errno));
+    return EXIT_INVALID_OPTIONS;
+  }
+
+  while (fgets(buf, sizeof(buf), f)) {
+    lineno++;
+    g_strchomp(buf);
+
+    if ((status = run_line(s, script, lineno, buf)) && !result)
+      result = status;
+    if (result && !keep_going)
+      break;
+  }
+
+  if (f != stdin)
+    fclose(f);
+  return result;
+}
+
+static void print_usage()
+{
+  g_printerr("Usage: %s batch [OPTION...] SCRIPT...\n"
+	     "Try '%s batch --help' for more information.\n",
+	     g_get_prgname(), g_get_prgname());
+  exit(EXIT_INVALID_OPTIONS);
+}
+
+int main(int argc, char **argv)
+{
+  TTSession *s;
+  GError *err = NULL;
+  char **args;
+  int fd, i, e, status = 0;
+
+  g_set_prgname("titools");
+
+  if (argc < 2 || strcmp(argv[1], "batch"))
+    print_usage();
+
+  /* parse "titools batch OPTIONS" as if it were a single program */
+  args = g_new0(char *, argc);
+  args[0] = argv[0];
+  for (i = 2; i < argc; i++)
+    args[i - 1] = argv[i];
+
+  /* the cable and calculator are found here, once; each command
+     opens the link again in its own process (see multicall.c) */
+  tt_set_link_mode(TT_LINK_BATCH);
+  s = tt_init(argc - 1, args, app_options, 1, 0, 1);
+  g_free(args);
+
+  if ((fd = g_file_open_tmp("titools-XXXXXX", &s->dirlist_file, &err)) < 0) {
+    g_printerr("%s: %s\n", g_get_prgname(), err->message);
+    g_error_free(err);
+    tt_exit();
+    return EXIT_INTERNAL_ERROR;
+  }
+  close(fd);
+  g_unlink(s->dirlist_file);
+
+  for (i = 0; script_names[i]; i++) {
+    if ((e = run_script(s, script_names[i])) && !status)
+      status = e;
+    if (status && !keep_going)
+      break;
+  }
+
+  g_unlink(s->dirlist_file);
+  g_strfreev(script_names);
+  tt_exit();
+  return status;
+}
@@ -25,22 +25,248 @@
 
 #define VAR_TYPE_MASK 0x3f
 
+#define EXIT_INVALID_OPTIONS 15
+#define EXIT_INTERNAL_ERROR 14
+#define EXIT_NO_CABLE_FOUND 13
+#define EXIT_CABLE_FAILED 12
+#define EXIT_NO_CALC_FOUND 11
+#define EXIT_CALC_UNSUPPORTED 10
+
+/* How tt_init() obtains its link */
+#define TT_LINK_AUTO 0		/* use titoolsd if running, else open it */
+#define TT_LINK_DIRECT 1	/* always open the link ourselves */
+#define TT_LINK_SERVED 2	/* inside titoolsd; link is already open */
+#define TT_LINK_BATCH 3		/* like DIRECT, for 'titools batch' */
+
+/* A connection to a calculator */
+typedef struct _TTSession {
+  CalcModel model;
+  CableHandle *cable;
+  CalcHandle *calc;
+  char *link_key;		/* group in the "links" cache, or NULL */
+  GNode *vars, *apps;		/* directory listing (see dirlist.c) */
+  char *dirlist_file;		/* file to share listing through, or NULL */
+  int refresh;			/* ignore cached listings (--refresh) */
+  int dirlist_partial;		/* listing has only some folders */
+  struct _TTSnapshot *snapshot;	/* listing converted for matching */
+  CableModel cable_model;	/* link closed by tt_session_detach() */
+  int port;
+} TTSession;
+
 /* common.c */
 
-extern CalcModel calc_model;
-extern CableHandle *cable_handle;
-extern CalcHandle *calc_handle;
+void tt_set_link_mode(int mode);
+void tt_link_release(TTSession *s);
+int tt_link_reclaim(TTSession *s);
+void tt_set_device_setup(int (*setup)(TTSession *s));
+void tt_use_all_devices();
 
-void tt_init(int argc, char **argv, const GOptionEntry* options,
-	     int min_fn, CalcFeatures required_features, int silent_probe);
+TTSession * tt_init(int argc, char **argv, const GOptionEntry* options,
+		    int min_fn, CalcFeatures required_features,
+		    int silent_probe);
 
 void tt_exit();
 
+void tt_enter_output_dir();
+
+/* session.c */
+
+char * tt_link_key(CableModel cable, int port);
+TTSession * tt_session_new(CalcModel model, CableHandle *cable,
+			   CalcHandle *calc, const char *link_key);
+TTSession * tt_session_open(CableModel cable_model, int port,
+			    CalcModel model, int timeout, int *err);
+void tt_session_free(TTSession *s);
+int tt_session_resync(TTSession *s);
+void tt_session_detach(TTSession *s);
+int tt_session_attach(TTSession *s);
+
 void tt_print_error(int e, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
 
-char * tt_format_varname(const VarEntry *ve);
+char * tt_format_varname(const TTSession *s, const VarEntry *ve);
+
+int tt_get_version(TTSession *s, CalcInfos *infos);
+char * tt_calc_id(TTSession *s);
+char * tt_device_id(TTSession *s);
+int tt_get_memfree(TTSession *s, guint64 *ram, guint64 *flash);
+
+/* cache.c */
+
+char * tt_cache_filename(const char *name);
+GKeyFile * tt_cache_load(const char *name);
+void tt_cache_save(const char *name, GKeyFile *kf);
+
+/* charset.c */
+
+int tt_unichar_to_ti(CalcModel model, gunichar c);
+char * tt_utf8_to_ti(CalcModel model, const char *str);
+guint16 tt_ti_to_key(CalcModel model, int c);
+
+/* daemon.c */
+
+typedef struct _TTRequest {
+  char *tool;			/* program name (e.g. "tils") */
+  char *cwd;			/* client's working directory */
+  int argc;
+  char **argv;
+  char **env;			/* client's environment */
+  int fds[3];			/* client's stdin, stdout, stderr */
+} TTRequest;
+
+char * tt_daemon_socket_path();
+int tt_daemon_forward(int argc, char **argv);
+int tt_daemon_listen(const char *path);
+TTRequest * tt_daemon_accept(int sock, int *client);
+void tt_daemon_reply(int client, int status);
+void tt_request_free(TTRequest *req);
+
+/* progress.c */
+
+#define TT_PROGRESS_NONE 0
+#define TT_PROGRESS_BAR 1	/* progress bar on stderr */
+#define TT_PROGRESS_JSON 2	/* JSON lines on stderr */
+
+int tt_progress_mode(const char *name);
+void tt_progress_init(TTSession *s, int mode, const char *label);
+int tt_progress_enabled();
+void tt_progress_begin(const char *item, guint32 total);
+void tt_progress_end(int status);
+
+/* multicall.c */
+
+typedef struct _TTTool {
+  const char *name;		/* program name (e.g. "tils") */
+  const char *short_name;	/* name in batch scripts (e.g. "ls") */
+  int (*main)(int argc, char **argv);
+} TTTool;
+
+const TTTool * tt_find_tool(const char *name);
+int tt_run_tool(TTSession *s, const TTTool *tool, int argc, char **argv,
+		int (*setup)(gpointer data), gpointer data);
+
+/* dirlist.c */
+
+int tt_dirlist_save(const char *filename, GNode *vars, GNode *apps,
+		    const guint64 *fingerprint);
+int tt_dirlist_load(const char *filename, GNode **vars, GNode **apps,
+		    guint64 *fingerprint);
+int tt_get_dirlist(TTSession *s, GNode **vars, GNode **apps);
+void tt_dirlist_clear(TTSession *s);
+void tt_dirlist_changed(TTSession *s);
+
+/* A variable in the listing, with its names already converted */
+typedef struct _TTDirEntry {
+  VarEntry *ve;			/* the entry in the session's listing */
+  const char *name;		/* detokenized name, for matching */
+  const char *utf8_folder;	/* folder name in UTF-8, or "" */
+  const char *utf8_name;	/* variable name in UTF-8 */
+  const char *type_name;	/* type name in upper case, or NULL */
+  const char *type_fext;	/* file extension in upper case */
+} TTDirEntry;
+
+typedef struct _TTSnapshot TTSnapshot;
+
+typedef int (*TTFolderFunc)(const char *folder, gpointer data);
+
+int tt_get_dir_entries(TTSession *s, const TTDirEntry **entries, int *n);
+int tt_get_dir_entries_in(TTSession *s, TTFolderFunc want, gpointer data,
+			  const TTDirEntry **entries, int *n);
+const TTDirEntry * tt_find_dir_entry(const TTSession *s, const VarEntry *ve);
+char * tt_var_key(const VarEntry *ve);
+int tt_dirlist_lookup(TTSession *s, const VarEntry *ve, VarEntry **oldve);
+void tt_dirlist_add(TTSession *s, const VarEntry *ve);
+
+/* groupfile.c */
+
+typedef struct _TTGroupWriter TTGroupWriter;
+typedef struct _TTArchive TTArchive;
+
+char * tt_group_member_name(CalcModel model, const VarEntry *ve);
+TTGroupWriter * tt_group_writer_new(CalcModel model, const char *filename);
+TTGroupWriter * tt_group_writer_new_store(CalcModel model, const char *store,
+					  const char *device);
+const char * tt_group_writer_filename(const TTGroupWriter *w);
+void tt_group_writer_set_compression(TTGroupWriter *w, int level);
+int tt_group_writer_add_regular(TTGroupWriter *w, FileContent *content);
+int tt_group_writer_add_flash(TTGroupWriter *w, FlashContent *content);
+int tt_group_writer_copy(TTGroupWriter *w, TTArchive *a, const char *name);
+int tt_group_writer_close(TTGroupWriter *w);
+
+TTArchive * tt_archive_open(const char *filename);
+void tt_archive_close(TTArchive *a);
+
+char ** tt_snapshot_read(const char *filename);
+
+typedef struct _TTPack TTPack;
+
+#define TT_PACK_VAR 0		/* variable data */
+#define TT_PACK_FILE 1		/* a single file (application) */
+
+/* An entry in a pack (see groupfile.c) */
+typedef struct _TTPackEntry {
+  int kind;
+  const char *folder;		/* names in the calculator's encoding */
+  const char *name;
+  guint8 type;
+  guint8 attr;
+  guint8 version;
+  const guint8 *data;		/* contents, within the mapped file */
+  guint32 length;
+  const guint8 *hash;		/* SHA-256 of contents (32 bytes) */
+} TTPackEntry;
+
+TTPack * tt_pack_open(const char *filename);
+void tt_pack_close(TTPack *p);
+CalcModel tt_pack_model(const TTPack *p);
+int tt_pack_count(const TTPack *p);
+int tt_pack_entry(const TTPack *p, int i, TTPackEntry *pe);
+int tt_pack_find(const TTPack *p, const char *folder, const char *name);
+FileContent * tt_pack_content(const TTPack *p, const TTPackEntry *pe);
+void tt_pack_content_free(FileContent *content);
+FlashContent * tt_pack_flash_content(const TTPack *p, const TTPackEntry *pe);
+
+/* manifest.c */
+
+typedef struct _TTManifest TTManifest;
+
+TTManifest * tt_manifest_load(TTSession *s);
+char * tt_manifest_get_archive(const TTManifest *m);
+int tt_manifest_unchanged(const TTManifest *m, const VarEntry *ve,
+			  char **member, char **hash);
+void tt_manifest_add(TTManifest *m, const VarEntry *ve, const char *member,
+		     const char *hash);
+void tt_manifest_save(TTManifest *m, const char *archive);
+void tt_manifest_free(TTManifest *m);
+
+/* journal.c */
+
+typedef struct _TTJournal TTJournal;
+
+/* A variable transferred by an earlier run */
+typedef struct _TTJournalEntry {
+  guint8 type;
+  guint32 size;			/* size as listed on the calculator */
+  char *hash;			/* SHA-256 hash of contents */
+  char *path;			/* file written or read */
+} TTJournalEntry;
+
+TTJournal * tt_journal_open(TTSession *s, const char *tool,
+			    const char *target, int resume);
+const TTJournalEntry * tt_journal_find(const TTJournal *j, const VarEntry *ve);
+void tt_journal_add(TTJournal *j, const VarEntry *ve, guint32 size,
+		    const char *hash, const char *path);
+void tt_journal_close(TTJournal *j, int keep);
+
+TTJournal * tt_record_open(TTSession *s, const char *tool);
+void tt_record_clear(TTJournal *j);
+
+char * tt_var_hash(const VarEntry *ve);
+char * tt_flash_hash(const FlashContent *fcontent);
 
 /* glob.c */
 
-int tt_globs_foreach(char **patterns, int (*func)(VarEntry *ve));
-int tt_vars_foreach(int (*func)(VarEntry *ve));
+typedef int (*TTVarFunc)(TTSession *s, VarEntry *ve, gpointer data);
+
+int tt_globs_foreach(TTSession *s, char **patterns,
+		     TTVarFunc func, gpointer data);
+int tt_vars_foreach(TTSession *s, TTVarFunc func, gpointer data);
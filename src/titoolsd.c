@@ -0,0 +1,188 @@
+/*
+ * TITools
+ *
+ * Copyright (c) 2010 Benjamin Moody
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "titools.h"
+
+#if defined(HAVE_SYS_UN_H) && defined(HAVE_FORK)
+
+#include <signal.h>
+#include <unistd.h>
+
+static char *socket_name = NULL;
+
+static const GOptionEntry app_options[] =
+  {{ "socket", 's', 0, G_OPTION_ARG_FILENAME, &socket_name,
+     "Listen on socket FILE", "FILE" },
+   { 0, 0, 0, 0, 0, 0, 0 }};
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(G_GNUC_UNUSED int sig)
+{
+  quit = 1;
+}
+
+/* Set up the child's environment to match the client's */
+static void set_environment(char **env)
+{
+  char **names, *p;
+  int i;
+
+  names = g_listenv();
+  for (i = 0; names[i]; i++)
+    g_unsetenv(names[i]);
+  g_strfreev(names);
+
+  for (i = 0; env[i]; i++) {
+    if ((p = strchr(env[i], '='))) {
+      *p = 0;
+      g_setenv(env[i], p + 1, TRUE);
+      *p = '=';
+    }
+  }
+}
+
+typedef struct {
+  TTRequest *req;
+  int sock, client;
+} ServeInfo;
+
+/* Set up the child process to act as the client */
+static int setup_child(gpointer data)
+{
+  ServeInfo *si = data;
+  TTRequest *req = si->req;
+  int i;
+
+  close(si->sock);
+  close(si->client);
+
+  for (i = 0; i < 3; i++) {
+    dup2(req->fds[i], i);
+    close(req->fds[i]);
+    req->fds[i] = -1;
+  }
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  if (chdir(req->cwd)) {
+    g_printerr("%s: %s: %s\n", req->tool, req->cwd, g_strerror(errno));
+    return EXIT_INTERNAL_ERROR;
+  }
+
+  set_environment(req->env);
+  return 0;
+}
+
+/* Run a tool on behalf of a client (in a child process that inherits
+   the open link; see multicall.c.)  Returns the tool's exit
+   status. */
+static int serve_request(TTSession *s, TTRequest *req, int sock,
+			 int client)
+{
+  const TTTool *tool;
+  ServeInfo si;
+
+  if (!(tool = tt_find_tool(req->tool)) || strcmp(tool->name, req->tool)) {
+    g_printerr("%s: unknown program '%s'\n", g_get_prgname(), req->tool);
+    return EXIT_INVALID_OPTIONS;
+  }
+
+  si.req = req;
+  si.sock = sock;
+  si.client = client;
+  return tt_run_tool(s, tool, req->argc, req->argv, &setup_child, &si);
+}
+
+int main(int argc, char **argv)
+{
+  struct sigaction sa;
+  TTSession *session;
+  TTRequest *req;
+  char *path;
+  int sock, client;
+
+  tt_set_link_mode(TT_LINK_DIRECT);
+  session = tt_init(argc, argv, app_options, 0, 0, 1);
+
+  if (socket_name)
+    path = g_strdup(socket_name);
+  else
+    path = tt_daemon_socket_path();
+
+  if (!path) {
+    g_printerr("%s: no socket specified (TITOOLS_SOCKET is empty)\n",
+	       g_get_prgname());
+    tt_exit();
+    return EXIT_INVALID_OPTIONS;
+  }
+
+  if ((sock = tt_daemon_listen(path)) < 0) {
+    g_free(path);
+    tt_exit();
+    return EXIT_INTERNAL_ERROR;
+  }
+
+  /* no SA_RESTART, so that accept() is interrupted */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &handle_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  g_printerr("%s: serving %s on %s\n", g_get_prgname(),
+	     ticalcs_model_to_string(session->model), path);
+
+  while (!quit) {
+    if (!(req = tt_daemon_accept(sock, &client)))
+      continue;
+
+    tt_daemon_reply(client, serve_request(session, req, sock, client));
+    close(client);
+    tt_request_free(req);
+  }
+
+  close(sock);
+  unlink(path);
+  g_free(path);
+  g_free(socket_name);
+  tt_exit();
+  return 0;
+}
+
+#else /* !HAVE_SYS_UN_H || !HAVE_FORK */
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv)
+{
+  g_printerr("titoolsd: not supported on this system\n");
+  return EXIT_INTERNAL_ERROR;
+}
+
+#endif